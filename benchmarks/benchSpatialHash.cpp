@@ -0,0 +1,307 @@
+#include <benchmark/benchmark.h>
+#include "SpatialHash.h"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Arguments are ints so cell sizes and radii are given in tenths of a unit, the dimension is
+// the half width of the box the points are spread over just like NGLScene::m_dim.
+// Run SpatialHashBench --benchmark_out=bench.json --benchmark_out_format=json (or build the
+// SpatialHashBenchJson target) and compare the files from two builds with benchmark's compare.py
+
+namespace
+{
+enum class Distribution { Uniform, Clustered };
+
+constexpr const char* storageName(SpatialHash::Storage storage)
+{
+  switch(storage)
+  {
+    case SpatialHash::Storage::HashMap : return "HashMap";
+    case SpatialHash::Storage::CellSorted : return "CellSorted";
+    case SpatialHash::Storage::CellSortedSoA : return "CellSortedSoA";
+  }
+  return "";
+}
+
+/// @brief the points for a distribution, count and box are made once and shared by every run.
+/// Clustered points are gaussian blobs round 16 random centres so most cells are empty and a
+/// few are crowded, the case the uniform spread never hits
+const std::vector<Vec3f>& points(Distribution distribution, size_t numPoints, float dim)
+{
+  static std::map<std::tuple<Distribution, size_t, float>, std::vector<Vec3f>> cache;
+  auto& pts = cache[{distribution, numPoints, dim}];
+  if(!pts.empty())
+  {
+    return pts;
+  }
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<float> box(-dim, dim);
+  pts.reserve(numPoints);
+  if(distribution == Distribution::Uniform)
+  {
+    for(size_t i = 0; i < numPoints; ++i)
+    {
+      pts.emplace_back(box(rng), box(rng), box(rng));
+    }
+  }
+  else
+  {
+    constexpr size_t numClusters = 16;
+    std::vector<Vec3f> centres;
+    for(size_t c = 0; c < numClusters; ++c)
+    {
+      centres.emplace_back(box(rng), box(rng), box(rng));
+    }
+    std::normal_distribution<float> spread(0.0f, dim / 16.0f);
+    for(size_t i = 0; i < numPoints; ++i)
+    {
+      auto& c = centres[i % numClusters];
+      pts.emplace_back(std::clamp(c.m_x + spread(rng), -dim, dim),
+                       std::clamp(c.m_y + spread(rng), -dim, dim),
+                       std::clamp(c.m_z + spread(rng), -dim, dim));
+    }
+  }
+  return pts;
+}
+
+/// @brief query centres are taken from the points themselves so clustered queries land where
+/// the data is
+std::vector<Vec3f> centres(const std::vector<Vec3f>& pts, size_t count)
+{
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<size_t> pick(0, pts.size() - 1);
+  std::vector<Vec3f> result(count);
+  for(auto& c : result)
+  {
+    c = pts[pick(rng)];
+  }
+  return result;
+}
+
+struct Setup
+{
+  SpatialHash::Storage storage;
+  Distribution distribution;
+  size_t numPoints;
+  float dim;
+  float cellSize;
+  float radius;
+};
+
+Setup setup(benchmark::State& state, bool withRadius)
+{
+  Setup s;
+  s.storage = static_cast<SpatialHash::Storage>(state.range(0));
+  s.distribution = static_cast<Distribution>(state.range(1));
+  s.numPoints = static_cast<size_t>(state.range(2));
+  s.dim = static_cast<float>(state.range(3));
+  s.cellSize = state.range(4) / 10.0f;
+  s.radius = withRadius ? state.range(5) / 10.0f : 0.0f;
+  state.SetLabel(std::string(storageName(s.storage)) +
+                 (s.distribution == Distribution::Uniform ? " uniform" : " clustered"));
+  return s;
+}
+
+void BM_Build(benchmark::State& state)
+{
+  auto s = setup(state, false);
+  auto& pts = points(s.distribution, s.numPoints, s.dim);
+  SpatialHash hash(s.cellSize, s.storage, SpatialHash::CellKey::Packed);
+  for(auto _ : state)
+  {
+    hash.build(pts);
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * s.numPoints));
+  state.counters["cells"] = static_cast<double>(hash.cellStats().cells);
+  state.counters["allocs"] = static_cast<double>(hash.allocationsLastBuild());
+}
+
+void BM_Insert(benchmark::State& state)
+{
+  auto s = setup(state, false);
+  auto& pts = points(s.distribution, s.numPoints, s.dim);
+  SpatialHash hash(s.cellSize, s.storage, SpatialHash::CellKey::Packed);
+  for(auto _ : state)
+  {
+    hash.clear();
+    for(auto& p : pts)
+    {
+      hash.insert(p);
+    }
+    hash.commit();
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * s.numPoints));
+}
+
+// producers share one hash through insertConcurrent, each pool worker inserts its chunks of the
+// points one at a time or, batched, with one claim per chunk. The commit is timed as well
+void BM_InsertConcurrent(benchmark::State& state)
+{
+  auto storage = static_cast<SpatialHash::Storage>(state.range(0));
+  auto numPoints = static_cast<size_t>(state.range(1));
+  auto numThreads = static_cast<size_t>(state.range(2));
+  bool batched = state.range(3) != 0;
+  auto& pts = points(Distribution::Uniform, numPoints, 60.0f);
+  ThreadPool pool(numThreads);
+  SpatialHash hash(1.0f, storage, SpatialHash::CellKey::Packed);
+  hash.setBuildPool(&pool);
+  for(auto _ : state)
+  {
+    hash.clear();
+    hash.reserveConcurrent(numPoints);
+    pool.parallelFor(numPoints, [&](size_t begin, size_t end, size_t)
+    {
+      if(batched)
+      {
+        hash.insertConcurrent(pts.data() + begin, end - begin);
+        return;
+      }
+      for(size_t i = begin; i < end; ++i)
+      {
+        hash.insertConcurrent(pts[i]);
+      }
+    }, 4096);
+    hash.commit();
+    benchmark::ClobberMemory();
+  }
+  state.SetLabel(std::string(storageName(storage)) + (batched ? " batched" : " per point"));
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * numPoints));
+}
+
+constexpr size_t numCentres = 1024;
+
+void BM_Query(benchmark::State& state)
+{
+  auto s = setup(state, true);
+  auto& pts = points(s.distribution, s.numPoints, s.dim);
+  SpatialHash hash(s.cellSize, s.storage, SpatialHash::CellKey::Packed);
+  hash.build(pts);
+  auto queries = centres(pts, numCentres);
+  std::vector<uint32_t> found;
+  size_t next = 0;
+  size_t total = 0;
+  for(auto _ : state)
+  {
+    found.clear();
+    hash.queryIndices(queries[next], s.radius, found);
+    total += found.size();
+    next = (next + 1) % numCentres;
+    benchmark::DoNotOptimize(found.data());
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+  state.counters["found"] = benchmark::Counter(static_cast<double>(total), benchmark::Counter::kAvgIterations);
+}
+
+void BM_QueryBatch(benchmark::State& state)
+{
+  auto s = setup(state, true);
+  auto& pts = points(s.distribution, s.numPoints, s.dim);
+  SpatialHash hash(s.cellSize, s.storage, SpatialHash::CellKey::Packed);
+  hash.build(pts);
+  auto queries = centres(pts, numCentres);
+  SpatialHash::BatchResult result;
+  result.withPoints = false;
+  for(auto _ : state)
+  {
+    hash.queryBatch(queries, s.radius, result);
+    benchmark::DoNotOptimize(result.indices.data());
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * numCentres));
+  state.counters["found"] = static_cast<double>(result.indices.size()) / numCentres;
+}
+
+// segments of a fixed length in random directions from the query centres, probed with the DDA
+// walk of querySegment or, as before it, with a sphere query round the midpoint enclosing them
+void BM_QuerySegment(benchmark::State& state)
+{
+  auto storage = static_cast<SpatialHash::Storage>(state.range(0));
+  auto numPoints = static_cast<size_t>(state.range(1));
+  float length = state.range(2) / 10.0f;
+  float thickness = state.range(3) / 10.0f;
+  bool sphere = state.range(4) != 0;
+  auto& pts = points(Distribution::Uniform, numPoints, 60.0f);
+  SpatialHash hash(1.0f, storage, SpatialHash::CellKey::Packed);
+  hash.build(pts);
+  auto starts = centres(pts, numCentres);
+  std::vector<Vec3f> ends(numCentres);
+  std::mt19937 rng(7);
+  std::normal_distribution<float> gauss;
+  for(size_t i = 0; i < numCentres; ++i)
+  {
+    Vec3f d(gauss(rng), gauss(rng), gauss(rng));
+    float scale = length / std::max(1e-6f, std::sqrt(d.m_x * d.m_x + d.m_y * d.m_y + d.m_z * d.m_z));
+    ends[i] = Vec3f(starts[i].m_x + d.m_x * scale, starts[i].m_y + d.m_y * scale, starts[i].m_z + d.m_z * scale);
+  }
+  std::vector<uint32_t> found;
+  size_t next = 0;
+  size_t total = 0;
+  for(auto _ : state)
+  {
+    found.clear();
+    const Vec3f& a = starts[next];
+    const Vec3f& b = ends[next];
+    if(sphere)
+    {
+      Vec3f mid((a.m_x + b.m_x) / 2, (a.m_y + b.m_y) / 2, (a.m_z + b.m_z) / 2);
+      hash.queryIndices(mid, length / 2 + thickness, found);
+    }
+    else
+    {
+      hash.querySegment(a, b, thickness, found);
+    }
+    total += found.size();
+    next = (next + 1) % numCentres;
+    benchmark::DoNotOptimize(found.data());
+  }
+  state.SetLabel(std::string(storageName(storage)) + (sphere ? " midpoint sphere" : " segment"));
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+  state.counters["found"] = benchmark::Counter(static_cast<double>(total), benchmark::Counter::kAvgIterations);
+}
+
+// storage, distribution, points, dim, cell size in tenths
+void buildArgs(benchmark::internal::Benchmark* b)
+{
+  b->ArgNames({"storage", "clustered", "points", "dim", "cellTenths"});
+  b->ArgsProduct({{0, 1, 2}, {0, 1}, {1000, 10000, 100000, 1000000}, {10, 60}, {5, 10, 20}});
+  b->Unit(benchmark::kMillisecond);
+}
+
+// as above plus the radius in tenths
+void queryArgs(benchmark::internal::Benchmark* b)
+{
+  b->ArgNames({"storage", "clustered", "points", "dim", "cellTenths", "radiusTenths"});
+  b->ArgsProduct({{0, 1, 2}, {0, 1}, {1000, 10000, 100000, 1000000}, {10, 60}, {5, 10, 20}, {5, 10, 20}});
+  b->Unit(benchmark::kMicrosecond);
+}
+// storage, points, length and thickness in tenths, midpoint sphere instead of the walk
+void segmentArgs(benchmark::internal::Benchmark* b)
+{
+  b->ArgNames({"storage", "points", "lengthTenths", "thicknessTenths", "sphere"});
+  b->ArgsProduct({{0, 1, 2}, {100000, 1000000}, {20, 100, 400}, {0, 5, 20}, {0, 1}});
+  b->Unit(benchmark::kMicrosecond);
+}
+// storage, points, producer threads, batched
+void concurrentArgs(benchmark::internal::Benchmark* b)
+{
+  b->ArgNames({"storage", "points", "threads", "batched"});
+  b->ArgsProduct({{0, 1, 2}, {100000, 1000000}, {1, 2, 4, 8, 16, 32, 64}, {0, 1}});
+  b->Unit(benchmark::kMillisecond);
+  b->UseRealTime();
+}
+} // end namespace
+
+BENCHMARK(BM_Build)->Apply(buildArgs);
+BENCHMARK(BM_Insert)->Apply(buildArgs);
+BENCHMARK(BM_InsertConcurrent)->Apply(concurrentArgs);
+BENCHMARK(BM_Query)->Apply(queryArgs);
+BENCHMARK(BM_QueryBatch)->Apply(queryArgs);
+BENCHMARK(BM_QuerySegment)->Apply(segmentArgs);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,276 @@
+#include "SpatialHash.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Headless driver for SpatialHash, loads or generates a point set, builds the hash and times
+// a query workload so the library can be profiled with perf / VTune on machines without GL.
+
+namespace
+{
+struct Options
+{
+  std::string file;
+  std::string save;
+  std::string snapshot;
+  std::string statsFile;
+  std::string traceFile;
+  size_t numPoints = 100000;
+  float dim = 20.0f;
+  float domain = 0.0f;
+  float cellSize = 0.0f;
+  float radius = 1.0f;
+  size_t numQueries = 10000;
+  size_t k = 0;
+  int repeats = 5;
+  SpatialHash::Storage storage = SpatialHash::Storage::CellSortedSoA;
+  SpatialHash::CellKey cellKey = SpatialHash::CellKey::Packed;
+  bool reorder = false;
+  SpatialHash::Curve curve = SpatialHash::Curve::Hilbert;
+};
+
+void usage(const char* name)
+{
+  std::cout << "usage: " << name << " [options]\n"
+            << "  --points file     text file of x y z per line, # starts a comment\n"
+            << "  --random n        n uniform points in [-dim,dim]^3 when no file is given (100000)\n"
+            << "  --dim d           half width of the random box (20)\n"
+            << "  --cell size       cell size, 0 picks one from the radius (0)\n"
+            << "  --radius r        query radius (1)\n"
+            << "  --queries n       query centres taken from the points (10000)\n"
+            << "  --knn k           also time k nearest neighbour queries\n"
+            << "  --repeat n        runs of each timing, the best and mean are printed (5)\n"
+            << "  --storage s       hashmap, sorted or soa (soa)\n"
+            << "  --key k           hashed, packed, morton, dense or auto (packed)\n"
+            << "  --domain d        half width of the cube a dense grid covers, 0 uses the box of the points (0)\n"
+            << "  --order c         sort the points along a morton or hilbert curve before building, or none (none)\n"
+            << "  --save file       write a snapshot of the built hash\n"
+            << "  --snapshot file   map a saved snapshot instead of building, the points still give the query centres\n"
+            << "  --stats file      write the cell stats, memory use and (with SPATIALHASH_STATS) query counts as JSON\n"
+            << "  --trace file      write the build and batch phases as a Chrome trace (needs SPATIALHASH_STATS)\n";
+}
+
+bool parse(int argc, char** argv, Options& options)
+{
+  for(int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    if(arg == "--help" || arg == "-h" || i + 1 == argc)
+    {
+      return false;
+    }
+    std::string value = argv[++i];
+    if(arg == "--points") { options.file = value; }
+    else if(arg == "--save") { options.save = value; }
+    else if(arg == "--snapshot") { options.snapshot = value; }
+    else if(arg == "--stats") { options.statsFile = value; }
+    else if(arg == "--trace") { options.traceFile = value; }
+    else if(arg == "--random") { options.numPoints = std::stoul(value); }
+    else if(arg == "--dim") { options.dim = std::stof(value); }
+    else if(arg == "--domain") { options.domain = std::stof(value); }
+    else if(arg == "--cell") { options.cellSize = std::stof(value); }
+    else if(arg == "--radius") { options.radius = std::stof(value); }
+    else if(arg == "--queries") { options.numQueries = std::stoul(value); }
+    else if(arg == "--knn") { options.k = std::stoul(value); }
+    else if(arg == "--repeat") { options.repeats = std::max(1, std::stoi(value)); }
+    else if(arg == "--storage")
+    {
+      if(value == "hashmap") { options.storage = SpatialHash::Storage::HashMap; }
+      else if(value == "sorted") { options.storage = SpatialHash::Storage::CellSorted; }
+      else if(value == "soa") { options.storage = SpatialHash::Storage::CellSortedSoA; }
+      else { return false; }
+    }
+    else if(arg == "--order")
+    {
+      options.reorder = value != "none";
+      if(value == "morton") { options.curve = SpatialHash::Curve::Morton; }
+      else if(value == "hilbert") { options.curve = SpatialHash::Curve::Hilbert; }
+      else if(options.reorder) { return false; }
+    }
+    else if(arg == "--key")
+    {
+      if(value == "hashed") { options.cellKey = SpatialHash::CellKey::Hashed; }
+      else if(value == "packed") { options.cellKey = SpatialHash::CellKey::Packed; }
+      else if(value == "morton") { options.cellKey = SpatialHash::CellKey::Morton; }
+      else if(value == "dense") { options.cellKey = SpatialHash::CellKey::Dense; }
+      else if(value == "auto") { options.cellKey = SpatialHash::CellKey::Auto; }
+      else { return false; }
+    }
+    else
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool loadPoints(const std::string& file, std::vector<Vec3f>& points)
+{
+  std::ifstream in(file);
+  if(!in)
+  {
+    return false;
+  }
+  std::string line;
+  while(std::getline(in, line))
+  {
+    line = line.substr(0, line.find('#'));
+    std::istringstream values(line);
+    float x, y, z;
+    if(values >> x >> y >> z)
+    {
+      points.emplace_back(x, y, z);
+    }
+  }
+  return true;
+}
+
+/// @brief run func repeats times and print the best and mean wall time in milliseconds
+template<typename Func>
+void time(const char* name, int repeats, Func&& func)
+{
+  double best = 0.0;
+  double total = 0.0;
+  for(int r = 0; r < repeats; ++r)
+  {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    best = r == 0 ? ms : std::min(best, ms);
+    total += ms;
+  }
+  std::cout << name << " best " << best << " ms mean " << total / repeats << " ms\n";
+}
+} // end namespace
+
+int main(int argc, char** argv)
+{
+  Options options;
+  if(!parse(argc, argv, options))
+  {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::vector<Vec3f> points;
+  auto start = std::chrono::steady_clock::now();
+  if(!options.file.empty())
+  {
+    if(!loadPoints(options.file, points))
+    {
+      std::cerr << "can't read " << options.file << '\n';
+      return EXIT_FAILURE;
+    }
+  }
+  else
+  {
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> box(-options.dim, options.dim);
+    points.reserve(options.numPoints);
+    for(size_t i = 0; i < options.numPoints; ++i)
+    {
+      points.emplace_back(box(rng), box(rng), box(rng));
+    }
+  }
+  if(points.empty())
+  {
+    std::cerr << "no points\n";
+    return EXIT_FAILURE;
+  }
+  std::cout << "points " << points.size() << " in "
+            << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms\n";
+
+  // the centres are picked before any reordering so every order answers the same queries
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<size_t> pick(0, points.size() - 1);
+  std::vector<Vec3f> centres(options.numQueries);
+  for(auto& c : centres)
+  {
+    c = points[pick(rng)];
+  }
+  if(options.reorder)
+  {
+    time("order", 1, [&]
+    {
+      std::vector<uint32_t> order;
+      SpatialHash::spatialOrder(points, options.cellSize > 0.0f ? options.cellSize : options.radius, options.curve, order);
+      SpatialHash::permute(order, points);
+    });
+  }
+
+  SpatialHash hash(options.cellSize > 0.0f ? options.cellSize : 1.0f, options.storage, options.cellKey);
+  hash.setAutoCellSize(options.cellSize <= 0.0f, options.radius);
+  if(options.domain > 0.0f)
+  {
+    hash.setDomain(Vec3f(-options.domain, -options.domain, -options.domain), Vec3f(options.domain, options.domain, options.domain));
+  }
+  if(options.snapshot.empty())
+  {
+    time("build", options.repeats, [&]{ hash.build(points); });
+  }
+  else
+  {
+    bool opened = false;
+    time("open snapshot", options.repeats, [&]{ opened = hash.openSnapshot(options.snapshot); });
+    if(!opened)
+    {
+      std::cerr << "can't open snapshot " << options.snapshot << '\n';
+      return EXIT_FAILURE;
+    }
+  }
+  if(!options.save.empty() && !hash.saveSnapshot(options.save))
+  {
+    std::cerr << "can't save snapshot " << options.save << " (HashMap storage can't be saved)\n";
+    return EXIT_FAILURE;
+  }
+  auto stats = hash.cellStats();
+  std::cout << "cell size " << hash.cellSize() << " cells " << stats.cells << " max per bucket " << stats.maxBucket
+            << " allocations " << hash.allocationsLastBuild() << (hash.dense() ? " dense grid" : "") << '\n';
+
+  size_t found = 0;
+  std::vector<uint32_t> indices;
+  time("query", options.repeats, [&]
+  {
+    found = 0;
+    for(auto& c : centres)
+    {
+      indices.clear();
+      hash.queryIndices(c, options.radius, indices);
+      found += indices.size();
+    }
+  });
+  std::cout << "mean found " << static_cast<double>(found) / std::max<size_t>(1, centres.size()) << '\n';
+
+  SpatialHash::BatchResult batch;
+  batch.withPoints = false;
+  time("query batch", options.repeats, [&]{ hash.queryBatch(centres, options.radius, batch); });
+
+  SpatialHash::NeighbourList neighbours;
+  time("neighbour list", options.repeats, [&]{ hash.buildNeighbourList(options.radius, neighbours); });
+  std::cout << "pairs " << neighbours.numPairs() << '\n';
+
+  if(options.k > 0)
+  {
+    SpatialHash::BatchResult nearest;
+    nearest.withPoints = false;
+    time("knn batch", options.repeats, [&]{ hash.kNearestBatch(centres.data(), centres.size(), options.k, nearest); });
+  }
+  if(!options.statsFile.empty() && !hash.writeStatsJson(options.statsFile))
+  {
+    std::cerr << "can't write stats " << options.statsFile << '\n';
+    return EXIT_FAILURE;
+  }
+  if(!options.traceFile.empty() && !hash.writeChromeTrace(options.traceFile))
+  {
+    std::cerr << "can't write trace " << options.traceFile << '\n';
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
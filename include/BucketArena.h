@@ -0,0 +1,50 @@
+#ifndef BUCKETARENA_H_
+#define BUCKETARENA_H_
+
+#include <memory_resource>
+#include <vector>
+#include <cstddef>
+
+/// @brief memory resource for the HashMap storage of SpatialHash. Memory is carved from large
+/// blocks and freed allocations go on a free list per power of two size so they are reused by the
+/// next allocation of that size. reset() makes everything available again without giving the
+/// blocks back, so rebuilds of a similar size stop touching the heap.
+class BucketArena : public std::pmr::memory_resource
+{
+public:
+  explicit BucketArena(size_t blockSize=64 * 1024, std::pmr::memory_resource* upstream=std::pmr::new_delete_resource()) noexcept;
+  ~BucketArena() override;
+  BucketArena(const BucketArena&) = delete;
+  BucketArena& operator=(const BucketArena&) = delete;
+
+  /// @brief forget every allocation, only valid once nothing allocated from here is in use. When
+  /// the last round needed more than one block they are merged into one big enough for all of it
+  void reset() noexcept;
+  /// @brief blocks taken from upstream so far
+  size_t upstreamAllocations() const noexcept { return m_upstreamAllocations; }
+  /// @brief bytes held in blocks
+  size_t capacity() const noexcept;
+
+private:
+  void* do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+  bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+  static size_t sizeClass(size_t bytes, size_t alignment) noexcept;
+  void addBlock(size_t minSize);
+  void releaseBlocks() noexcept;
+
+  struct Block { std::byte* data; size_t size; };
+  struct FreeNode { FreeNode* next; };
+  static constexpr size_t numClasses = 48;
+  /// alignment of every carved allocation, larger requests go straight to upstream
+  static constexpr size_t maxAlign = 64;
+  std::pmr::memory_resource* m_upstream;
+  size_t m_blockSize;
+  std::vector<Block> m_blocks;
+  size_t m_current = 0;
+  size_t m_offset = 0;
+  FreeNode* m_free[numClasses] = {};
+  size_t m_upstreamAllocations = 0;
+};
+
+#endif
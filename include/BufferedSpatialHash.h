@@ -0,0 +1,328 @@
+#ifndef BUFFEREDSPATIALHASH_H_
+#define BUFFEREDSPATIALHASH_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "SpatialHash.h"
+#include "ThreadPool.h"
+
+/// @brief several SpatialHash generations so readers never wait for a rebuild. Rebuilds go into a
+/// spare generation, on the caller's thread or a background builder, and the result is published
+/// with an atomic pointer swap. A generation that was current is only built into again once every
+/// reader that could have seen it has left, tracked with epochs: a reader announces the epoch it
+/// started in and each publish starts a new one. With two buffers a rebuild may wait for the
+/// readers of the generation before last, a third buffer lets back to back rebuilds go straight on
+template<typename PointT = Vec3f, int Dim = PointTraits<PointT>::dim, typename KeyT = uint64_t>
+class BasicBufferedSpatialHash
+{
+public:
+  using Hash = BasicSpatialHash<PointT, Dim, KeyT>;
+  using Scalar = typename Hash::Scalar;
+  using Storage = typename Hash::Storage;
+  using CellKey = typename Hash::CellKey;
+
+  /// @brief a reader's slot in the epoch table, get one per reading thread from reader() and keep
+  /// it. Queries through it are lock free and never wait for a rebuild
+  class Reader
+  {
+  public:
+    Reader(Reader&& other) noexcept : m_owner(other.m_owner), m_slot(other.m_slot) { other.m_slot = nullptr; }
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+    Reader& operator=(Reader&&) = delete;
+    ~Reader() { if(m_slot) { m_slot->taken.store(false, std::memory_order_release); } }
+
+    /// @brief call func(const Hash&) with the newest published generation and return what it
+    /// returns, the generation stays intact until func is done. Calls may nest
+    template<typename Func>
+    decltype(auto) read(Func&& func) const noexcept;
+    template<typename Func>
+    void forEachInRadius(const PointT& point, Scalar radius, Func&& func) const noexcept
+    {
+      read([&](const Hash& hash){ hash.forEachInRadius(point, radius, func); });
+    }
+    void queryIndices(const PointT& point, Scalar radius, std::vector<uint32_t>& result) const noexcept
+    {
+      read([&](const Hash& hash){ hash.queryIndices(point, radius, result); });
+    }
+    std::vector<PointT> query(const PointT& point, Scalar radius) const noexcept
+    {
+      return read([&](const Hash& hash){ return hash.query(point, radius); });
+    }
+
+  private:
+    friend class BasicBufferedSpatialHash;
+    struct Slot;
+    Reader(const BasicBufferedSpatialHash* owner, Slot* slot) noexcept : m_owner(owner), m_slot(slot) {}
+    const BasicBufferedSpatialHash* m_owner;
+    Slot* m_slot;
+  };
+
+  /// @brief numBuffers generations (2 or more) built on a pool of buildThreads threads, by default
+  /// one per core bar the one readers are likely running on. Up to maxReaders Readers at once
+  BasicBufferedSpatialHash(Scalar cellSize, Storage storage=Storage::CellSortedSoA, CellKey cellKey=CellKey::Packed,
+                           size_t numBuffers=3, size_t buildThreads=defaultBuildThreads(), size_t maxReaders=64) noexcept;
+  ~BasicBufferedSpatialHash();
+  BasicBufferedSpatialHash(const BasicBufferedSpatialHash&) = delete;
+  BasicBufferedSpatialHash& operator=(const BasicBufferedSpatialHash&) = delete;
+
+  /// @brief claim a reader slot, yields until one is free if all maxReaders are taken
+  Reader reader() const noexcept;
+  /// @brief build the next generation from points on this thread and publish it, concurrent
+  /// rebuilds take turns
+  void rebuild(const PointT* points, size_t numPoints) noexcept;
+  void rebuild(const std::vector<PointT>& points) noexcept;
+  /// @brief hand points to the background builder and return at once. A rebuild still waiting
+  /// to start is replaced so the builder always goes for the newest points
+  void rebuildAsync(std::vector<PointT> points) noexcept;
+  /// @brief wait for the background builder to publish everything handed to it
+  void waitForRebuilds() noexcept;
+  /// @brief applied to every generation from its next build on
+  void setAutoCellSize(bool enabled, Scalar typicalRadius=0) noexcept;
+  /// @brief the box a Dense grid covers, applied to every generation from its next build on
+  void setDomain(const PointT& lower, const PointT& upper) noexcept;
+  /// @brief generations published so far
+  uint64_t generation() const noexcept { return m_generation.load(std::memory_order_acquire); }
+  size_t numBuffers() const noexcept { return m_buffers.size(); }
+
+  static size_t defaultBuildThreads() noexcept
+  {
+    size_t cores = std::thread::hardware_concurrency();
+    return cores > 1 ? cores - 1 : 1;
+  }
+
+private:
+  struct Buffer
+  {
+    std::unique_ptr<Hash> hash;
+    /// epoch in which the buffer stopped being current, 0 while it never was
+    uint64_t retiredAt = 0;
+  };
+  /// 0 while the reader is outside read()
+  static constexpr uint64_t idle = 0;
+  std::vector<Buffer> m_buffers;
+  std::unique_ptr<typename Reader::Slot[]> m_slots;
+  size_t m_numSlots;
+  std::atomic<Hash*> m_current;
+  std::atomic<uint64_t> m_epoch{1};
+  std::atomic<uint64_t> m_generation{0};
+  size_t m_currentIndex = 0;
+  ThreadPool m_buildPool;
+  /// one rebuild at a time
+  std::mutex m_buildMutex;
+  bool m_autoCellSize = false;
+  Scalar m_typicalRadius = 0;
+  bool m_haveDomain = false;
+  PointT m_domainLower{};
+  PointT m_domainUpper{};
+  /// background builder state, guarded by m_queueMutex
+  std::thread m_builder;
+  std::mutex m_queueMutex;
+  std::condition_variable m_queueWake;
+  std::condition_variable m_queueDone;
+  std::vector<PointT> m_pending;
+  bool m_hasPending = false;
+  bool m_building = false;
+  bool m_stop = false;
+
+  /// wait until no reader is still inside an epoch before retiredAt
+  void waitForReaders(uint64_t retiredAt) const noexcept;
+  void builderLoop() noexcept;
+};
+
+template<typename PointT, int Dim, typename KeyT>
+struct BasicBufferedSpatialHash<PointT, Dim, KeyT>::Reader::Slot
+{
+  /// own cache line each so readers don't slow each other down
+  alignas(64) std::atomic<uint64_t> epoch{idle};
+  std::atomic<bool> taken{false};
+};
+
+template<typename PointT, int Dim, typename KeyT>
+BasicBufferedSpatialHash<PointT, Dim, KeyT>::BasicBufferedSpatialHash(Scalar cellSize, Storage storage, CellKey cellKey,
+                                                                      size_t numBuffers, size_t buildThreads, size_t maxReaders) noexcept :
+  m_buffers(std::max<size_t>(numBuffers, 2)),
+  m_slots(std::make_unique<typename Reader::Slot[]>(std::max<size_t>(maxReaders, 1))),
+  m_numSlots(std::max<size_t>(maxReaders, 1)),
+  m_buildPool(buildThreads)
+{
+  for(auto& buffer : m_buffers)
+  {
+    buffer.hash = std::make_unique<Hash>(cellSize, storage, cellKey);
+    buffer.hash->setBuildPool(&m_buildPool);
+  }
+  // readers see an empty hash until the first rebuild is published
+  m_current.store(m_buffers[0].hash.get(), std::memory_order_release);
+}
+
+template<typename PointT, int Dim, typename KeyT>
+BasicBufferedSpatialHash<PointT, Dim, KeyT>::~BasicBufferedSpatialHash()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_queueMutex);
+    m_stop = true;
+  }
+  m_queueWake.notify_all();
+  if(m_builder.joinable())
+  {
+    m_builder.join();
+  }
+}
+
+template<typename PointT, int Dim, typename KeyT>
+auto BasicBufferedSpatialHash<PointT, Dim, KeyT>::reader() const noexcept -> Reader
+{
+  while(true)
+  {
+    for(size_t s = 0; s < m_numSlots; ++s)
+    {
+      bool expected = false;
+      if(m_slots[s].taken.compare_exchange_strong(expected, true, std::memory_order_acquire))
+      {
+        return Reader(this, &m_slots[s]);
+      }
+    }
+    std::this_thread::yield();
+  }
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Func>
+decltype(auto) BasicBufferedSpatialHash<PointT, Dim, KeyT>::Reader::read(Func&& func) const noexcept
+{
+  // announce the epoch before loading the pointer, a writer that publishes after the load
+  // starts a later epoch and so waits for this reader before reusing the generation
+  bool outer = m_slot->epoch.load(std::memory_order_relaxed) == idle;
+  if(outer)
+  {
+    m_slot->epoch.store(m_owner->m_epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+  }
+  struct Leave
+  {
+    Slot* slot;
+    bool outer;
+    ~Leave() { if(outer) { slot->epoch.store(idle, std::memory_order_release); } }
+  } leave{m_slot, outer};
+  const Hash& hash = *m_owner->m_current.load(std::memory_order_seq_cst);
+  return func(hash);
+}
+
+template<typename PointT, int Dim, typename KeyT>
+void BasicBufferedSpatialHash<PointT, Dim, KeyT>::waitForReaders(uint64_t retiredAt) const noexcept
+{
+  for(size_t s = 0; s < m_numSlots; ++s)
+  {
+    uint64_t epoch;
+    while((epoch = m_slots[s].epoch.load(std::memory_order_seq_cst)) != idle && epoch < retiredAt)
+    {
+      std::this_thread::yield();
+    }
+  }
+}
+
+template<typename PointT, int Dim, typename KeyT>
+void BasicBufferedSpatialHash<PointT, Dim, KeyT>::rebuild(const std::vector<PointT>& points) noexcept
+{
+  rebuild(points.data(), points.size());
+}
+
+template<typename PointT, int Dim, typename KeyT>
+void BasicBufferedSpatialHash<PointT, Dim, KeyT>::rebuild(const PointT* points, size_t numPoints) noexcept
+{
+  std::lock_guard<std::mutex> lock(m_buildMutex);
+  // the spare retired longest ago is the one its readers are most likely to have left
+  size_t next = m_currentIndex == 0 ? 1 : 0;
+  for(size_t b = 0; b < m_buffers.size(); ++b)
+  {
+    if(b != m_currentIndex && m_buffers[b].retiredAt < m_buffers[next].retiredAt)
+    {
+      next = b;
+    }
+  }
+  waitForReaders(m_buffers[next].retiredAt);
+  Hash& hash = *m_buffers[next].hash;
+  hash.setAutoCellSize(m_autoCellSize, m_typicalRadius);
+  if(m_haveDomain)
+  {
+    hash.setDomain(m_domainLower, m_domainUpper);
+  }
+  hash.build(points, numPoints);
+  m_current.store(&hash, std::memory_order_seq_cst);
+  // readers from here on may see the new generation, the old one is retired in the new epoch
+  m_buffers[m_currentIndex].retiredAt = m_epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+  m_currentIndex = next;
+  m_generation.fetch_add(1, std::memory_order_release);
+}
+
+template<typename PointT, int Dim, typename KeyT>
+void BasicBufferedSpatialHash<PointT, Dim, KeyT>::rebuildAsync(std::vector<PointT> points) noexcept
+{
+  {
+    std::lock_guard<std::mutex> lock(m_queueMutex);
+    m_pending = std::move(points);
+    m_hasPending = true;
+    if(!m_builder.joinable())
+    {
+      m_builder = std::thread([this]{ builderLoop(); });
+    }
+  }
+  m_queueWake.notify_one();
+}
+
+template<typename PointT, int Dim, typename KeyT>
+void BasicBufferedSpatialHash<PointT, Dim, KeyT>::builderLoop() noexcept
+{
+  std::vector<PointT> points;
+  std::unique_lock<std::mutex> lock(m_queueMutex);
+  while(true)
+  {
+    m_queueWake.wait(lock, [this]{ return m_hasPending || m_stop; });
+    if(m_stop)
+    {
+      return;
+    }
+    // swapping hands the last batch's memory back for the next rebuildAsync to fill
+    std::swap(points, m_pending);
+    m_hasPending = false;
+    m_building = true;
+    lock.unlock();
+    rebuild(points);
+    lock.lock();
+    m_building = false;
+    m_queueDone.notify_all();
+  }
+}
+
+template<typename PointT, int Dim, typename KeyT>
+void BasicBufferedSpatialHash<PointT, Dim, KeyT>::waitForRebuilds() noexcept
+{
+  std::unique_lock<std::mutex> lock(m_queueMutex);
+  m_queueDone.wait(lock, [this]{ return !m_hasPending && !m_building; });
+}
+
+template<typename PointT, int Dim, typename KeyT>
+void BasicBufferedSpatialHash<PointT, Dim, KeyT>::setAutoCellSize(bool enabled, Scalar typicalRadius) noexcept
+{
+  std::lock_guard<std::mutex> lock(m_buildMutex);
+  m_autoCellSize = enabled;
+  m_typicalRadius = typicalRadius;
+}
+
+template<typename PointT, int Dim, typename KeyT>
+void BasicBufferedSpatialHash<PointT, Dim, KeyT>::setDomain(const PointT& lower, const PointT& upper) noexcept
+{
+  std::lock_guard<std::mutex> lock(m_buildMutex);
+  m_haveDomain = true;
+  m_domainLower = lower;
+  m_domainUpper = upper;
+}
+
+/// @brief the buffered hash of Vec3f points, compiled once in BufferedSpatialHash.cpp
+using BufferedSpatialHash = BasicBufferedSpatialHash<Vec3f>;
+extern template class BasicBufferedSpatialHash<Vec3f>;
+
+#endif
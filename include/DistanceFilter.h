@@ -0,0 +1,28 @@
+#ifndef DISTANCEFILTER_H_
+#define DISTANCEFILTER_H_
+
+#include <cstdint>
+#include <cstddef>
+
+/// @brief vectorised sphere test over structure of arrays candidates, used by the
+/// CellSortedSoA storage of SpatialHash. The kernel (AVX2, SSE2 or scalar) is picked once at
+/// runtime from what the cpu supports.
+class DistanceFilter
+{
+public:
+  /// @brief candidates a caller usually hands to filter() at once, enough to fill the vector
+  /// lanes while a stack buffer for the survivors stays small
+  static constexpr uint32_t blockSize = 64;
+
+  /// @brief write the offsets i in [0,count) with (x[i],y[i],z[i]) within sqrt(radiusSquared) of
+  /// (cx,cy,cz) to out in order and return how many there are, out needs room for count entries
+  static uint32_t filter(const float* x, const float* y, const float* z, uint32_t count,
+                         float cx, float cy, float cz, float radiusSquared, uint32_t* out) noexcept;
+  /// @brief name of the kernel in use
+  static const char* isa() noexcept;
+  /// @brief the plain C++ kernel, always available, base is added to the offsets written
+  static uint32_t scalar(const float* x, const float* y, const float* z, uint32_t count,
+                         float cx, float cy, float cz, float radiusSquared, uint32_t* out, uint32_t base=0) noexcept;
+};
+
+#endif
@@ -0,0 +1,189 @@
+#ifndef FLATCELLMAP_H_
+#define FLATCELLMAP_H_
+
+#include <memory_resource>
+#include <algorithm>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+
+/// @brief open addressing cell directory of the HashMap storage of SpatialHash. Linear probing
+/// over a power of two table kept at most half full, each slot has a one byte tag (empty, or the
+/// high bit plus seven hash bits) stored apart from the keys and values so a probe of an empty
+/// cell usually stops at the first tag and never leaves its cache line. The keys are only read
+/// when a tag matches. Erasing shifts the following run back so there are no tombstones.
+/// ValueT is a pmr container, every array and value takes its memory from the resource
+template<typename KeyT, typename ValueT>
+class FlatCellMap
+{
+public:
+  explicit FlatCellMap(std::pmr::memory_resource* resource=std::pmr::get_default_resource()) noexcept :
+    m_tags(resource), m_keys(resource), m_values(resource) {}
+
+  size_t size() const noexcept { return m_size; }
+  size_t capacity() const noexcept { return m_tags.size(); }
+  bool empty() const noexcept { return m_size == 0; }
+
+  /// @brief the value of key or nullptr
+  const ValueT* find(KeyT key) const noexcept
+  {
+    size_t slot = findSlot(key);
+    return slot == noSlot ? nullptr : &m_values[slot];
+  }
+  ValueT* find(KeyT key) noexcept
+  {
+    size_t slot = findSlot(key);
+    return slot == noSlot ? nullptr : &m_values[slot];
+  }
+  /// @brief the value of key, added empty if it isn't there
+  ValueT& operator[](KeyT key) noexcept
+  {
+    size_t slot = findSlot(key);
+    if(slot != noSlot)
+    {
+      return m_values[slot];
+    }
+    if(2 * (m_size + 1) > m_tags.size())
+    {
+      rehash(std::max<size_t>(minCapacity, 2 * m_tags.size()));
+    }
+    uint64_t h = mix(key);
+    slot = home(h);
+    while(m_tags[slot] != emptyTag)
+    {
+      slot = (slot + 1) & m_mask;
+    }
+    m_tags[slot] = tag(h);
+    m_keys[slot] = key;
+    ++m_size;
+    return m_values[slot];
+  }
+  /// @brief take key out, its value's memory goes back to the resource
+  void erase(KeyT key) noexcept
+  {
+    size_t hole = findSlot(key);
+    if(hole == noSlot)
+    {
+      return;
+    }
+    m_values[hole] = ValueT(m_values.get_allocator().resource());
+    // pull back every entry of the run after the hole that may sit there without passing its home
+    for(size_t slot = (hole + 1) & m_mask; m_tags[slot] != emptyTag; slot = (slot + 1) & m_mask)
+    {
+      size_t wanted = home(mix(m_keys[slot]));
+      if(((slot - wanted) & m_mask) >= ((slot - hole) & m_mask))
+      {
+        m_tags[hole] = m_tags[slot];
+        m_keys[hole] = m_keys[slot];
+        m_values[hole] = std::move(m_values[slot]);
+        hole = slot;
+      }
+    }
+    m_tags[hole] = emptyTag;
+    m_values[hole].clear();
+    --m_size;
+  }
+  /// @brief make room for count keys without rehashing
+  void reserve(size_t count) noexcept
+  {
+    size_t size = minCapacity;
+    while(size < 2 * count)
+    {
+      size <<= 1;
+    }
+    if(size > m_tags.size())
+    {
+      rehash(size);
+    }
+  }
+  /// @brief call func(key, value) for every entry in table order
+  template<typename Func>
+  void forEach(Func&& func) const noexcept
+  {
+    for(size_t slot = 0; slot < m_tags.size(); ++slot)
+    {
+      if(m_tags[slot] != emptyTag)
+      {
+        func(m_keys[slot], m_values[slot]);
+      }
+    }
+  }
+
+private:
+  static constexpr uint8_t emptyTag = 0;
+  static constexpr size_t minCapacity = 16;
+  static constexpr size_t noSlot = ~size_t(0);
+
+  /// Fibonacci hashing, the packed and Morton keys differ mostly in their low bits and the multiply
+  /// moves that into the high bits the home slot and tag are taken from
+  static uint64_t mix(KeyT key) noexcept { return static_cast<uint64_t>(key) * 0x9e3779b97f4a7c15ull; }
+  size_t home(uint64_t h) const noexcept { return static_cast<size_t>(h >> m_shift); }
+  uint8_t tag(uint64_t h) const noexcept { return static_cast<uint8_t>(0x80 | ((h >> (m_shift - 7)) & 0x7f)); }
+
+  size_t findSlot(KeyT key) const noexcept
+  {
+    if(m_size == 0)
+    {
+      return noSlot;
+    }
+    uint64_t h = mix(key);
+    uint8_t t = tag(h);
+    for(size_t slot = home(h);; slot = (slot + 1) & m_mask)
+    {
+      uint8_t s = m_tags[slot];
+      if(s == emptyTag)
+      {
+        return noSlot;
+      }
+      if(s == t && m_keys[slot] == key)
+      {
+        return slot;
+      }
+    }
+  }
+
+  void rehash(size_t size) noexcept
+  {
+    auto* resource = m_tags.get_allocator().resource();
+    std::pmr::vector<uint8_t> tags(size, emptyTag, resource);
+    std::pmr::vector<KeyT> keys(size, KeyT(0), resource);
+    std::pmr::vector<ValueT> values(resource);
+    values.resize(size);
+    m_tags.swap(tags);
+    m_keys.swap(keys);
+    m_values.swap(values);
+    m_mask = size - 1;
+    m_shift = 64;
+    for(size_t s = size; s > 1; s >>= 1)
+    {
+      --m_shift;
+    }
+    for(size_t old = 0; old < tags.size(); ++old)
+    {
+      if(tags[old] == emptyTag)
+      {
+        continue;
+      }
+      uint64_t h = mix(keys[old]);
+      size_t slot = home(h);
+      while(m_tags[slot] != emptyTag)
+      {
+        slot = (slot + 1) & m_mask;
+      }
+      // the tag bits sit below the home bits so they move with the table size
+      m_tags[slot] = tag(h);
+      m_keys[slot] = keys[old];
+      m_values[slot] = std::move(values[old]);
+    }
+  }
+
+  std::pmr::vector<uint8_t> m_tags;
+  std::pmr::vector<KeyT> m_keys;
+  std::pmr::vector<ValueT> m_values;
+  size_t m_size = 0;
+  size_t m_mask = 0;
+  int m_shift = 64;
+};
+
+#endif
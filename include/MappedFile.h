@@ -0,0 +1,35 @@
+#ifndef MAPPEDFILE_H_
+#define MAPPEDFILE_H_
+
+#include <cstddef>
+#include <string>
+
+/// @brief read only memory map of a whole file, used by SpatialHash to serve queries straight
+/// from a snapshot. The pages come from the OS page cache so processes mapping the same file
+/// share one copy of it
+class MappedFile
+{
+public:
+  MappedFile() noexcept = default;
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  /// @brief map path, closing whatever was mapped before. Returns false if the file can't be
+  /// opened or mapped, or is empty
+  bool open(const std::string& path) noexcept;
+  void close() noexcept;
+  bool isOpen() const noexcept { return m_data != nullptr; }
+  const std::byte* data() const noexcept { return m_data; }
+  size_t size() const noexcept { return m_size; }
+
+private:
+  const std::byte* m_data = nullptr;
+  size_t m_size = 0;
+#ifdef _WIN32
+  void* m_file = nullptr;
+  void* m_mapping = nullptr;
+#endif
+};
+
+#endif
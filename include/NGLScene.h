@@ -7,7 +7,8 @@
 #include <memory>
 #include <vector>
 #include "WindowParams.h"
-#include "SpatialHash.h"
+#include "NGLSpatialHash.h"
+#include "QueryCache.h"
 
 // this must be included after NGL includes else we get a clash with gl libs
 #include <QOpenGLWindow>
@@ -95,8 +96,12 @@ private:
     std::vector<ngl::Vec3> m_points;
     std::vector<ngl::Vec3> m_colours;
     float m_radius=5.0f;
+    /// set when the points or radius change so the next updateHash does a full build
+    bool m_rebuildHash=true;
     ngl::Vec3 m_hashPos={0,0,0};
-    std::unique_ptr<SpatialHash> m_hash;
+    std::unique_ptr<NGLSpatialHash> m_hash;
+    /// the probe is drawn every frame but only moves with the keys, so its result is cached
+    std::unique_ptr<BasicQueryCache<ngl::Vec3>> m_queryCache;
     std::unique_ptr<ngl::AbstractVAO> m_vao;
     std::unique_ptr<ngl::Text> m_text;
     bool m_showAll=true;
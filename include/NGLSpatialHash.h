@@ -0,0 +1,21 @@
+#ifndef NGLSPATIALHASH_H_
+#define NGLSPATIALHASH_H_
+
+#include <ngl/Vec3.h>
+#include "SpatialHash.h"
+
+template<>
+struct PointTraits<ngl::Vec3>
+{
+  using Scalar = float;
+  static constexpr int dim = 3;
+  static float get(const ngl::Vec3& p, int axis) noexcept { return p[static_cast<size_t>(axis)]; }
+  static ngl::Vec3 make(const std::array<float, 3>& c) noexcept { return ngl::Vec3(c[0], c[1], c[2]); }
+};
+
+/// @brief the hash of ngl::Vec3 points used by the demo, compiled once in NGLSpatialHash.cpp so
+/// the headless library never sees NGL
+using NGLSpatialHash = BasicSpatialHash<ngl::Vec3>;
+extern template class BasicSpatialHash<ngl::Vec3>;
+
+#endif
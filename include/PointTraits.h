@@ -0,0 +1,22 @@
+#ifndef POINTTRAITS_H_
+#define POINTTRAITS_H_
+
+#include <array>
+#include <cstddef>
+
+/// @brief how BasicSpatialHash reads and makes points. A specialisation gives the coordinate type
+/// Scalar, the number of coordinates dim, get(p, axis) returning one coordinate and make(c)
+/// building a point from an array of its dim coordinates
+template<typename PointT>
+struct PointTraits;
+
+template<typename T, size_t N>
+struct PointTraits<std::array<T, N>>
+{
+  using Scalar = T;
+  static constexpr int dim = static_cast<int>(N);
+  static T get(const std::array<T, N>& p, int axis) noexcept { return p[axis]; }
+  static std::array<T, N> make(const std::array<T, N>& c) noexcept { return c; }
+};
+
+#endif
@@ -0,0 +1,240 @@
+#ifndef QUERYCACHE_H_
+#define QUERYCACHE_H_
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "SpatialHash.h"
+
+/// @brief radius queries of one probe that comes back every frame, in front of a SpatialHash.
+/// The result is kept with the hash generation, the (optionally quantised) centre and the radius
+/// it was found for, and handed back as it is while none of them change. When the probe moves
+/// the cache keeps every point of the cells its box covered, drops the cells that left the box,
+/// reads only the cells that entered it and re-tests the kept points, so no cell is probed twice.
+/// A new hash generation or a box too big to keep starts over. Not thread safe, give each probe
+/// its own cache
+template<typename PointT = Vec3f, int Dim = PointTraits<PointT>::dim, typename KeyT = uint64_t>
+class BasicQueryCache
+{
+public:
+  using Hash = BasicSpatialHash<PointT, Dim, KeyT>;
+  using Scalar = typename Hash::Scalar;
+  using Cell = typename Hash::Cell;
+
+  /// @brief ids within the radius and their positions, in no particular order
+  struct Result
+  {
+    std::vector<uint32_t> ids;
+    std::vector<PointT> points;
+  };
+
+  /// @brief how each query was answered, probedCells counts the cells read from the hash
+  struct Stats
+  {
+    size_t hits = 0;
+    size_t incremental = 0;
+    size_t full = 0;
+    size_t probedCells = 0;
+  };
+
+  /// @brief with quantum above zero centres are snapped to a grid of that spacing, so a probe
+  /// jittering within one step reuses its result, which is then the one for the snapped centre.
+  /// The hash must outlive the cache
+  explicit BasicQueryCache(const Hash& hash, Scalar quantum=0) noexcept : m_hash(hash), m_quantum(quantum) {}
+
+  /// @brief the points within radius of centre, valid until the next query
+  const Result& query(const PointT& centre, Scalar radius) noexcept;
+  /// @brief forget the cached result, the next query reads every cell of its box
+  void invalidate() noexcept { m_valid = false; }
+  const Stats& stats() const noexcept { return m_stats; }
+  void resetStats() noexcept { m_stats = Stats(); }
+  /// @brief most cells a box may cover for its points to be kept, bigger boxes are queried
+  /// straight from the hash every time the centre or radius changes
+  static constexpr uint64_t maxCachedCells = 4096;
+
+private:
+  struct Candidate
+  {
+    Cell cell;
+    uint32_t id;
+    PointT position;
+  };
+  struct Box
+  {
+    Cell lo;
+    Cell hi;
+    bool contains(const Cell& c) const noexcept
+    {
+      for(int axis = 0; axis < Dim; ++axis)
+      {
+        if(c[axis] < lo[axis] || c[axis] > hi[axis])
+        {
+          return false;
+        }
+      }
+      return true;
+    }
+    uint64_t cells() const noexcept
+    {
+      uint64_t count = 1;
+      for(int axis = 0; axis < Dim; ++axis)
+      {
+        count *= static_cast<uint64_t>(static_cast<int64_t>(hi[axis]) - lo[axis] + 1);
+      }
+      return count;
+    }
+  };
+
+  PointT quantise(const PointT& centre) const noexcept;
+  /// read the cells of box that aren't in skip, or all of them without skip
+  void addCells(const Box& box, const Box* skip) noexcept;
+
+  const Hash& m_hash;
+  Scalar m_quantum;
+  bool m_valid = false;
+  /// the candidates hold every point of m_box, false for boxes over maxCachedCells
+  bool m_haveCandidates = false;
+  uint64_t m_generation = 0;
+  PointT m_centre{};
+  Scalar m_radius = 0;
+  Box m_box;
+  std::vector<Candidate> m_candidates;
+  Result m_result;
+  Stats m_stats;
+};
+
+template<typename PointT, int Dim, typename KeyT>
+PointT BasicQueryCache<PointT, Dim, KeyT>::quantise(const PointT& centre) const noexcept
+{
+  if(m_quantum <= 0)
+  {
+    return centre;
+  }
+  std::array<Scalar, PointTraits<PointT>::dim> c;
+  for(int axis = 0; axis < PointTraits<PointT>::dim; ++axis)
+  {
+    c[axis] = std::round(PointTraits<PointT>::get(centre, axis) / m_quantum) * m_quantum;
+  }
+  return PointTraits<PointT>::make(c);
+}
+
+template<typename PointT, int Dim, typename KeyT>
+void BasicQueryCache<PointT, Dim, KeyT>::addCells(const Box& box, const Box* skip) noexcept
+{
+  // the moved points are filtered once for the whole box rather than once per cell
+  m_hash.forEachMoved([&](uint32_t id, const PointT& p)
+  {
+    Cell cell = m_hash.cellOf(p);
+    if(box.contains(cell) && (skip == nullptr || !skip->contains(cell)))
+    {
+      m_candidates.push_back({cell, id, p});
+    }
+  });
+  Cell cell = box.lo;
+  while(true)
+  {
+    if(skip == nullptr || !skip->contains(cell))
+    {
+      ++m_stats.probedCells;
+      m_hash.forEachStoredInCell(cell, [&](uint32_t id, const PointT& p){ m_candidates.push_back({cell, id, p}); });
+    }
+    // odometer over the box, the last axis changing fastest like the hash's own loops
+    int axis = Dim - 1;
+    while(axis >= 0 && cell[axis] == box.hi[axis])
+    {
+      cell[axis] = box.lo[axis];
+      --axis;
+    }
+    if(axis < 0)
+    {
+      return;
+    }
+    ++cell[axis];
+  }
+}
+
+template<typename PointT, int Dim, typename KeyT>
+auto BasicQueryCache<PointT, Dim, KeyT>::query(const PointT& point, Scalar radius) noexcept -> const Result&
+{
+  PointT centre = quantise(point);
+  bool sameGeneration = m_valid && m_generation == m_hash.generation();
+  bool sameCentre = true;
+  for(int axis = 0; axis < PointTraits<PointT>::dim; ++axis)
+  {
+    sameCentre = sameCentre && PointTraits<PointT>::get(centre, axis) == PointTraits<PointT>::get(m_centre, axis);
+  }
+  if(sameGeneration && sameCentre && radius == m_radius)
+  {
+    ++m_stats.hits;
+    return m_result;
+  }
+  Box box;
+  for(int axis = 0; axis < Dim; ++axis)
+  {
+    Scalar c = PointTraits<PointT>::get(centre, axis);
+    box.lo[axis] = m_hash.hashCoord(c - radius);
+    box.hi[axis] = m_hash.hashCoord(c + radius);
+  }
+  m_result.ids.clear();
+  m_result.points.clear();
+  m_valid = true;
+  m_generation = m_hash.generation();
+  m_centre = centre;
+  m_radius = radius;
+  if(box.cells() > maxCachedCells)
+  {
+    ++m_stats.full;
+    m_haveCandidates = false;
+    m_hash.forEachInRadius(centre, radius, [&](uint32_t id, const PointT& p)
+    {
+      m_result.ids.push_back(id);
+      m_result.points.push_back(p);
+    });
+    return m_result;
+  }
+  if(sameGeneration && m_haveCandidates)
+  {
+    // keep the points of cells still in the box and read only the cells that entered it
+    ++m_stats.incremental;
+    size_t kept = 0;
+    for(const auto& c : m_candidates)
+    {
+      if(box.contains(c.cell))
+      {
+        m_candidates[kept++] = c;
+      }
+    }
+    m_candidates.resize(kept);
+    addCells(box, &m_box);
+  }
+  else
+  {
+    ++m_stats.full;
+    m_candidates.clear();
+    addCells(box, nullptr);
+  }
+  m_box = box;
+  m_haveCandidates = true;
+  Scalar radiusSquared = radius * radius;
+  for(const auto& c : m_candidates)
+  {
+    Scalar d = 0;
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      Scalar t = PointTraits<PointT>::get(c.position, axis) - PointTraits<PointT>::get(centre, axis);
+      d += t * t;
+    }
+    if(d <= radiusSquared)
+    {
+      m_result.ids.push_back(c.id);
+      m_result.points.push_back(c.position);
+    }
+  }
+  return m_result;
+}
+
+/// @brief the cache for SpatialHash, compiled once in QueryCache.cpp
+using QueryCache = BasicQueryCache<Vec3f>;
+extern template class BasicQueryCache<Vec3f>;
+
+#endif
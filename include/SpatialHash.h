@@ -2,29 +2,1515 @@
 #define SPATIALHASH_H_
 
 #include <vector>
-#include <unordered_map>
-#include <ngl/Vec3.h>
+#include <array>
+#include <cstdint>
+#include <cmath>
+#include <atomic>
+#include <memory>
+#include <memory_resource>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <string>
+#include "PointTraits.h"
+#include "Vec3f.h"
+#include "DistanceFilter.h"
+#include "BucketArena.h"
+#include "FlatCellMap.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+#include "SpatialHashStats.h"
 
-class SpatialHash 
+namespace spatialHashDetail
+{
+  /// offset a cell coordinate into bits unsigned bits
+  constexpr uint64_t packCoord(int c, int bits) noexcept
+  {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(c) + (1u << (bits - 1)))) & ((uint64_t(1) << bits) - 1);
+  }
+
+  /// spread the low 21 bits so there are two zero bits between each
+  constexpr uint64_t spreadBits(uint64_t x) noexcept
+  {
+    x = (x | x << 32) & 0x1f00000000ffffull;
+    x = (x | x << 16) & 0x1f0000ff0000ffull;
+    x = (x | x << 8) & 0x100f00f00f00f00full;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+  }
+
+  /// Morton key of any shape, bit b of axis a goes to bit b * dim + a. Kept out of line so the
+  /// key switch stays small enough to inline
+  template<typename KeyT, int Dim, int Bits>
+  KeyT interleave(const int* cell) noexcept
+  {
+    KeyT key = 0;
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      uint64_t packed = packCoord(cell[axis], Bits);
+      for(int bit = 0; bit < Bits; ++bit)
+      {
+        key |= static_cast<KeyT>((packed >> bit) & 1) << (bit * Dim + axis);
+      }
+    }
+    return key;
+  }
+
+  /// @brief position along a space filling curve of a point given by dim coordinates of bits bits
+  /// each, the highest bit of every axis first. The Hilbert form first turns the coordinates into
+  /// the transposed Hilbert index (J. Skilling, Programming the Hilbert curve, 2004) so curve
+  /// neighbours are always face neighbours, the Morton form uses them as they are
+  inline uint64_t curveKey(uint32_t* x, int dim, int bits, bool hilbert) noexcept
+  {
+    if(hilbert)
+    {
+      uint32_t top = uint32_t(1) << (bits - 1);
+      for(uint32_t q = top; q > 1; q >>= 1)
+      {
+        uint32_t p = q - 1;
+        for(int i = 0; i < dim; ++i)
+        {
+          if(x[i] & q)
+          {
+            x[0] ^= p;
+          }
+          else
+          {
+            uint32_t t = (x[0] ^ x[i]) & p;
+            x[0] ^= t;
+            x[i] ^= t;
+          }
+        }
+      }
+      for(int i = 1; i < dim; ++i)
+      {
+        x[i] ^= x[i - 1];
+      }
+      uint32_t t = 0;
+      for(uint32_t q = top; q > 1; q >>= 1)
+      {
+        if(x[dim - 1] & q)
+        {
+          t ^= q - 1;
+        }
+      }
+      for(int i = 0; i < dim; ++i)
+      {
+        x[i] ^= t;
+      }
+    }
+    uint64_t key = 0;
+    for(int bit = bits - 1; bit >= 0; --bit)
+    {
+      for(int i = 0; i < dim; ++i)
+      {
+        key = key << 1 | ((x[i] >> bit) & 1);
+      }
+    }
+    return key;
+  }
+
+  /// multipliers of the Hashed keys, the first three are the original x, y and z ones
+  constexpr uint32_t hashPrimes[] = {1u, 15485863u, 32452843u, 49979687u, 67867967u, 86028121u, 104395301u, 122949823u};
+
+  /// @brief read only array the queries go through, it points at one of the hash's vectors or
+  /// into a mapped snapshot
+  template<typename T>
+  struct ArrayView
+  {
+    const T* ptr = nullptr;
+    size_t count = 0;
+    ArrayView() noexcept = default;
+    ArrayView(const T* data, size_t size) noexcept : ptr(data), count(size) {}
+    ArrayView(const std::vector<T>& v) noexcept : ptr(v.data()), count(v.size()) {}
+    const T& operator[](size_t i) const noexcept { return ptr[i]; }
+    const T* data() const noexcept { return ptr; }
+    size_t size() const noexcept { return count; }
+    bool empty() const noexcept { return count == 0; }
+    const T* begin() const noexcept { return ptr; }
+    const T* end() const noexcept { return ptr + count; }
+  };
+
+  /// @brief first bytes of a snapshot file, the arrays follow at the 64 byte aligned offsets given
+  /// here. The sizes and the byte order mark make a file from another point type, key type or
+  /// machine fail to open instead of being misread
+  struct SnapshotHeader
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t pointSize;
+    uint32_t scalarSize;
+    uint32_t keySize;
+    uint32_t cellRecordSize;
+    int32_t dim;
+    int32_t pointDim;
+    uint8_t storage;
+    uint8_t cellKey;
+    uint8_t dense;
+    uint8_t pad;
+    uint32_t tableShift;
+    int32_t gridOrigin[8];
+    int32_t gridExtent[8];
+    double cellSize;
+    double lower[8];
+    double upper[8];
+    uint64_t numPoints;
+    uint64_t numEntries;
+    uint64_t numCellStarts;
+    uint64_t numCells;
+    uint64_t occupiedCells;
+    uint64_t fileSize;
+    uint64_t indexOffset;
+    uint64_t cellStartOffset;
+    uint64_t cellsOffset;
+    uint64_t pointsOffset;
+    uint64_t coordsOffset;
+    uint64_t coordsStride;
+  };
+  constexpr char snapshotMagic[8] = {'S', 'P', 'H', 'A', 'S', 'H', '\0', '\0'};
+  constexpr uint32_t snapshotVersion = 2;
+  constexpr uint32_t snapshotByteOrder = 0x01020304;
+  constexpr uint64_t snapshotAlign = 64;
+
+  constexpr size_t power(size_t base, int exponent) noexcept
+  {
+    return exponent == 0 ? 1 : base * power(base, exponent - 1);
+  }
+
+  /// every offset in [-reach, reach]^dim with the last axis changing fastest
+  template<int Dim, int Reach>
+  constexpr auto neighbourhood() noexcept
+  {
+    constexpr int side = 2 * Reach + 1;
+    std::array<std::array<int, Dim>, power(side, Dim)> cells{};
+    for(size_t n = 0; n < cells.size(); ++n)
+    {
+      size_t rest = n;
+      for(int a = Dim - 1; a >= 0; --a)
+      {
+        cells[n][a] = static_cast<int>(rest % side) - Reach;
+        rest /= side;
+      }
+    }
+    return cells;
+  }
+
+  /// neighbourhoods built at compile time
+  template<int Dim, int Reach>
+  inline constexpr auto stencil = neighbourhood<Dim, Reach>();
+}
+
+/// @brief spatial hash over points of type PointT read through PointTraits, hashing the first Dim
+/// coordinates into cell keys of type KeyT. SpatialHash below is the Vec3f instance
+template<typename PointT = Vec3f, int Dim = PointTraits<PointT>::dim, typename KeyT = uint64_t>
+class BasicSpatialHash
 {
 public:
-  SpatialHash(float cellSize) noexcept : m_cellSize(cellSize) {}
+  using Traits = PointTraits<PointT>;
+  using Scalar = typename Traits::Scalar;
+  static_assert(Dim >= 1 && Dim <= Traits::dim && Dim <= 8, "Dim must be between 1 and the point's dimension, at most 8");
+  static_assert(std::is_floating_point<Scalar>::value, "the point coordinates must be floating point");
+  static_assert(std::is_unsigned<KeyT>::value && sizeof(KeyT) >= 4, "KeyT must be an unsigned integer of at least 32 bits");
+  /// @brief integer coordinates of a cell
+  using Cell = std::array<int, Dim>;
+  /// @brief the first Dim coordinates of a point, used for boxes
+  using Coords = std::array<Scalar, Dim>;
+  /// @brief bits per axis in the Packed and Morton keys
+  static constexpr int keyBits = std::min<int>(32, 8 * static_cast<int>(sizeof(KeyT)) / Dim);
+
+  /// @brief how the points are stored
+  /// HashMap keeps a vector of point ids per cell in a FlatCellMap, their memory comes from a
+  /// BucketArena (or the resource passed to the constructor) which rebuilds reuse
+  /// CellSorted keeps one contiguous array sorted by cell plus a flat cell start table, built
+  /// with a counting sort in commit()
+  /// CellSortedSoA is CellSorted with one array per coordinate so the candidates of a cell are
+  /// tested several at a time, by DistanceFilter for float points in three dimensions
+  enum class Storage { HashMap, CellSorted, CellSortedSoA };
+  /// @brief how integer cell coordinates become a key
+  /// Hashed is the original prime multiply folded to 32 bits, distant cells can share a key
+  /// Packed stores each coordinate in keyBits bits of the key (21 of 64 in 3D) and Morton
+  /// interleaves those bits (Z order), both are exact for cell coordinates in
+  /// [-2^(keyBits-1), 2^(keyBits-1))
+  /// Dense indexes the cell start table of the cell sorted storages straight by the cell's place
+  /// in a grid over the domain (setDomain, else the box of the points at each build), x fastest.
+  /// A lookup is a multiply add with no hashing or probing and a row of cells along x is one run
+  /// of memory, which the radius and box queries scan in one go. Points outside the domain share
+  /// its border cells. Auto picks Dense when the grid has at most maxDenseCellsPerPoint cells per
+  /// point and Packed otherwise, HashMap storage treats both as Packed
+  enum class CellKey { Hashed, Packed, Morton, Dense, Auto };
+  /// @brief space filling curves spatialOrder can sort along
+  enum class Curve { Morton, Hilbert };
+
+  /// @brief how well the keys separate the cells, a shared bucket holds points from several cells
+  /// and wastedTests counts the candidate tests spent on points of the other cells when every
+  /// occupied cell is probed once. occupancy[0] counts the empty buckets (free slots of the HashMap
+  /// table) and occupancy[b] the buckets holding 2^(b-1) to 2^b - 1 entries, the last bin everything above
+  struct CellStats
+  {
+    size_t points = 0;
+    size_t cells = 0;
+    size_t buckets = 0;
+    size_t sharedBuckets = 0;
+    size_t maxBucket = 0;
+    size_t wastedTests = 0;
+    std::array<size_t, 24> occupancy{};
+    float meanBucket() const noexcept { return buckets ? static_cast<float>(points) / buckets : 0.0f; }
+  };
+
+  /// @brief one result of kNearest
+  struct Nearest
+  {
+    Scalar distanceSquared;
+    uint32_t id;
+    PointT position;
+  };
+
+  /// @brief the result of firstOnSegment, t is where the point projects onto the segment, 0 at a
+  /// and 1 at b, and distanceSquared its distance from there
+  struct SegmentHit
+  {
+    Scalar t;
+    Scalar distanceSquared;
+    uint32_t id;
+    PointT position;
+  };
+
+  /// @brief results of a batched query in CSR form, the neighbours of centre i are
+  /// indices[offsets[i]] .. indices[offsets[i+1]] with the matching positions in neighbours.
+  /// Reusing one BatchResult between calls keeps its memory so steady state batches don't allocate
+  struct BatchResult
+  {
+    std::vector<size_t> offsets;
+    std::vector<uint32_t> indices;
+    std::vector<PointT> neighbours;
+    /// set to false to only fill the indices
+    bool withPoints = true;
+    size_t count(size_t i) const noexcept { return offsets[i + 1] - offsets[i]; }
+    /// per thread scratch, each worker appends to its own buffer and records which run of
+    /// centres it answered so no locking is needed
+    struct Chunk { size_t begin; size_t end; size_t bufferStart; };
+    struct WorkerBuffer { std::vector<uint32_t> indices; std::vector<PointT> points; std::vector<Chunk> chunks; std::vector<Nearest> nearest; };
+    std::vector<WorkerBuffer> workers;
+  };
+
+  /// @brief every point's neighbours within a radius in CSR form, the neighbours of id i are
+  /// indices[offsets[i]] .. indices[offsets[i+1]] in increasing id order. Each pair shows up in
+  /// both rows. Reusing one NeighbourList keeps its memory between calls
+  struct NeighbourList
+  {
+    std::vector<size_t> offsets;
+    std::vector<uint32_t> indices;
+    size_t count(size_t id) const noexcept { return offsets[id + 1] - offsets[id]; }
+    size_t numPairs() const noexcept { return indices.size() / 2; }
+    /// per thread pair buffers and the per id write cursors
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> workers;
+    std::vector<uint32_t> cursor;
+  };
 
-  void insert(const ngl::Vec3& point) noexcept;
+  /// @brief bucketResource supplies the HashMap cells and map nodes, by default the hash uses its
+  /// own BucketArena which is reset on every build
+  BasicSpatialHash(Scalar cellSize, Storage storage=Storage::HashMap, CellKey cellKey=CellKey::Hashed,
+                   std::pmr::memory_resource* bucketResource=nullptr) noexcept :
+    m_cellSize(cellSize), m_storage(storage), m_cellKey(cellKey),
+    m_bucketResource(bucketResource ? bucketResource : &m_arena), m_hashTable(m_bucketResource) {}
+  /// @brief the cells refer to memory owned by the hash so it can't be copied or moved
+  BasicSpatialHash(const BasicSpatialHash&) = delete;
+  BasicSpatialHash& operator=(const BasicSpatialHash&) = delete;
+
+  /// @brief add a point and return its id, ids count up from 0 in insertion order
+  uint32_t insert(const PointT& point) noexcept;
+  /// @brief in CellSorted mode sort all pending inserts and moves into the flat cell layout, query
+  /// only sees committed points. In HashMap mode only the points of insertConcurrent are pending.
+  void commit() noexcept;
+  /// @brief make room for capacity more points from insertConcurrent, which any number of threads
+  /// may call at once until the next commit. Not thread safe itself, and insert, update, remove
+  /// and the builds must wait for that commit. Queries of the committed points can run alongside
+  void reserveConcurrent(size_t capacity) noexcept;
+  /// @brief thread safe insert into the room made by reserveConcurrent, one relaxed atomic add per
+  /// point. Returns the id or invalidId once the room is used up. The points are only seen by
+  /// queries after commit(), which must follow the producers finishing
+  uint32_t insertConcurrent(const PointT& point) noexcept;
+  /// @brief insert count points with consecutive ids claimed in one go and return the first, or
+  /// invalidId with nothing inserted if they don't all fit
+  uint32_t insertConcurrent(const PointT* points, size_t count) noexcept;
+  static constexpr uint32_t invalidId = 0xffffffff;
+  /// @brief replace the contents with points, the hashing and the grouping into cells run
+  /// across the cores of the build pool. The id of points[i] is i.
+  void build(const PointT* points, size_t numPoints) noexcept;
+  void build(const std::vector<PointT>& points) noexcept;
+  /// @brief as build but only 32 bit ids are stored, the queries read the positions from points
+  /// so it must stay alive and unchanged until the next build or clear
+  void buildIndexed(const PointT* points, size_t numPoints) noexcept;
+  void buildIndexed(const std::vector<PointT>& points) noexcept;
+  /// @brief take a point out, its id is not reused
+  void remove(uint32_t id) noexcept;
+  /// @brief move a point and return true if it changed cell, staying in its cell only stores the
+  /// new position. In the cell sorted layouts a point that changes cell leaves a dead entry and
+  /// goes on a short moved list, the layout is re-sorted once that list grows
+  bool update(uint32_t id, const PointT& position) noexcept;
+  /// @brief move points ids[i] to positions[i] in parallel, only the points changing cell touch the
+  /// cells. An id given more than once goes to its last position. Returns how many changed cell
+  size_t applyMoves(const uint32_t* ids, const PointT* positions, size_t count) noexcept;
+  /// @brief move every point, the point with id i goes to positions[i]
+  size_t applyMoves(const std::vector<PointT>& positions) noexcept;
   void debug() const noexcept;
   void clear() noexcept;
   size_t size() const noexcept;
+  /// @brief points in the hash, removed ones don't count
+  size_t numPoints() const noexcept { return m_numPoints - m_numRemoved; }
+  /// @brief ids handed out so far, one past the largest id
+  size_t numIds() const noexcept { return m_numPoints; }
+  Storage storage() const noexcept { return m_storage; }
+  CellKey cellKey() const noexcept { return m_cellKey; }
+  Scalar cellSize() const noexcept { return m_cellSize; }
+  /// @brief change the cell size, takes effect at the next build or commit
+  void setCellSize(Scalar cellSize) noexcept { m_cellSize = cellSize; }
+  /// @brief the box the Dense grid covers instead of the box of the points, for simulations with
+  /// known bounds. Takes effect at the next build or commit
+  void setDomain(const PointT& lower, const PointT& upper) noexcept;
+  /// @brief go back to covering the box of the points
+  void clearDomain() noexcept { m_haveDomain = false; }
+  /// @brief true when the last build of a cell sorted storage laid the cells out as a dense grid
+  bool dense() const noexcept { return m_dense; }
+  /// @brief most grid cells per point Auto allows, each costs one cell start
+  static constexpr uint64_t maxDenseCellsPerPoint = 4;
+  /// @brief biggest grid Dense makes, beyond it falls back to Packed
+  static constexpr uint64_t maxDenseCells = uint64_t(1) << 28;
+  /// @brief when enabled every build and commit picks the cell size with suggestCellSize from the
+  /// point count, their bounding box and typicalRadius, read the choice back with cellSize()
+  void setAutoCellSize(bool enabled, Scalar typicalRadius=0) noexcept;
+  bool autoCellSize() const noexcept { return m_autoCellSize; }
+  /// @brief cost of probing one cell measured in distance tests, used to weigh cell size choices
+  /// and to decide when a query walks the occupied cells instead of probing its range
+  static constexpr float probeCost = 4.0f;
+  /// @brief most cells across one query diameter the suggested size allows
+  static constexpr int maxCellsPerDiameter = 6;
+  /// @brief cell size minimising the probes plus candidate tests of a query of radius over
+  /// numPoints spread evenly in the box, with no radius it aims for two points per cell
+  static Scalar suggestCellSize(size_t numPoints, const PointT& boxMin, const PointT& boxMax, Scalar radius) noexcept;
+  /// @brief walk the buckets and measure the key collisions and occupancy, O(n)
+  CellStats cellStats() const noexcept;
+  /// @brief heap allocations made by the last build or commit, the growth of the hash's own arrays
+  /// plus blocks its BucketArena took. Zero once rebuilds reach a steady size. Allocations inside
+  /// a resource passed to the constructor are not seen
+  size_t allocationsLastBuild() const noexcept { return m_allocations; }
 
-  std::vector<ngl::Vec3> query(const ngl::Vec3& point, float radius) const noexcept ;
+  std::vector<PointT> query(const PointT& point, Scalar radius) const noexcept ;
+  /// @brief append the ids of the points within radius to result
+  void queryIndices(const PointT& point, Scalar radius, std::vector<uint32_t>& result) const noexcept;
+  /// @brief call func(id, position) for every point within radius, nothing is allocated
+  template<typename Func>
+  void forEachInRadius(const PointT& point, Scalar radius, Func&& func) const noexcept;
+  /// @brief call func(id, position) for every point in the box lower .. upper, faces included
+  template<typename Func>
+  void forEachInBox(const PointT& lower, const PointT& upper, Func&& func) const noexcept;
+  /// @brief append the ids of the points in the box lower .. upper to result
+  void queryBox(const PointT& lower, const PointT& upper, std::vector<uint32_t>& result) const noexcept;
+  /// @brief call func(id, position) for every point within thickness of the segment a .. b. Only
+  /// the cells the segment crosses are probed, grown by the cells thickness reaches, found with a
+  /// 3D-DDA (Amanatides and Woo) walk from a towards b that is clipped to the box of the points.
+  /// A func returning bool ends the query by returning false, e.g. once anything is hit. Segments
+  /// long against the data walk the occupied cells instead, in no particular order
+  template<typename Func>
+  void forEachOnSegment(const PointT& a, const PointT& b, Scalar thickness, Func&& func) const noexcept;
+  /// @brief append the ids of the points within thickness of the segment a .. b to result
+  void querySegment(const PointT& a, const PointT& b, Scalar thickness, std::vector<uint32_t>& result) const noexcept;
+  /// @brief the point within thickness of the segment a .. b projecting closest to a, for picking
+  /// and line of sight. The walk stops once no cell ahead can hold a closer one. False on a miss
+  bool firstOnSegment(const PointT& a, const PointT& b, Scalar thickness, SegmentHit& hit) const noexcept;
+  /// @brief query numCentres centres across the cores, with one shared radius or one radius per centre
+  void queryBatch(const PointT* centres, size_t numCentres, Scalar radius, BatchResult& result) const noexcept;
+  void queryBatch(const PointT* centres, size_t numCentres, const Scalar* radii, BatchResult& result) const noexcept;
+  void queryBatch(const std::vector<PointT>& centres, Scalar radius, BatchResult& result) const noexcept;
+  /// @brief write the k points closest to point to out (room for k) nearest first and return how
+  /// many there are, fewer than k only if the hash holds fewer points. Cells are searched in
+  /// shells around the point's cell until no unvisited cell can hold anything closer, the
+  /// candidates are kept in a max heap in out so nothing is allocated
+  size_t kNearest(const PointT& point, size_t k, Nearest* out) const noexcept;
+  std::vector<Nearest> kNearest(const PointT& point, size_t k) const noexcept;
+  /// @brief kNearest for each centre across the cores, the neighbours of centre i are nearest first
+  void kNearestBatch(const PointT* centres, size_t numCentres, size_t k, BatchResult& result) const noexcept;
+  /// @brief call func(a, b, positionA, positionB) once for every unordered pair of points within
+  /// radius. Each cell is only paired with the forward half of its neighbours so no pair is
+  /// tested twice
+  template<typename Func>
+  void forEachPairWithin(Scalar radius, Func&& func) const noexcept;
+  /// @brief the pairs of forEachPairWithin found across the cores and written as a neighbour list
+  void buildNeighbourList(Scalar radius, NeighbourList& result) const noexcept;
+  /// @brief write the built cells, entry order and points to a versioned binary file which
+  /// openSnapshot maps back without rebuilding. Only CellSorted and CellSortedSoA hashes built
+  /// with build() and with no pending inserts, moves or removals can be saved, else returns false
+  bool saveSnapshot(const std::string& path) const noexcept;
+  /// @brief map a file written by saveSnapshot from a hash of the same types and serve the queries
+  /// straight from it. Processes mapping the same file share its pages. The first insert, move or
+  /// remove afterwards copies the arrays out of the file, a build or clear just drops it. Returns
+  /// false, leaving the hash empty, if the file doesn't match or its tables index out of range,
+  /// which costs one pass over the index and tables but not the points
+  bool openSnapshot(const std::string& path) noexcept;
+  /// @brief true while queries are served from a mapped snapshot
+  bool mapped() const noexcept { return m_snapshot.isOpen(); }
+  /// @brief write to order the indices of the points sorted along curve through cells of cellSize,
+  /// points sharing a cell keep their input order. order[i] is the input index of the point that
+  /// goes to position i, hand it to permute for the points and every per point array before the
+  /// build so points close in space are close in memory, and so are the ids queries return
+  static void spatialOrder(const PointT* points, size_t numPoints, Scalar cellSize, Curve curve, std::vector<uint32_t>& order) noexcept;
+  static void spatialOrder(const std::vector<PointT>& points, Scalar cellSize, Curve curve, std::vector<uint32_t>& order) noexcept;
+  /// @brief reorder values so values[i] is the old values[order[i]]
+  template<typename T>
+  static void permute(const std::vector<uint32_t>& order, std::vector<T>& values) noexcept;
+  /// @brief totals of the queries since the last resetStats, all zero unless built with SPATIALHASH_STATS
+  QueryStats queryStats() const noexcept { return m_recorder.queryStats(); }
+  /// @brief zero the query totals and forget the recorded phases
+  void resetStats() noexcept { m_recorder.reset(); }
+  /// @brief heap bytes held by the hash, its arrays and the blocks of its BucketArena. A mapped
+  /// snapshot's pages belong to the page cache and are not counted
+  size_t bytesUsed() const noexcept;
+  /// @brief write the cellStats with the occupancy histogram, bytesUsed, the query totals and the
+  /// recorded phase times as one JSON object, cellStats walks every bucket so this is O(n)
+  bool writeStatsJson(const std::string& path) const noexcept;
+  /// @brief write the recorded build and batch phases as a Chrome trace for chrome://tracing or
+  /// Perfetto, empty unless built with SPATIALHASH_STATS
+  bool writeChromeTrace(const std::string& path) const noexcept;
+  /// @brief integer cell coordinate of a coordinate and the cell of a point
+  int hashCoord(Scalar coord) const noexcept;
+  Cell cellOf(const PointT& point) const noexcept;
+  /// @brief call func(id, position) for every point in cell, moved ones included
+  template<typename Func>
+  void forEachInCell(const Cell& cell, Func&& func) const noexcept;
+  /// @brief forEachInCell without the moved points. Reading many cells this way and the moved
+  /// points once with forEachMoved avoids scanning the moved list for every cell
+  template<typename Func>
+  void forEachStoredInCell(const Cell& cell, Func&& func) const noexcept;
+  /// @brief call func(id, position) for every point that left its cell since the last sort
+  template<typename Func>
+  void forEachMoved(Func&& func) const noexcept;
+  /// @brief changes whenever something the queries see may have changed, a result cached at one
+  /// generation is still valid while it stays the same
+  uint64_t generation() const noexcept { return m_generation; }
+  /// @brief pool the builds, commits and moves run on, ThreadPool::global() unless set. The
+  /// batched queries always use the global pool
+  void setBuildPool(ThreadPool* pool) noexcept { m_buildPool = pool; }
 private:
-  float m_cellSize = 1.0f;
-  std::unordered_map<int, std::vector<ngl::Vec3>> m_hashTable;
+  Scalar m_cellSize = 1;
+  Storage m_storage = Storage::HashMap;
+  CellKey m_cellKey = CellKey::Hashed;
+  bool m_autoCellSize = false;
+  Scalar m_typicalRadius = 0;
+  BucketArena m_arena;
+  std::pmr::memory_resource* m_bucketResource;
+  using HashTable = FlatCellMap<KeyT, std::pmr::vector<uint32_t>>;
+  HashTable m_hashTable;
+  /// cells of the last HashMap build, reserved up front so the table doesn't rehash as it fills
+  size_t m_occupiedHint = 0;
+  /// points owned by the hash, all of them in HashMap mode and the pending inserts in CellSorted mode
+  std::vector<PointT> m_points;
+  /// caller owned points when built with buildIndexed
+  const PointT* m_external = nullptr;
+  size_t m_numPoints = 0;
+  /// box around the points, the cells touching it bound the kNearest shells
+  Coords m_lower = filled(std::numeric_limits<Scalar>::infinity());
+  Coords m_upper = filled(-std::numeric_limits<Scalar>::infinity());
+  /// per id flag for removed points, empty until the first remove
+  std::vector<uint8_t> m_removed;
+  size_t m_numRemoved = 0;
+  /// CellSorted data, m_cellStart[b] .. m_cellStart[b+1] is the range of bucket b in m_sortedIndex
+  /// and, unless built with buildIndexed, in m_sortedPoints or m_sortedCoords for CellSortedSoA.
+  /// The SoA arrays hold every coordinate of the point so it can be rebuilt from them
+  std::vector<PointT> m_sortedPoints;
+  std::array<std::vector<Scalar>, Traits::dim> m_sortedCoords;
+  std::vector<uint32_t> m_sortedIndex;
+  std::vector<uint32_t> m_cellStart;
+  /// the occupied cells in entry order, within a bucket the entries are grouped by cell so a
+  /// cell runs from its start to the start of the next one
+  struct OccupiedCell { Cell cell; uint32_t start; };
+  std::vector<OccupiedCell> m_cellList;
+  size_t m_numEntries = 0;
+  /// id to sorted entry, only built once points are moved or removed
+  std::vector<uint32_t> m_entryOf;
+  /// points which left their cell since the last sort, their sorted entry is dead (NaN so every
+  /// distance test fails) and queries check this list as well
+  struct Moved { uint32_t id; PointT position; };
+  std::vector<Moved> m_moved;
+  /// id to slot in m_moved or noSlot
+  std::vector<uint32_t> m_movedSlot;
+  static constexpr uint32_t noSlot = 0xffffffff;
+  /// key of each id in HashMap mode
+  std::vector<KeyT> m_pointKey;
+  /// scratch space for the builds, kept so steady state rebuilds reuse the memory
+  std::vector<uint32_t> m_pointBucket;
+  std::unique_ptr<std::atomic<uint32_t>[]> m_bucketCounter;
+  size_t m_bucketCounterSize = 0;
+  std::vector<Coords> m_boxMin;
+  std::vector<Coords> m_boxMax;
+  std::vector<uint32_t> m_scanSum;
+  std::vector<size_t> m_scanNonZero;
+  struct SortEntry { Cell cell; uint32_t index; };
+  struct SortScratch { std::vector<SortEntry> entries; size_t allocations = 0; };
+  std::vector<SortScratch> m_sortScratch;
+  std::vector<std::vector<uint32_t>> m_crossings;
+  /// id to the index of its last entry in the applyMoves batch being applied
+  std::vector<uint32_t> m_lastMove;
+  size_t m_allocations = 0;
+  size_t m_arenaBlocks = 0;
+  uint32_t m_tableShift = 64;
+  size_t m_occupiedCells = 0;
+  /// the Dense grid, bucket = sum of (cell - origin) * stride clamped to the extent on each axis
+  bool m_dense = false;
+  Cell m_gridOrigin{};
+  Cell m_gridExtent{};
+  Cell m_gridStride{};
+  bool m_haveDomain = false;
+  Coords m_domainLower{};
+  Coords m_domainUpper{};
+  /// what the CellSorted queries read, the vectors above after a build or the arrays of a mapped
+  /// snapshot. Anything that reallocates the vectors calls refreshView
+  struct SortedView
+  {
+    spatialHashDetail::ArrayView<PointT> points;
+    std::array<spatialHashDetail::ArrayView<Scalar>, Traits::dim> coords;
+    spatialHashDetail::ArrayView<uint32_t> index;
+    spatialHashDetail::ArrayView<uint32_t> cellStart;
+    spatialHashDetail::ArrayView<OccupiedCell> cells;
+  };
+  SortedView m_view;
+  MappedFile m_snapshot;
+  ThreadPool* m_buildPool = nullptr;
+  uint64_t m_generation = 0;
+  /// query totals and phase times, an empty shell unless built with SPATIALHASH_STATS
+  mutable spatialHashDetail::StatsRecorder m_recorder;
+  /// room made by reserveConcurrent, slots m_concurrentBegin .. m_concurrentEnd of m_points with
+  /// ids from m_concurrentFirstId. The claim counter every producer bumps has a cache line to itself
+  size_t m_concurrentBegin = 0;
+  size_t m_concurrentEnd = 0;
+  size_t m_concurrentFirstId = 0;
+  struct alignas(64) ClaimCounter { std::atomic<size_t> next{0}; };
+  ClaimCounter m_concurrentClaimed;
+
+  static Scalar coord(const PointT& p, int axis) noexcept { return Traits::get(p, axis); }
+  static Coords filled(Scalar value) noexcept
+  {
+    Coords c;
+    c.fill(value);
+    return c;
+  }
+  /// a point with the given first Dim coordinates and any others zero
+  static PointT toPoint(const Coords& c) noexcept;
+  static Scalar distanceSquared(const PointT& a, const PointT& b) noexcept
+  {
+    Scalar d = 0;
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      Scalar t = coord(a, axis) - coord(b, axis);
+      d += t * t;
+    }
+    return d;
+  }
+  static Cell offsetCell(const Cell& cell, const Cell& offset) noexcept
+  {
+    Cell c;
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      c[axis] = cell[axis] + offset[axis];
+    }
+    return c;
+  }
+
+  KeyT hash(const PointT& point) const  noexcept;
 
-  int hash(const ngl::Vec3& point) const  noexcept;
+  KeyT hashIndex(const Cell& cell) const noexcept;
 
-  int hashCoord(float coord) const noexcept ;
+  uint32_t bucket(const Cell& cell) const noexcept;
 
-  int hashIndex(int x, int y, int z) const noexcept;
+  /// offsets after the origin in lexicographic order of the cells a radius can reach, with their
+  /// mirrors they cover the whole neighbourhood
+  void halfStencil(Scalar radius, std::vector<Cell>& stencil) const noexcept;
+  /// pair work is split into items, the occupied cells in the cell sorted layouts and the ids in
+  /// HashMap mode
+  size_t numPairItems() const noexcept { return cellSorted() ? m_view.cells.size() : m_numPoints; }
+  template<typename Func>
+  void forEachPairInItems(size_t first, size_t last, Scalar radius, const std::vector<Cell>& stencil, Func&& func) const noexcept;
+  /// pairs involving points on the moved list
+  template<typename Func>
+  void forEachMovedPair(Scalar radius, Func&& func) const noexcept;
+  /// inclusive integer cell bounds of a query
+  struct CellRange
+  {
+    Cell lo;
+    Cell hi;
+    uint64_t cells() const noexcept
+    {
+      uint64_t count = 1;
+      for(int axis = 0; axis < Dim; ++axis)
+      {
+        count *= static_cast<uint64_t>(static_cast<int64_t>(hi[axis]) - lo[axis] + 1);
+      }
+      return count;
+    }
+    bool contains(const Cell& c) const noexcept
+    {
+      for(int axis = 0; axis < Dim; ++axis)
+      {
+        if(c[axis] < lo[axis] || c[axis] > hi[axis])
+        {
+          return false;
+        }
+      }
+      return true;
+    }
+  };
+  /// call func(cell) for every cell of range, the last axis changing fastest
+  template<typename Func>
+  static void forEachCellIn(const CellRange& range, Func&& func) noexcept;
+  /// one loop per axis, nested at compile time
+  template<int Axis, typename Func>
+  static void forEachCellIn(const CellRange& range, Cell& cell, Func& func) noexcept;
+  /// call func(cell) for the cells of range within reach of centre, the offsets come from a
+  /// constexpr stencil so the loop has fixed bounds
+  template<int Reach, typename Func>
+  static void forEachStencilCell(const Cell& centre, const CellRange& range, Func&& func) noexcept;
+  template<typename Func>
+  void forEachOccupied(const CellRange& range, const PointT& point, Scalar radiusSquared, Func&& func) const noexcept;
+  /// Dense grid only, scan the cells of range clamped to the grid a row along x at a time, each
+  /// row being one run of entries
+  template<typename Func>
+  void forEachDenseRow(const CellRange& range, const PointT& point, Scalar radiusSquared, Func&& func) const noexcept;
+  /// range of the cells the box of the points touches
+  CellRange occupiedBounds() const noexcept;
+  /// clip t0 .. t1 of the segment a + t * direction to the box of the points grown by margin,
+  /// false if it misses
+  bool clipSegment(const PointT& a, const Coords& direction, Scalar margin, Scalar& t0, Scalar& t1) const noexcept;
+  /// call visit(cell, t) for every cell of bounds within reach of a cell the segment crosses
+  /// between t0 and t1, once each and in the order the walk reaches them. t is where the walk
+  /// entered the crossed cell, a false return ends the walk
+  template<typename Visit>
+  void walkSegment(const PointT& a, const Coords& direction, Scalar t0, Scalar t1, int reach, const CellRange& bounds, Visit&& visit) const noexcept;
+  /// report(id, position, t) for the points within thickness of the segment a .. b, t being where
+  /// they project onto it. more(t) is asked before each cell the walk probes
+  template<typename Report, typename More>
+  void segmentQuery(const PointT& a, const PointT& b, Scalar thickness, Report&& report, More&& more) const noexcept;
+  /// visit the points of cell within radius of point, points of other cells sharing its bucket
+  /// are skipped
+  template<typename Func>
+  void forEachInCell(const Cell& cell, const PointT& point, Scalar radiusSquared, Func&& func) const noexcept;
+  template<typename Accept, typename Func>
+  void scanSorted(uint32_t first, uint32_t end, const PointT& point, Scalar radiusSquared, Accept&& accept, Func&& func) const noexcept;
+  bool cellSorted() const noexcept { return m_storage != Storage::HashMap; }
+  PointT sortedPoint(uint32_t e) const noexcept;
+  /// the point of entry e rebuilt from the SoA arrays
+  PointT soaPoint(uint32_t e) const noexcept
+  {
+    std::array<Scalar, Traits::dim> c;
+    for(int axis = 0; axis < Traits::dim; ++axis)
+    {
+      c[axis] = m_view.coords[axis][e];
+    }
+    return Traits::make(c);
+  }
+  static bool samePosition(const PointT& a, const PointT& b) noexcept
+  {
+    for(int axis = 0; axis < Traits::dim; ++axis)
+    {
+      if(coord(a, axis) != coord(b, axis))
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+  /// dead entries of moved and removed points hold NaN
+  static bool dead(const PointT& p) noexcept { return std::isnan(coord(p, 0)); }
+  const PointT* hashMapPoints() const noexcept { return m_external ? m_external : m_points.data(); }
+  /// bounding box of the live points into m_lower and m_upper, and the cell size when automatic
+  void fitToPoints(const PointT* points, size_t numPoints) noexcept;
+  /// grow the box for a point added or moved outside the last build
+  void extendBounds(const PointT& p) noexcept;
+  bool removed(uint32_t id) const noexcept { return id < m_removed.size() && m_removed[id]; }
+  void ownPoints() noexcept;
+  /// trim m_points to the slots insertConcurrent filled, in HashMap mode they also go into the table
+  void closeConcurrent() noexcept;
+  ThreadPool& buildPool() const noexcept { return m_buildPool ? *m_buildPool : ThreadPool::global(); }
+  void refreshView() noexcept;
+  /// copy a mapped snapshot's arrays into the vectors before they are changed
+  void detachSnapshot() noexcept;
+  void buildEntryIndex() noexcept;
+  void killEntry(uint32_t e) noexcept;
+  void setSortedPoint(uint32_t e, const PointT& p) noexcept;
+  void moveCell(uint32_t id, const PointT& position) noexcept;
+  void resort() noexcept;
+  /// bracket a build so m_allocations counts what it allocated
+  void beginBuild() noexcept;
+  void endBuild() noexcept;
+  template<typename T>
+  void resizeCounted(std::vector<T>& v, size_t size) noexcept
+  {
+    m_allocations += size > v.capacity();
+    v.resize(size);
+  }
+  void buildHashMap(const PointT* points, size_t numPoints) noexcept;
+  /// lay out the Dense grid if the key asks for one and it fits, else size the hashed table.
+  /// Returns the number of buckets
+  uint32_t chooseTable(size_t numPoints) noexcept;
+  void sortCells(const PointT* points, size_t numPoints, bool copyPoints) noexcept;
+  void queryBatch(const PointT* centres, size_t numCentres, Scalar radius, const Scalar* radii, BatchResult& result) const noexcept;
+  /// reset the worker buffers, then once every worker has appended its chunks and the counts are in
+  /// offsets[i+1] turn the counts into offsets and gather the buffers into the CSR arrays
+  static void beginBatch(size_t numCentres, BatchResult& result) noexcept;
+  static void finishBatch(size_t numCentres, BatchResult& result) noexcept;
 };
 
-#endif
\ No newline at end of file
+template<typename PointT, int Dim, typename KeyT>
+template<typename T>
+void BasicSpatialHash<PointT, Dim, KeyT>::permute(const std::vector<uint32_t>& order, std::vector<T>& values) noexcept
+{
+  std::vector<T> reordered;
+  reordered.reserve(order.size());
+  for(auto i : order)
+  {
+    reordered.push_back(std::move(values[i]));
+  }
+  values.swap(reordered);
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Func>
+void BasicSpatialHash<PointT, Dim, KeyT>::forEachInCell(const Cell& cell, Func&& func) const noexcept
+{
+  forEachMoved([&](uint32_t id, const PointT& p)
+  {
+    if(cellOf(p) == cell)
+    {
+      func(id, p);
+    }
+  });
+  forEachStoredInCell(cell, func);
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Func>
+void BasicSpatialHash<PointT, Dim, KeyT>::forEachStoredInCell(const Cell& cell, Func&& func) const noexcept
+{
+  if(cellSorted() && m_view.cellStart.empty())
+  {
+    return;
+  }
+  // every live point passes an infinite radius, the NaN of dead entries never does
+  forEachInCell(cell, toPoint(filled(0)), std::numeric_limits<Scalar>::infinity(), func);
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Func>
+void BasicSpatialHash<PointT, Dim, KeyT>::forEachMoved(Func&& func) const noexcept
+{
+  for(const auto& moved : m_moved)
+  {
+    func(moved.id, moved.position);
+  }
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Func>
+void BasicSpatialHash<PointT, Dim, KeyT>::forEachInRadius(const PointT& point, Scalar radius, Func&& func) const noexcept
+{
+  spatialHashDetail::QueryScope scope(m_recorder);
+#if SPATIALHASH_STATS
+  auto report = [&](uint32_t id, const PointT& p){ scope.accept(); func(id, p); };
+#else
+  auto& report = func;
+#endif
+  if(cellSorted() && m_view.cellStart.empty())
+  {
+    return;
+  }
+  Scalar radiusSquared = radius * radius;
+  Cell centre = cellOf(point);
+  CellRange range;
+  bool nearCentre = true;
+  for(int axis = 0; axis < Dim; ++axis)
+  {
+    range.lo[axis] = hashCoord(coord(point, axis) - radius);
+    range.hi[axis] = hashCoord(coord(point, axis) + radius);
+    nearCentre = nearCentre && range.lo[axis] >= centre[axis] - 1 && range.hi[axis] <= centre[axis] + 1;
+  }
+  SPATIALHASH_TALLY(candidates, m_moved.size());
+  for(const auto& moved : m_moved)
+  {
+    if(distanceSquared(moved.position, point) <= radiusSquared)
+    {
+      report(moved.id, moved.position);
+    }
+  }
+  if(m_dense)
+  {
+    forEachDenseRow(range, point, radiusSquared, report);
+    return;
+  }
+  // a probe costs a hash and a lookup, walking the occupied cells costs a bounds check each (or a
+  // distance test per point for the map) so big ranges over sparse data walk instead of probe
+  size_t walkCost = cellSorted() ? m_view.cells.size() : m_numPoints;
+  if(static_cast<double>(range.cells()) * probeCost > static_cast<double>(walkCost))
+  {
+    forEachOccupied(range, point, radiusSquared, report);
+    return;
+  }
+  auto probe = [&](const Cell& cell){ forEachInCell(cell, point, radiusSquared, report); };
+  // radii up to a cell, the usual case, stay in the 3^dim block around the point's cell which
+  // has fixed loop bounds. Wider ranges loop over their own box, a 5^dim or 7^dim stencil was
+  // slower as many of its offsets fall outside the range
+  if(nearCentre)
+  {
+    forEachStencilCell<1>(centre, range, probe);
+  }
+  else
+  {
+    forEachCellIn(range, probe);
+  }
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Func>
+void BasicSpatialHash<PointT, Dim, KeyT>::forEachInBox(const PointT& lower, const PointT& upper, Func&& func) const noexcept
+{
+  spatialHashDetail::QueryScope scope(m_recorder);
+  if(numPoints() == 0 || (cellSorted() && m_view.cellStart.empty()))
+  {
+    return;
+  }
+  auto report = [&](uint32_t id, const PointT& p)
+  {
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      if(coord(p, axis) < coord(lower, axis) || coord(p, axis) > coord(upper, axis))
+      {
+        return;
+      }
+    }
+    scope.accept();
+    func(id, p);
+  };
+  // the moved points are tested before the box is clipped so they never depend on the bounds
+  SPATIALHASH_TALLY(candidates, m_moved.size());
+  for(const auto& moved : m_moved)
+  {
+    report(moved.id, moved.position);
+  }
+  // clamped to the box of the points so open boxes with infinite faces work too
+  CellRange range;
+  for(int axis = 0; axis < Dim; ++axis)
+  {
+    Scalar lo = std::max(m_lower[axis], coord(lower, axis));
+    Scalar hi = std::min(m_upper[axis], coord(upper, axis));
+    if(!(lo <= hi))
+    {
+      return;
+    }
+    range.lo[axis] = hashCoord(lo);
+    range.hi[axis] = hashCoord(hi);
+  }
+  // the cells are read whole, an infinite radius passes every live point on to the box test
+  Scalar all = std::numeric_limits<Scalar>::infinity();
+  if(m_dense)
+  {
+    forEachDenseRow(range, lower, all, report);
+    return;
+  }
+  size_t walkCost = cellSorted() ? m_view.cells.size() : m_numPoints;
+  if(static_cast<double>(range.cells()) * probeCost > static_cast<double>(walkCost))
+  {
+    forEachOccupied(range, lower, all, report);
+    return;
+  }
+  forEachCellIn(range, [&](const Cell& cell){ forEachInCell(cell, lower, all, report); });
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Func>
+void BasicSpatialHash<PointT, Dim, KeyT>::forEachOnSegment(const PointT& a, const PointT& b, Scalar thickness, Func&& func) const noexcept
+{
+  spatialHashDetail::QueryScope scope(m_recorder);
+  bool stopped = false;
+  segmentQuery(a, b, thickness, [&](uint32_t id, const PointT& p, Scalar)
+  {
+    if(stopped)
+    {
+      return;
+    }
+    scope.accept();
+    if constexpr(std::is_same_v<std::invoke_result_t<Func&, uint32_t, const PointT&>, bool>)
+    {
+      stopped = !func(id, p);
+    }
+    else
+    {
+      func(id, p);
+    }
+  }, [&](Scalar){ return !stopped; });
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Report, typename More>
+void BasicSpatialHash<PointT, Dim, KeyT>::segmentQuery(const PointT& a, const PointT& b, Scalar thickness, Report&& report, More&& more) const noexcept
+{
+  if(numPoints() == 0 || (cellSorted() && m_view.cellStart.empty()))
+  {
+    return;
+  }
+  thickness = std::max(thickness, Scalar(0));
+  Coords direction;
+  Scalar lengthSquared = 0;
+  for(int axis = 0; axis < Dim; ++axis)
+  {
+    direction[axis] = coord(b, axis) - coord(a, axis);
+    lengthSquared += direction[axis] * direction[axis];
+  }
+  Scalar thicknessSquared = thickness * thickness;
+  auto test = [&](uint32_t id, const PointT& p)
+  {
+    Scalar t = 0;
+    if(lengthSquared > 0)
+    {
+      for(int axis = 0; axis < Dim; ++axis)
+      {
+        t += (coord(p, axis) - coord(a, axis)) * direction[axis];
+      }
+      t = std::clamp(t / lengthSquared, Scalar(0), Scalar(1));
+    }
+    Scalar d = 0;
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      Scalar s = coord(p, axis) - coord(a, axis) - t * direction[axis];
+      d += s * s;
+    }
+    if(d <= thicknessSquared)
+    {
+      report(id, p, t);
+    }
+  };
+  SPATIALHASH_TALLY(candidates, m_moved.size());
+  for(const auto& moved : m_moved)
+  {
+    test(moved.id, moved.position);
+  }
+  Scalar t0 = 0;
+  Scalar t1 = 1;
+  if(!clipSegment(a, direction, thickness, t0, t1))
+  {
+    return;
+  }
+  // the walk probes the new face of the block around each crossed cell, about one crossing per
+  // cell of length along each axis. Against few occupied cells walking those is cheaper
+  CellRange bounds = occupiedBounds();
+  CellRange range;
+  Scalar side = 2 * std::ceil(thickness / m_cellSize) + 1;
+  double probes = std::pow(static_cast<double>(side), Dim);
+  for(int axis = 0; axis < Dim; ++axis)
+  {
+    Scalar from = coord(a, axis) + t0 * direction[axis];
+    Scalar to = coord(a, axis) + t1 * direction[axis];
+    range.lo[axis] = std::max(bounds.lo[axis], hashCoord(std::max(std::min(from, to) - thickness, m_lower[axis])));
+    range.hi[axis] = std::min(bounds.hi[axis], hashCoord(std::min(std::max(from, to) + thickness, m_upper[axis])));
+    probes += std::abs(static_cast<double>(hashCoord(to)) - hashCoord(from)) * std::pow(static_cast<double>(side), Dim - 1);
+  }
+  Scalar all = std::numeric_limits<Scalar>::infinity();
+  size_t walkCost = cellSorted() ? m_view.cells.size() : m_numPoints;
+  if(probes * probeCost > static_cast<double>(walkCost))
+  {
+    forEachOccupied(range, a, all, test);
+    return;
+  }
+  int reach = static_cast<int>(side) / 2;
+  walkSegment(a, direction, t0, t1, reach, range, [&](const Cell& cell, Scalar t)
+  {
+    if(!more(t))
+    {
+      return false;
+    }
+    forEachInCell(cell, a, all, test);
+    return true;
+  });
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Visit>
+void BasicSpatialHash<PointT, Dim, KeyT>::walkSegment(const PointT& a, const Coords& direction, Scalar t0, Scalar t1, int reach, const CellRange& bounds, Visit&& visit) const noexcept
+{
+  // Amanatides and Woo: tMax is where the segment crosses the next cell face along each axis and
+  // tDelta how far apart those crossings are, the walk steps across the nearest face each time
+  Cell cell;
+  Cell step;
+  Coords tMax;
+  Coords tDelta;
+  for(int axis = 0; axis < Dim; ++axis)
+  {
+    cell[axis] = hashCoord(coord(a, axis) + t0 * direction[axis]);
+    step[axis] = direction[axis] > 0 ? 1 : (direction[axis] < 0 ? -1 : 0);
+    if(step[axis] == 0)
+    {
+      tMax[axis] = std::numeric_limits<Scalar>::infinity();
+      tDelta[axis] = std::numeric_limits<Scalar>::infinity();
+      continue;
+    }
+    Scalar face = (cell[axis] + (step[axis] > 0 ? 1 : 0)) * m_cellSize;
+    tMax[axis] = (face - coord(a, axis)) / direction[axis];
+    tDelta[axis] = m_cellSize / std::abs(direction[axis]);
+  }
+  // a cell is inside the blocks of one unbroken run of steps as each axis only moves one way, so
+  // skipping the cells of the previous block visits every cell once
+  CellRange previous{};
+  bool first = true;
+  Scalar t = t0;
+  while(true)
+  {
+    CellRange block;
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      block.lo[axis] = std::max(cell[axis] - reach, bounds.lo[axis]);
+      block.hi[axis] = std::min(cell[axis] + reach, bounds.hi[axis]);
+    }
+    bool going = true;
+    forEachCellIn(block, [&](const Cell& c)
+    {
+      if(going && (first || !previous.contains(c)))
+      {
+        going = visit(c, t);
+      }
+    });
+    if(!going)
+    {
+      return;
+    }
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      previous.lo[axis] = cell[axis] - reach;
+      previous.hi[axis] = cell[axis] + reach;
+    }
+    first = false;
+    int next = 0;
+    for(int axis = 1; axis < Dim; ++axis)
+    {
+      next = tMax[axis] < tMax[next] ? axis : next;
+    }
+    // NaN from a degenerate segment fails this too
+    if(!(tMax[next] <= t1))
+    {
+      return;
+    }
+    t = tMax[next];
+    cell[next] += step[next];
+    tMax[next] += tDelta[next];
+  }
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Func>
+inline void BasicSpatialHash<PointT, Dim, KeyT>::forEachCellIn(const CellRange& range, Func&& func) noexcept
+{
+  Cell cell;
+  forEachCellIn<0>(range, cell, func);
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<int Axis, typename Func>
+inline void BasicSpatialHash<PointT, Dim, KeyT>::forEachCellIn(const CellRange& range, Cell& cell, Func& func) noexcept
+{
+  for(cell[Axis] = range.lo[Axis]; cell[Axis] <= range.hi[Axis]; ++cell[Axis])
+  {
+    if constexpr(Axis + 1 == Dim)
+    {
+      func(static_cast<const Cell&>(cell));
+    }
+    else
+    {
+      forEachCellIn<Axis + 1>(range, cell, func);
+    }
+  }
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<int Reach, typename Func>
+inline void BasicSpatialHash<PointT, Dim, KeyT>::forEachStencilCell(const Cell& centre, const CellRange& range, Func&& func) noexcept
+{
+  for(const auto& offset : spatialHashDetail::stencil<Dim, Reach>)
+  {
+    Cell cell = offsetCell(centre, offset);
+    if(range.contains(cell))
+    {
+      func(cell);
+    }
+  }
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Func>
+inline void BasicSpatialHash<PointT, Dim, KeyT>::forEachInCell(const Cell& cell, const PointT& point, Scalar radiusSquared, Func&& func) const noexcept
+{
+  // several cells share a bucket, so once a point is in range make sure it belongs to this cell
+  // else it would be reported again when its own cell is visited
+  auto inCell = [&](const PointT& p)
+  {
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      if(hashCoord(coord(p, axis)) != cell[axis])
+      {
+        return false;
+      }
+    }
+    return true;
+  };
+  SPATIALHASH_TALLY(cellsVisited, 1);
+  if(m_storage == Storage::HashMap)
+  {
+    const auto* ids = m_hashTable.find(hashIndex(cell));
+    if(ids == nullptr)
+    {
+      SPATIALHASH_TALLY(emptyProbes, 1);
+      return;
+    }
+    SPATIALHASH_TALLY(candidates, ids->size());
+    const PointT* points = hashMapPoints();
+    for(auto id : *ids)
+    {
+      const PointT& p = points[id];
+      // only Hashed keys are shared between cells
+      if(distanceSquared(p, point) <= radiusSquared && (m_cellKey != CellKey::Hashed || inCell(p)))
+      {
+        func(id, p);
+      }
+    }
+    return;
+  }
+  uint32_t b = bucket(cell);
+  SPATIALHASH_TALLY(emptyProbes, m_view.cellStart[b] == m_view.cellStart[b + 1]);
+  scanSorted(m_view.cellStart[b], m_view.cellStart[b + 1], point, radiusSquared, inCell, func);
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Func>
+void BasicSpatialHash<PointT, Dim, KeyT>::forEachOccupied(const CellRange& range, const PointT& point, Scalar radiusSquared, Func&& func) const noexcept
+{
+  if(m_storage == Storage::HashMap)
+  {
+    // each key is visited once so even points of colliding cells are only reported once
+    SPATIALHASH_TALLY(cellsVisited, m_hashTable.size());
+    SPATIALHASH_TALLY(candidates, m_numPoints - m_numRemoved);
+    const PointT* points = hashMapPoints();
+    m_hashTable.forEach([&](KeyT, const auto& ids)
+    {
+      for(auto id : ids)
+      {
+        const PointT& p = points[id];
+        if(distanceSquared(p, point) <= radiusSquared)
+        {
+          func(id, p);
+        }
+      }
+    });
+    return;
+  }
+  // neighbouring cells in the list are neighbours in memory too so runs of cells in range are
+  // scanned in one go, which keeps the filter kernel blocks full
+  auto any = [](const PointT&){ return true; };
+  uint32_t runStart = 0;
+  uint32_t runEnd = 0;
+  for(size_t c = 0; c < m_view.cells.size(); ++c)
+  {
+    const auto& cell = m_view.cells[c];
+    if(range.contains(cell.cell))
+    {
+      SPATIALHASH_TALLY(cellsVisited, 1);
+      if(cell.start != runEnd)
+      {
+        scanSorted(runStart, runEnd, point, radiusSquared, any, func);
+        runStart = cell.start;
+      }
+      runEnd = c + 1 < m_view.cells.size() ? m_view.cells[c + 1].start : static_cast<uint32_t>(m_numEntries);
+    }
+  }
+  scanSorted(runStart, runEnd, point, radiusSquared, any, func);
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Func>
+void BasicSpatialHash<PointT, Dim, KeyT>::forEachDenseRow(const CellRange& range, const PointT& point, Scalar radiusSquared, Func&& func) const noexcept
+{
+  // clamping keeps the border cells, which hold the points outside the domain. Each bucket is
+  // scanned once and the caller's test is exact so no point is reported twice
+  CellRange grid;
+  for(int axis = 0; axis < Dim; ++axis)
+  {
+    int64_t last = m_gridExtent[axis] - 1;
+    grid.lo[axis] = static_cast<int>(std::clamp<int64_t>(static_cast<int64_t>(range.lo[axis]) - m_gridOrigin[axis], 0, last));
+    grid.hi[axis] = static_cast<int>(std::clamp<int64_t>(static_cast<int64_t>(range.hi[axis]) - m_gridOrigin[axis], 0, last));
+  }
+  auto any = [](const PointT&){ return true; };
+  Cell row = grid.lo;
+  while(true)
+  {
+    uint32_t base = 0;
+    for(int axis = 1; axis < Dim; ++axis)
+    {
+      base += static_cast<uint32_t>(row[axis] * m_gridStride[axis]);
+    }
+    SPATIALHASH_TALLY(cellsVisited, grid.hi[0] - grid.lo[0] + 1);
+    scanSorted(m_view.cellStart[base + grid.lo[0]], m_view.cellStart[base + grid.hi[0] + 1], point, radiusSquared, any, func);
+    int axis = 1;
+    while(axis < Dim && row[axis] == grid.hi[axis])
+    {
+      row[axis] = grid.lo[axis];
+      ++axis;
+    }
+    if(axis == Dim)
+    {
+      return;
+    }
+    ++row[axis];
+  }
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Func>
+void BasicSpatialHash<PointT, Dim, KeyT>::forEachPairWithin(Scalar radius, Func&& func) const noexcept
+{
+  // the join counts as one query, the radius queries of the moved points are counted on their own
+  spatialHashDetail::QueryScope scope(m_recorder);
+  std::vector<Cell> stencil;
+  halfStencil(radius, stencil);
+  auto report = [&](uint32_t a, uint32_t b, const PointT& p, const PointT& q)
+  {
+    scope.accept();
+    func(a, b, p, q);
+  };
+  forEachPairInItems(0, numPairItems(), radius, stencil, report);
+  forEachMovedPair(radius, report);
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Func>
+void BasicSpatialHash<PointT, Dim, KeyT>::forEachPairInItems(size_t first, size_t last, Scalar radius, const std::vector<Cell>& stencil, Func&& func) const noexcept
+{
+  Scalar radiusSquared = radius * radius;
+  if(m_storage == Storage::HashMap)
+  {
+    // ids of the point's own cell are paired with larger ids only, forward cells with all of them
+    const PointT* points = hashMapPoints();
+    for(size_t a = first; a < last; ++a)
+    {
+      uint32_t id = static_cast<uint32_t>(a);
+      if(removed(id))
+      {
+        continue;
+      }
+      const PointT& p = points[a];
+      Cell cell = cellOf(p);
+      forEachInCell(cell, p, radiusSquared, [&](uint32_t other, const PointT& q)
+      {
+        if(other > id)
+        {
+          func(id, other, p, q);
+        }
+      });
+      for(const auto& o : stencil)
+      {
+        forEachInCell(offsetCell(cell, o), p, radiusSquared, [&](uint32_t other, const PointT& q)
+        {
+          func(id, other, p, q);
+        });
+      }
+    }
+    return;
+  }
+  auto any = [](const PointT&){ return true; };
+  for(size_t c = first; c < last; ++c)
+  {
+    const auto& cell = m_view.cells[c];
+    uint32_t end = c + 1 < m_view.cells.size() ? m_view.cells[c + 1].start : static_cast<uint32_t>(m_numEntries);
+    for(uint32_t e = cell.start; e < end; ++e)
+    {
+      PointT p = sortedPoint(e);
+      // dead entries of moved and removed points
+      if(dead(p))
+      {
+        continue;
+      }
+      uint32_t id = m_view.index[e];
+      auto pair = [&](uint32_t other, const PointT& q){ func(id, other, p, q); };
+      // the rest of the cell follows in the sorted arrays
+      scanSorted(e + 1, end, p, radiusSquared, any, pair);
+      for(const auto& o : stencil)
+      {
+        forEachInCell(offsetCell(cell.cell, o), p, radiusSquared, pair);
+      }
+    }
+  }
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Func>
+void BasicSpatialHash<PointT, Dim, KeyT>::forEachMovedPair(Scalar radius, Func&& func) const noexcept
+{
+  // a pair of two moved points is seen from both, keep it once
+  for(const auto& moved : m_moved)
+  {
+    forEachInRadius(moved.position, radius, [&](uint32_t other, const PointT& q)
+    {
+      if(other != moved.id && (m_movedSlot[other] == noSlot || other > moved.id))
+      {
+        func(moved.id, other, moved.position, q);
+      }
+    });
+  }
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Accept, typename Func>
+inline void BasicSpatialHash<PointT, Dim, KeyT>::scanSorted(uint32_t first, uint32_t end, const PointT& point, Scalar radiusSquared, Accept&& accept, Func&& func) const noexcept
+{
+  SPATIALHASH_TALLY(candidates, end - first);
+  if(m_storage == Storage::CellSortedSoA)
+  {
+    if constexpr(std::is_same<Scalar, float>::value && Dim == 3)
+    {
+      const float* xs = m_view.coords[0].data();
+      const float* ys = m_view.coords[1].data();
+      const float* zs = m_view.coords[2].data();
+      uint32_t survivors[DistanceFilter::blockSize];
+      for(; first < end; first += DistanceFilter::blockSize)
+      {
+        uint32_t count = std::min(end - first, DistanceFilter::blockSize);
+        uint32_t numSurvivors = DistanceFilter::filter(xs + first, ys + first, zs + first, count,
+                                                       coord(point, 0), coord(point, 1), coord(point, 2), radiusSquared, survivors);
+        for(uint32_t s = 0; s < numSurvivors; ++s)
+        {
+          uint32_t e = first + survivors[s];
+          PointT p = soaPoint(e);
+          if(accept(p))
+          {
+            func(m_view.index[e], p);
+          }
+        }
+      }
+    }
+    else
+    {
+      // other shapes test straight from the coordinate arrays, the compiler vectorises the sum
+      Coords centre;
+      for(int axis = 0; axis < Dim; ++axis)
+      {
+        centre[axis] = coord(point, axis);
+      }
+      for(uint32_t e = first; e < end; ++e)
+      {
+        Scalar d = 0;
+        for(int axis = 0; axis < Dim; ++axis)
+        {
+          Scalar t = m_view.coords[axis][e] - centre[axis];
+          d += t * t;
+        }
+        if(d <= radiusSquared)
+        {
+          PointT p = soaPoint(e);
+          if(accept(p))
+          {
+            func(m_view.index[e], p);
+          }
+        }
+      }
+    }
+    return;
+  }
+  const PointT* sorted = m_view.points.empty() ? nullptr : m_view.points.data();
+  for(uint32_t e = first; e < end; ++e)
+  {
+    const PointT& p = sorted ? sorted[e] : m_external[m_view.index[e]];
+    if(distanceSquared(p, point) <= radiusSquared && accept(p))
+    {
+      func(m_view.index[e], p);
+    }
+  }
+}
+
+template<typename PointT, int Dim, typename KeyT>
+inline int BasicSpatialHash<PointT, Dim, KeyT>::hashCoord(Scalar coord) const noexcept
+{
+  return static_cast<int>(std::floor(coord / m_cellSize));
+}
+
+template<typename PointT, int Dim, typename KeyT>
+inline auto BasicSpatialHash<PointT, Dim, KeyT>::cellOf(const PointT& point) const noexcept -> Cell
+{
+  Cell cell;
+  for(int axis = 0; axis < Dim; ++axis)
+  {
+    cell[axis] = hashCoord(coord(point, axis));
+  }
+  return cell;
+}
+
+template<typename PointT, int Dim, typename KeyT>
+inline KeyT BasicSpatialHash<PointT, Dim, KeyT>::hashIndex(const Cell& cell) const noexcept
+{
+  using namespace spatialHashDetail;
+  switch(m_cellKey)
+  {
+    // the Dense grid only applies to the cell start table, the map packs its keys
+    case CellKey::Packed :
+    case CellKey::Dense :
+    case CellKey::Auto :
+    {
+      KeyT key = 0;
+      for(int axis = 0; axis < Dim; ++axis)
+      {
+        key |= static_cast<KeyT>(packCoord(cell[axis], keyBits)) << (axis * keyBits);
+      }
+      return key;
+    }
+    case CellKey::Morton :
+    {
+      if constexpr(Dim == 3 && sizeof(KeyT) == 8)
+      {
+        return spreadBits(packCoord(cell[0], 21)) | spreadBits(packCoord(cell[1], 21)) << 1 | spreadBits(packCoord(cell[2], 21)) << 2;
+      }
+      else
+      {
+        return interleave<KeyT, Dim, keyBits>(cell.data());
+      }
+    }
+    default :
+    {
+      // unsigned so the wrap around is defined, same keys as the old signed int version
+      uint32_t key = 0;
+      for(int axis = 0; axis < Dim; ++axis)
+      {
+        key += static_cast<uint32_t>(cell[axis]) * hashPrimes[axis];
+      }
+      return key;
+    }
+  }
+}
+
+template<typename PointT, int Dim, typename KeyT>
+inline uint32_t BasicSpatialHash<PointT, Dim, KeyT>::bucket(const Cell& cell) const noexcept
+{
+  if(m_dense)
+  {
+    uint32_t b = 0;
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      int64_t c = std::clamp<int64_t>(static_cast<int64_t>(cell[axis]) - m_gridOrigin[axis], 0, m_gridExtent[axis] - 1);
+      b += static_cast<uint32_t>(c) * static_cast<uint32_t>(m_gridStride[axis]);
+    }
+    return b;
+  }
+  // Fibonacci hashing, the top bits of the product mix every bit of the key
+  return static_cast<uint32_t>((static_cast<uint64_t>(hashIndex(cell)) * 0x9E3779B97F4A7C15ull) >> m_tableShift);
+}
+
+#include "SpatialHashImpl.h"
+
+/// @brief the hash of Vec3f points, compiled once in SpatialHash.cpp
+using SpatialHash = BasicSpatialHash<Vec3f>;
+extern template class BasicSpatialHash<Vec3f>;
+
+#endif
@@ -0,0 +1,1949 @@
+#ifndef SPATIALHASHIMPL_H_
+#define SPATIALHASHIMPL_H_
+
+// member definitions of BasicSpatialHash, included at the end of SpatialHash.h
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <tuple>
+
+  template<typename PointT, int Dim, typename KeyT>
+  uint32_t BasicSpatialHash<PointT, Dim, KeyT>::insert(const PointT& point) noexcept
+  {
+    if(cellSorted())
+    {
+      m_points.push_back(point);
+      return static_cast<uint32_t>(m_numPoints + m_points.size() - 1);
+    }
+    // the caller's points can't be extended so take a copy of them first
+    ownPoints();
+    uint32_t id = static_cast<uint32_t>(m_points.size());
+    KeyT index = hash(point);
+    m_points.push_back(point);
+    m_pointKey.push_back(index);
+    extendBounds(point);
+    m_hashTable[index].push_back(id);
+    m_numPoints = m_points.size();
+    ++m_generation;
+    return id;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::reserveConcurrent(size_t capacity) noexcept
+  {
+    if(m_concurrentEnd == m_concurrentBegin)
+    {
+      if(!cellSorted())
+      {
+        ownPoints();
+      }
+      m_concurrentBegin = m_points.size();
+      m_concurrentFirstId = (cellSorted() ? m_numPoints : 0) + m_concurrentBegin;
+      m_concurrentClaimed.next.store(0, std::memory_order_relaxed);
+    }
+    // a second reserve keeps the slots claimed so far and adds capacity behind them
+    size_t claimed = std::min(m_concurrentClaimed.next.load(std::memory_order_relaxed), m_concurrentEnd - m_concurrentBegin);
+    m_concurrentClaimed.next.store(claimed, std::memory_order_relaxed);
+    m_concurrentEnd = m_concurrentBegin + claimed + capacity;
+    m_points.resize(m_concurrentEnd);
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  uint32_t BasicSpatialHash<PointT, Dim, KeyT>::insertConcurrent(const PointT& point) noexcept
+  {
+    // the counter can run past the end, closeConcurrent only keeps the slots inside it
+    size_t slot = m_concurrentClaimed.next.fetch_add(1, std::memory_order_relaxed);
+    if(slot >= m_concurrentEnd - m_concurrentBegin)
+    {
+      return invalidId;
+    }
+    m_points[m_concurrentBegin + slot] = point;
+    return static_cast<uint32_t>(m_concurrentFirstId + slot);
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  uint32_t BasicSpatialHash<PointT, Dim, KeyT>::insertConcurrent(const PointT* points, size_t count) noexcept
+  {
+    // compare and swap so a run that doesn't fit claims nothing and leaves no unwritten slots
+    size_t room = m_concurrentEnd - m_concurrentBegin;
+    size_t slot = m_concurrentClaimed.next.load(std::memory_order_relaxed);
+    do
+    {
+      if(slot > room || count > room - slot)
+      {
+        return invalidId;
+      }
+    } while(!m_concurrentClaimed.next.compare_exchange_weak(slot, slot + count, std::memory_order_relaxed));
+    std::copy(points, points + count, m_points.begin() + static_cast<std::ptrdiff_t>(m_concurrentBegin + slot));
+    return static_cast<uint32_t>(m_concurrentFirstId + slot);
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::closeConcurrent() noexcept
+  {
+    if(m_concurrentEnd == m_concurrentBegin)
+    {
+      return;
+    }
+    size_t begin = m_concurrentBegin;
+    size_t end = begin + std::min(m_concurrentClaimed.next.load(std::memory_order_relaxed), m_concurrentEnd - begin);
+    m_concurrentBegin = m_concurrentEnd = 0;
+    m_concurrentClaimed.next.store(0, std::memory_order_relaxed);
+    m_points.resize(end);
+    if(cellSorted())
+    {
+      return;
+    }
+    // as in buildHashMap the keys are hashed across the cores and the table filled serially
+    resizeCounted(m_pointKey, end);
+    buildPool().parallelFor(end - begin, [&](size_t first, size_t last, size_t)
+    {
+      for(size_t i = begin + first; i < begin + last; ++i)
+      {
+        m_pointKey[i] = hash(m_points[i]);
+      }
+    });
+    for(size_t i = begin; i < end; ++i)
+    {
+      extendBounds(m_points[i]);
+      m_hashTable[m_pointKey[i]].push_back(static_cast<uint32_t>(i));
+    }
+    m_numPoints = end;
+    ++m_generation;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::commit() noexcept
+  {
+    closeConcurrent();
+    if(!cellSorted() || (m_points.empty() && m_moved.empty()))
+    {
+      return;
+    }
+    ++m_generation;
+    spatialHashDetail::PhaseScope phase(m_recorder, "commit");
+    beginBuild();
+    detachSnapshot();
+    resort();
+    endBuild();
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::beginBuild() noexcept
+  {
+    m_allocations = 0;
+    m_arenaBlocks = m_arena.upstreamAllocations();
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::endBuild() noexcept
+  {
+    m_allocations += m_arena.upstreamAllocations() - m_arenaBlocks;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::resort() noexcept
+  {
+    // points committed previously are re-sorted along with the new ones, they go in front of the
+    // pending ones in id order so every id stays the same
+    size_t numPending = m_points.size();
+    resizeCounted(m_points, m_numPoints + numPending);
+    std::copy_backward(m_points.begin(), m_points.begin() + numPending, m_points.end());
+    // dead entries write NaN here, moved points are put back below and removed ones are skipped
+    for(size_t e = 0; e < m_numEntries; ++e)
+    {
+      m_points[m_sortedIndex[e]] = sortedPoint(static_cast<uint32_t>(e));
+    }
+    for(const auto& moved : m_moved)
+    {
+      m_points[moved.id] = moved.position;
+    }
+    fitToPoints(m_points.data(), m_points.size());
+    sortCells(m_points.data(), m_points.size(), true);
+    m_points.clear();
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::ownPoints() noexcept
+  {
+    detachSnapshot();
+    if(m_external == nullptr)
+    {
+      return;
+    }
+    if(cellSorted())
+    {
+      m_sortedPoints.resize(m_numEntries);
+      for(size_t e = 0; e < m_numEntries; ++e)
+      {
+        m_sortedPoints[e] = m_external[m_sortedIndex[e]];
+      }
+      refreshView();
+    }
+    else
+    {
+      m_points.assign(m_external, m_external + m_numPoints);
+    }
+    m_external = nullptr;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::buildEntryIndex() noexcept
+  {
+    if(m_entryOf.size() == m_numPoints)
+    {
+      return;
+    }
+    m_entryOf.assign(m_numPoints, noSlot);
+    buildPool().parallelFor(m_numEntries, [&](size_t begin, size_t end, size_t)
+    {
+      for(size_t e = begin; e < end; ++e)
+      {
+        m_entryOf[m_sortedIndex[e]] = static_cast<uint32_t>(e);
+      }
+    });
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::setSortedPoint(uint32_t e, const PointT& p) noexcept
+  {
+    if(m_storage == Storage::CellSortedSoA)
+    {
+      for(int axis = 0; axis < Traits::dim; ++axis)
+      {
+        m_sortedCoords[axis][e] = coord(p, axis);
+      }
+    }
+    else
+    {
+      m_sortedPoints[e] = p;
+    }
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::killEntry(uint32_t e) noexcept
+  {
+    std::array<Scalar, Traits::dim> nan;
+    nan.fill(std::numeric_limits<Scalar>::quiet_NaN());
+    setSortedPoint(e, Traits::make(nan));
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  PointT BasicSpatialHash<PointT, Dim, KeyT>::toPoint(const Coords& c) noexcept
+  {
+    std::array<Scalar, Traits::dim> all{};
+    std::copy(c.begin(), c.end(), all.begin());
+    return Traits::make(all);
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::extendBounds(const PointT& p) noexcept
+  {
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      m_lower[axis] = std::min(m_lower[axis], coord(p, axis));
+      m_upper[axis] = std::max(m_upper[axis], coord(p, axis));
+    }
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::moveCell(uint32_t id, const PointT& position) noexcept
+  {
+    extendBounds(position);
+    if(!cellSorted())
+    {
+      auto& ids = *m_hashTable.find(m_pointKey[id]);
+      *std::find(ids.begin(), ids.end(), id) = ids.back();
+      ids.pop_back();
+      if(ids.empty())
+      {
+        m_hashTable.erase(m_pointKey[id]);
+      }
+      m_pointKey[id] = hash(position);
+      m_hashTable[m_pointKey[id]].push_back(id);
+      m_points[id] = position;
+      return;
+    }
+    killEntry(m_entryOf[id]);
+    if(m_movedSlot.empty())
+    {
+      m_movedSlot.assign(m_numPoints, noSlot);
+    }
+    m_movedSlot[id] = static_cast<uint32_t>(m_moved.size());
+    m_moved.push_back({id, position});
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  bool BasicSpatialHash<PointT, Dim, KeyT>::update(uint32_t id, const PointT& position) noexcept
+  {
+    size_t numPending = cellSorted() ? m_points.size() : 0;
+    if(id >= m_numPoints + numPending || removed(id))
+    {
+      return false;
+    }
+    ownPoints();
+    ++m_generation;
+    // moves within a cell can still leave the box kNearest, box and segment queries clip to
+    extendBounds(position);
+    if(!cellSorted())
+    {
+      if(hash(position) == m_pointKey[id])
+      {
+        m_points[id] = position;
+        return false;
+      }
+      moveCell(id, position);
+      return true;
+    }
+    if(id >= m_numPoints)
+    {
+      m_points[id - m_numPoints] = position;
+      return false;
+    }
+    buildEntryIndex();
+    if(!m_movedSlot.empty() && m_movedSlot[id] != noSlot)
+    {
+      // already on the moved list so only the position changes
+      auto& moved = m_moved[m_movedSlot[id]];
+      bool changed = cellOf(moved.position) != cellOf(position);
+      moved.position = position;
+      return changed;
+    }
+    uint32_t e = m_entryOf[id];
+    if(cellOf(sortedPoint(e)) == cellOf(position))
+    {
+      setSortedPoint(e, position);
+      return false;
+    }
+    moveCell(id, position);
+    // re-sort once the moved list costs the queries more than a rebuild would
+    if(m_moved.size() > 256 + m_numEntries / 32)
+    {
+      resort();
+    }
+    return true;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::remove(uint32_t id) noexcept
+  {
+    size_t numPending = cellSorted() ? m_points.size() : 0;
+    if(id >= m_numPoints + numPending || removed(id))
+    {
+      return;
+    }
+    if(m_removed.size() <= id)
+    {
+      m_removed.resize(m_numPoints + numPending, 0);
+    }
+    m_removed[id] = 1;
+    ++m_generation;
+    // pending inserts are just skipped by the next commit
+    if(id >= m_numPoints)
+    {
+      return;
+    }
+    ++m_numRemoved;
+    if(!cellSorted())
+    {
+      auto& ids = *m_hashTable.find(m_pointKey[id]);
+      *std::find(ids.begin(), ids.end(), id) = ids.back();
+      ids.pop_back();
+      if(ids.empty())
+      {
+        m_hashTable.erase(m_pointKey[id]);
+      }
+      return;
+    }
+    ownPoints();
+    buildEntryIndex();
+    if(!m_movedSlot.empty() && m_movedSlot[id] != noSlot)
+    {
+      uint32_t slot = m_movedSlot[id];
+      m_moved[slot] = m_moved.back();
+      m_movedSlot[m_moved[slot].id] = slot;
+      m_moved.pop_back();
+      m_movedSlot[id] = noSlot;
+      return;
+    }
+    killEntry(m_entryOf[id]);
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  size_t BasicSpatialHash<PointT, Dim, KeyT>::applyMoves(const std::vector<PointT>& positions) noexcept
+  {
+    return applyMoves(nullptr, positions.data(), std::min(positions.size(), m_numPoints));
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  size_t BasicSpatialHash<PointT, Dim, KeyT>::applyMoves(const uint32_t* ids, const PointT* positions, size_t count) noexcept
+  {
+    spatialHashDetail::PhaseScope phase(m_recorder, "apply moves");
+    ownPoints();
+    if(cellSorted())
+    {
+      buildEntryIndex();
+    }
+    // points staying in their cell are written in place in parallel, each id is touched by one
+    // thread only. The few changing cell are collected and moved afterwards
+    auto& pool = buildPool();
+    auto& crossings = m_crossings;
+    crossings.resize(pool.numThreads());
+    for(auto& c : crossings)
+    {
+      c.clear();
+    }
+    // each worker grows its own box over the new positions, merged into m_lower and m_upper after
+    m_boxMin.assign(pool.numThreads(), filled(std::numeric_limits<Scalar>::infinity()));
+    m_boxMax.assign(pool.numThreads(), filled(-std::numeric_limits<Scalar>::infinity()));
+    // an id listed more than once only takes its last position, the earlier entries are skipped
+    // so no two threads write the same point
+    if(ids)
+    {
+      if(m_lastMove.size() < m_numPoints)
+      {
+        m_lastMove.resize(m_numPoints);
+      }
+      for(size_t i = 0; i < count; ++i)
+      {
+        if(ids[i] < m_numPoints)
+        {
+          m_lastMove[ids[i]] = static_cast<uint32_t>(i);
+        }
+      }
+    }
+    // points written back where they already are leave the generation alone, so a frame that
+    // moves nothing keeps cached query results valid
+    std::atomic<bool> changed{false};
+    auto note = [&](const PointT& from, const PointT& to)
+    {
+      if(!changed.load(std::memory_order_relaxed) && !samePosition(from, to))
+      {
+        changed.store(true, std::memory_order_relaxed);
+      }
+    };
+    pool.parallelFor(count, [&](size_t begin, size_t end, size_t worker)
+    {
+      for(size_t i = begin; i < end; ++i)
+      {
+        uint32_t id = ids ? ids[i] : static_cast<uint32_t>(i);
+        const PointT& p = positions[i];
+        if(id >= m_numPoints || removed(id) || (ids && m_lastMove[id] != i))
+        {
+          continue;
+        }
+        for(int axis = 0; axis < Dim; ++axis)
+        {
+          m_boxMin[worker][axis] = std::min(m_boxMin[worker][axis], coord(p, axis));
+          m_boxMax[worker][axis] = std::max(m_boxMax[worker][axis], coord(p, axis));
+        }
+        if(!cellSorted())
+        {
+          if(hash(p) == m_pointKey[id])
+          {
+            note(m_points[id], p);
+            m_points[id] = p;
+            continue;
+          }
+        }
+        else if(!m_movedSlot.empty() && m_movedSlot[id] != noSlot)
+        {
+          note(m_moved[m_movedSlot[id]].position, p);
+          m_moved[m_movedSlot[id]].position = p;
+          continue;
+        }
+        else
+        {
+          uint32_t e = m_entryOf[id];
+          PointT current = sortedPoint(e);
+          if(cellOf(current) == cellOf(p))
+          {
+            note(current, p);
+            setSortedPoint(e, p);
+            continue;
+          }
+        }
+        crossings[worker].push_back(static_cast<uint32_t>(i));
+      }
+    });
+    // apply the crossings in batch order so the layout doesn't depend on the thread count
+    auto& all = crossings[0];
+    for(size_t w = 1; w < crossings.size(); ++w)
+    {
+      all.insert(all.end(), crossings[w].begin(), crossings[w].end());
+    }
+    std::sort(all.begin(), all.end());
+    for(size_t w = 0; w < m_boxMin.size(); ++w)
+    {
+      for(int axis = 0; axis < Dim; ++axis)
+      {
+        m_lower[axis] = std::min(m_lower[axis], m_boxMin[w][axis]);
+        m_upper[axis] = std::max(m_upper[axis], m_boxMax[w][axis]);
+      }
+    }
+    m_generation += changed.load(std::memory_order_relaxed) || !all.empty();
+    for(auto i : all)
+    {
+      moveCell(ids ? ids[i] : i, positions[i]);
+    }
+    if(cellSorted() && m_moved.size() > 256 + m_numEntries / 32)
+    {
+      resort();
+    }
+    return all.size();
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::setAutoCellSize(bool enabled, Scalar typicalRadius) noexcept
+  {
+    m_autoCellSize = enabled;
+    m_typicalRadius = typicalRadius;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::setDomain(const PointT& lower, const PointT& upper) noexcept
+  {
+    m_haveDomain = true;
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      m_domainLower[axis] = coord(lower, axis);
+      m_domainUpper[axis] = coord(upper, axis);
+    }
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::fitToPoints(const PointT* points, size_t numPoints) noexcept
+  {
+    spatialHashDetail::PhaseScope phase(m_recorder, "fit");
+    // bounding box, one per worker then merged
+    auto& pool = buildPool();
+    Scalar inf = std::numeric_limits<Scalar>::infinity();
+    auto& minimum = m_boxMin;
+    auto& maximum = m_boxMax;
+    resizeCounted(minimum, pool.numThreads());
+    resizeCounted(maximum, pool.numThreads());
+    std::fill(minimum.begin(), minimum.end(), filled(inf));
+    std::fill(maximum.begin(), maximum.end(), filled(-inf));
+    pool.parallelFor(numPoints, [&](size_t begin, size_t end, size_t worker)
+    {
+      auto& lo = minimum[worker];
+      auto& hi = maximum[worker];
+      for(size_t i = begin; i < end; ++i)
+      {
+        if(removed(static_cast<uint32_t>(i)))
+        {
+          continue;
+        }
+        const auto& p = points[i];
+        for(int axis = 0; axis < Dim; ++axis)
+        {
+          lo[axis] = std::min(lo[axis], coord(p, axis));
+          hi[axis] = std::max(hi[axis], coord(p, axis));
+        }
+      }
+    });
+    for(size_t w = 1; w < minimum.size(); ++w)
+    {
+      for(int axis = 0; axis < Dim; ++axis)
+      {
+        minimum[0][axis] = std::min(minimum[0][axis], minimum[w][axis]);
+        maximum[0][axis] = std::max(maximum[0][axis], maximum[w][axis]);
+      }
+    }
+    m_lower = minimum[0];
+    m_upper = maximum[0];
+    if(!m_autoCellSize || numPoints == 0)
+    {
+      return;
+    }
+    Scalar size = suggestCellSize(numPoints, toPoint(minimum[0]), toPoint(maximum[0]), m_typicalRadius);
+    // every point removed leaves an empty box, keep the old size then
+    if(size > 0 && minimum[0][0] <= maximum[0][0])
+    {
+      m_cellSize = size;
+    }
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  auto BasicSpatialHash<PointT, Dim, KeyT>::suggestCellSize(size_t numPoints, const PointT& boxMin, const PointT& boxMax, Scalar radius) noexcept -> Scalar
+  {
+    if(numPoints == 0)
+    {
+      return 0;
+    }
+    // flat or degenerate boxes still get some thickness so the density stays finite
+    Coords extent;
+    Scalar largest = 0;
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      extent[axis] = coord(boxMax, axis) - coord(boxMin, axis);
+      largest = std::max(largest, extent[axis]);
+    }
+    Scalar thickness = std::max(largest * Scalar(0.01), radius > 0 ? radius : Scalar(0));
+    if(largest <= 0)
+    {
+      return radius > 0 ? radius : 0;
+    }
+    Scalar volume = 1;
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      volume *= std::max(extent[axis], thickness);
+    }
+    Scalar density = static_cast<Scalar>(numPoints) / volume;
+    if(radius <= 0)
+    {
+      // no query hint so aim for about two points per cell
+      return Dim == 3 ? std::cbrt(2 / density) : std::pow(2 / density, Scalar(1) / Dim);
+    }
+    // a query with cell size 2r/k probes about (k+1)^dim cells and tests the points in a
+    // (2r + size)^dim box, a probe costs a few distance tests. Keeping k <= maxCellsPerDiameter
+    // bounds the probes per query whatever the density
+    Scalar best = 2 * radius;
+    Scalar bestCost = std::numeric_limits<Scalar>::max();
+    for(int k = 1; k <= maxCellsPerDiameter; ++k)
+    {
+      Scalar size = 2 * radius / static_cast<Scalar>(k);
+      Scalar side = 2 * radius + size;
+      Scalar cost = probeCost * static_cast<Scalar>(spatialHashDetail::power(k + 1, Dim)) + density * std::pow(side, Scalar(Dim));
+      if(cost < bestCost)
+      {
+        bestCost = cost;
+        best = size;
+      }
+    }
+    return best;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::spatialOrder(const std::vector<PointT>& points, Scalar cellSize, Curve curve, std::vector<uint32_t>& order) noexcept
+  {
+    spatialOrder(points.data(), points.size(), cellSize, curve, order);
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::spatialOrder(const PointT* points, size_t numPoints, Scalar cellSize, Curve curve, std::vector<uint32_t>& order) noexcept
+  {
+    order.resize(numPoints);
+    if(numPoints == 0)
+    {
+      return;
+    }
+    auto cellCoord = [cellSize](const PointT& p, int axis)
+    {
+      return static_cast<int64_t>(std::floor(coord(p, axis) / cellSize));
+    };
+    // the curve covers the cells of the bounding box, coarsened until it fits in the key
+    std::array<int64_t, Dim> lo;
+    std::array<int64_t, Dim> hi;
+    lo.fill(std::numeric_limits<int64_t>::max());
+    hi.fill(std::numeric_limits<int64_t>::min());
+    for(size_t i = 0; i < numPoints; ++i)
+    {
+      for(int axis = 0; axis < Dim; ++axis)
+      {
+        int64_t c = cellCoord(points[i], axis);
+        lo[axis] = std::min(lo[axis], c);
+        hi[axis] = std::max(hi[axis], c);
+      }
+    }
+    constexpr int bits = std::min(32, 64 / Dim);
+    int shift = 0;
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      while(static_cast<uint64_t>(hi[axis] - lo[axis]) >> shift >> (bits - 1) > 1)
+      {
+        ++shift;
+      }
+    }
+    struct Keyed { uint64_t key; uint32_t index; };
+    std::vector<Keyed> keyed(numPoints);
+    ThreadPool::global().parallelFor(numPoints, [&](size_t begin, size_t end, size_t)
+    {
+      for(size_t i = begin; i < end; ++i)
+      {
+        uint32_t x[Dim];
+        for(int axis = 0; axis < Dim; ++axis)
+        {
+          x[axis] = static_cast<uint32_t>(static_cast<uint64_t>(cellCoord(points[i], axis) - lo[axis]) >> shift);
+        }
+        keyed[i] = {spatialHashDetail::curveKey(x, Dim, bits, curve == Curve::Hilbert), static_cast<uint32_t>(i)};
+      }
+    });
+    std::sort(keyed.begin(), keyed.end(), [](const Keyed& a, const Keyed& b)
+    {
+      return a.key != b.key ? a.key < b.key : a.index < b.index;
+    });
+    for(size_t i = 0; i < numPoints; ++i)
+    {
+      order[i] = keyed[i].index;
+    }
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::build(const std::vector<PointT>& points) noexcept
+  {
+    build(points.data(), points.size());
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::build(const PointT* points, size_t numPoints) noexcept
+  {
+    spatialHashDetail::PhaseScope phase(m_recorder, "build");
+    beginBuild();
+    clear();
+    fitToPoints(points, numPoints);
+    if(cellSorted())
+    {
+      sortCells(points, numPoints, true);
+    }
+    else
+    {
+      resizeCounted(m_points, numPoints);
+      std::copy(points, points + numPoints, m_points.begin());
+      buildHashMap(m_points.data(), numPoints);
+    }
+    endBuild();
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::buildIndexed(const std::vector<PointT>& points) noexcept
+  {
+    buildIndexed(points.data(), points.size());
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::buildIndexed(const PointT* points, size_t numPoints) noexcept
+  {
+    spatialHashDetail::PhaseScope phase(m_recorder, "build indexed");
+    beginBuild();
+    clear();
+    fitToPoints(points, numPoints);
+    if(cellSorted())
+    {
+      sortCells(points, numPoints, false);
+    }
+    else
+    {
+      m_external = points;
+      buildHashMap(points, numPoints);
+    }
+    endBuild();
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::buildHashMap(const PointT* points, size_t numPoints) noexcept
+  {
+    // the map can't be filled concurrently but the hashing can
+    spatialHashDetail::PhaseScope phase(m_recorder, "hash keys");
+    resizeCounted(m_pointKey, numPoints);
+    buildPool().parallelFor(numPoints, [&](size_t begin, size_t end, size_t)
+    {
+      for(size_t i = begin; i < end; ++i)
+      {
+        m_pointKey[i] = hash(points[i]);
+      }
+    });
+    phase.next("fill table");
+    m_hashTable.reserve(m_occupiedHint);
+    for(size_t i = 0; i < numPoints; ++i)
+    {
+      m_hashTable[m_pointKey[i]].push_back(static_cast<uint32_t>(i));
+    }
+    m_occupiedHint = m_hashTable.size();
+    m_numPoints = numPoints;
+  }
+
+namespace spatialHashDetail
+{
+  // exclusive prefix sum of counter[0,size) in place, each block is summed on its own thread, the
+  // block totals are scanned serially and then each block writes its starts. Returns the total and
+  // adds the number of non zero counts to nonZero. blockSum and blockNonZero are scratch with room
+  // for numThreads() * 4 blocks
+  inline uint32_t exclusiveScan(ThreadPool& pool, std::atomic<uint32_t>* counter, size_t size, size_t& nonZero,
+                                uint32_t* blockSum, size_t* blockNonZero) noexcept
+  {
+    size_t numBlocks = std::min<size_t>(pool.numThreads() * 4, size);
+    size_t blockSize = (size + numBlocks - 1) / numBlocks;
+    std::fill(blockSum, blockSum + numBlocks, 0);
+    std::fill(blockNonZero, blockNonZero + numBlocks, 0);
+    pool.parallelFor(numBlocks, [&](size_t begin, size_t end, size_t)
+    {
+      for(size_t block = begin; block < end; ++block)
+      {
+        for(size_t b = block * blockSize; b < std::min((block + 1) * blockSize, size); ++b)
+        {
+          uint32_t count = counter[b].load(std::memory_order_relaxed);
+          blockSum[block] += count;
+          blockNonZero[block] += count != 0;
+        }
+      }
+    }, 1);
+    uint32_t sum = 0;
+    for(size_t block = 0; block < numBlocks; ++block)
+    {
+      uint32_t count = blockSum[block];
+      blockSum[block] = sum;
+      sum += count;
+      nonZero += blockNonZero[block];
+    }
+    pool.parallelFor(numBlocks, [&](size_t begin, size_t end, size_t)
+    {
+      for(size_t block = begin; block < end; ++block)
+      {
+        uint32_t start = blockSum[block];
+        for(size_t b = block * blockSize; b < std::min((block + 1) * blockSize, size); ++b)
+        {
+          uint32_t count = counter[b].load(std::memory_order_relaxed);
+          counter[b].store(start, std::memory_order_relaxed);
+          start += count;
+        }
+      }
+    }, 1);
+    return sum;
+  }
+}
+
+  template<typename PointT, int Dim, typename KeyT>
+  uint32_t BasicSpatialHash<PointT, Dim, KeyT>::chooseTable(size_t numPoints) noexcept
+  {
+    m_dense = false;
+    if(m_cellKey == CellKey::Dense || m_cellKey == CellKey::Auto)
+    {
+      const Coords& lower = m_haveDomain ? m_domainLower : m_lower;
+      const Coords& upper = m_haveDomain ? m_domainUpper : m_upper;
+      uint64_t limit = m_cellKey == CellKey::Dense ? maxDenseCells
+                                                   : std::min(maxDenseCells, maxDenseCellsPerPoint * std::max<uint64_t>(numPoints, 16));
+      // rounded as hashCoord does but counted in doubles, so a huge or empty box is turned down
+      // before anything is cast to int
+      double cells = 1;
+      for(int axis = 0; axis < Dim; ++axis)
+      {
+        double lo = static_cast<double>(std::floor(lower[axis] / m_cellSize));
+        double hi = static_cast<double>(std::floor(upper[axis] / m_cellSize));
+        bool fits = lo <= hi && lo > std::numeric_limits<int>::min() && hi < std::numeric_limits<int>::max();
+        cells = fits ? cells * (hi - lo + 1) : std::numeric_limits<double>::infinity();
+      }
+      if(cells <= static_cast<double>(limit))
+      {
+        m_dense = true;
+        int stride = 1;
+        for(int axis = 0; axis < Dim; ++axis)
+        {
+          m_gridOrigin[axis] = hashCoord(lower[axis]);
+          m_gridExtent[axis] = hashCoord(upper[axis]) - m_gridOrigin[axis] + 1;
+          m_gridStride[axis] = stride;
+          stride *= m_gridExtent[axis];
+        }
+        return static_cast<uint32_t>(cells);
+      }
+    }
+    // power of two table with roughly two buckets per point keeps collisions low
+    uint32_t tableSize = 16;
+    m_tableShift = 60;
+    while(tableSize < 2 * numPoints)
+    {
+      tableSize <<= 1;
+      --m_tableShift;
+    }
+    return tableSize;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::sortCells(const PointT* points, size_t numPoints, bool copyPoints) noexcept
+  {
+    using spatialHashDetail::exclusiveScan;
+    spatialHashDetail::PhaseScope phase(m_recorder, "count");
+    auto& pool = buildPool();
+    // a fresh layout has no tombstones, no moved points and new entry positions
+    m_entryOf.clear();
+    m_moved.clear();
+    m_movedSlot.clear();
+    uint32_t tableSize = chooseTable(numPoints);
+    if(m_bucketCounterSize < tableSize)
+    {
+      m_bucketCounter = std::make_unique<std::atomic<uint32_t>[]>(tableSize);
+      m_bucketCounterSize = tableSize;
+      ++m_allocations;
+    }
+    auto* counter = m_bucketCounter.get();
+    pool.parallelFor(tableSize, [&](size_t begin, size_t end, size_t)
+    {
+      for(size_t b = begin; b < end; ++b)
+      {
+        counter[b].store(0, std::memory_order_relaxed);
+      }
+    }, 1 << 16);
+    // hash and count per bucket
+    resizeCounted(m_pointBucket, numPoints);
+    pool.parallelFor(numPoints, [&](size_t begin, size_t end, size_t)
+    {
+      for(size_t i = begin; i < end; ++i)
+      {
+        if(removed(static_cast<uint32_t>(i)))
+        {
+          m_pointBucket[i] = noSlot;
+          continue;
+        }
+        uint32_t b = bucket(cellOf(points[i]));
+        m_pointBucket[i] = b;
+        counter[b].fetch_add(1, std::memory_order_relaxed);
+      }
+    });
+    // the counts become the write cursors for the scatter
+    phase.next("scan");
+    m_occupiedCells = 0;
+    resizeCounted(m_scanSum, pool.numThreads() * 4);
+    resizeCounted(m_scanNonZero, pool.numThreads() * 4);
+    uint32_t total = exclusiveScan(pool, counter, tableSize, m_occupiedCells, m_scanSum.data(), m_scanNonZero.data());
+    resizeCounted(m_cellStart, tableSize + 1);
+    m_cellStart[tableSize] = total;
+    pool.parallelFor(tableSize, [&](size_t begin, size_t end, size_t)
+    {
+      for(size_t b = begin; b < end; ++b)
+      {
+        m_cellStart[b] = counter[b].load(std::memory_order_relaxed);
+      }
+    }, 1 << 16);
+    phase.next("scatter");
+    // scatter the indices, threads race for slots within a bucket so each bucket is then sorted
+    // which keeps the layout the same whatever the thread count
+    resizeCounted(m_sortedIndex, total);
+    pool.parallelFor(numPoints, [&](size_t begin, size_t end, size_t)
+    {
+      for(size_t i = begin; i < end; ++i)
+      {
+        if(m_pointBucket[i] == noSlot)
+        {
+          continue;
+        }
+        m_sortedIndex[counter[m_pointBucket[i]].fetch_add(1, std::memory_order_relaxed)] = static_cast<uint32_t>(i);
+      }
+    });
+    // order each bucket by cell then input order so the cells sharing a bucket form runs, and
+    // count the runs
+    phase.next("sort buckets");
+    resizeCounted(m_sortScratch, pool.numThreads());
+    pool.parallelFor(tableSize, [&](size_t begin, size_t end, size_t worker)
+    {
+      auto& entries = m_sortScratch[worker].entries;
+      for(size_t b = begin; b < end; ++b)
+      {
+        uint32_t first = m_cellStart[b];
+        uint32_t last = m_cellStart[b + 1];
+        uint32_t numCells = first != last;
+        if(last - first > 1)
+        {
+          entries.clear();
+          m_sortScratch[worker].allocations += last - first > entries.capacity();
+          for(uint32_t e = first; e < last; ++e)
+          {
+            entries.push_back({cellOf(points[m_sortedIndex[e]]), m_sortedIndex[e]});
+          }
+          std::sort(entries.begin(), entries.end(), [](const SortEntry& a, const SortEntry& b)
+          {
+            return std::tie(a.cell, a.index) < std::tie(b.cell, b.index);
+          });
+          for(size_t n = 0; n < entries.size(); ++n)
+          {
+            m_sortedIndex[first + n] = entries[n].index;
+            numCells += n > 0 && entries[n].cell != entries[n - 1].cell;
+          }
+        }
+        counter[b].store(numCells, std::memory_order_relaxed);
+      }
+    }, 4096);
+    for(auto& scratch : m_sortScratch)
+    {
+      m_allocations += scratch.allocations;
+      scratch.allocations = 0;
+    }
+    phase.next("layout");
+    size_t unused = 0;
+    resizeCounted(m_cellList, exclusiveScan(pool, counter, tableSize, unused, m_scanSum.data(), m_scanNonZero.data()));
+    // the SoA layout always keeps its own copy as the distance tests read the coordinates directly
+    bool soa = m_storage == Storage::CellSortedSoA;
+    copyPoints = copyPoints || soa;
+    resizeCounted(m_sortedPoints, copyPoints && !soa ? total : 0);
+    for(auto& coords : m_sortedCoords)
+    {
+      resizeCounted(coords, soa ? total : 0);
+    }
+    pool.parallelFor(tableSize, [&](size_t begin, size_t end, size_t)
+    {
+      for(size_t b = begin; b < end; ++b)
+      {
+        uint32_t cell = counter[b].load(std::memory_order_relaxed);
+        for(uint32_t e = m_cellStart[b]; e < m_cellStart[b + 1]; ++e)
+        {
+          const auto& p = points[m_sortedIndex[e]];
+          Cell c = cellOf(p);
+          if(e == m_cellStart[b] || c != m_cellList[cell - 1].cell)
+          {
+            m_cellList[cell++] = {c, e};
+          }
+          if(soa)
+          {
+            for(int axis = 0; axis < Traits::dim; ++axis)
+            {
+              m_sortedCoords[axis][e] = coord(p, axis);
+            }
+          }
+          else if(copyPoints)
+          {
+            m_sortedPoints[e] = p;
+          }
+        }
+      }
+    }, 4096);
+    m_external = copyPoints ? nullptr : points;
+    m_numPoints = numPoints;
+    m_numEntries = total;
+    m_numRemoved = numPoints - total;
+    refreshView();
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::clear() noexcept
+  {
+    // a fresh table drops the nodes and bucket array in one go, the vectors below keep their
+    // capacity so a rebuild of the same size allocates nothing
+    m_hashTable = HashTable(m_bucketResource);
+    if(m_bucketResource == &m_arena)
+    {
+      m_arena.reset();
+    }
+    m_points.clear();
+    m_external = nullptr;
+    m_numPoints = 0;
+    ++m_generation;
+    m_concurrentBegin = m_concurrentEnd = 0;
+    m_concurrentClaimed.next.store(0, std::memory_order_relaxed);
+    m_lower = filled(std::numeric_limits<Scalar>::infinity());
+    m_upper = filled(-std::numeric_limits<Scalar>::infinity());
+    m_sortedPoints.clear();
+    for(auto& coords : m_sortedCoords)
+    {
+      coords.clear();
+    }
+    m_sortedIndex.clear();
+    m_cellStart.clear();
+    m_cellList.clear();
+    m_occupiedCells = 0;
+    m_dense = false;
+    m_pointKey.clear();
+    m_removed.clear();
+    m_numRemoved = 0;
+    m_numEntries = 0;
+    m_entryOf.clear();
+    m_moved.clear();
+    m_movedSlot.clear();
+    m_snapshot.close();
+    refreshView();
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::refreshView() noexcept
+  {
+    m_view.points = m_sortedPoints;
+    for(int axis = 0; axis < Traits::dim; ++axis)
+    {
+      m_view.coords[axis] = m_sortedCoords[axis];
+    }
+    m_view.index = m_sortedIndex;
+    m_view.cellStart = m_cellStart;
+    m_view.cells = m_cellList;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::detachSnapshot() noexcept
+  {
+    if(!m_snapshot.isOpen())
+    {
+      return;
+    }
+    m_sortedPoints.assign(m_view.points.begin(), m_view.points.end());
+    for(int axis = 0; axis < Traits::dim; ++axis)
+    {
+      m_sortedCoords[axis].assign(m_view.coords[axis].begin(), m_view.coords[axis].end());
+    }
+    m_sortedIndex.assign(m_view.index.begin(), m_view.index.end());
+    m_cellStart.assign(m_view.cellStart.begin(), m_view.cellStart.end());
+    m_cellList.assign(m_view.cells.begin(), m_view.cells.end());
+    m_snapshot.close();
+    refreshView();
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  bool BasicSpatialHash<PointT, Dim, KeyT>::saveSnapshot(const std::string& path) const noexcept
+  {
+    using namespace spatialHashDetail;
+    // the arrays are written and mapped back as raw bytes
+    if constexpr(!std::is_trivially_copyable<PointT>::value || !std::is_trivially_copyable<Scalar>::value)
+    {
+      return false;
+    }
+    if(!cellSorted() || m_external || m_view.cellStart.empty() || !m_points.empty() || !m_moved.empty() || m_numRemoved > 0)
+    {
+      return false;
+    }
+    auto align = [](uint64_t offset){ return (offset + snapshotAlign - 1) / snapshotAlign * snapshotAlign; };
+    bool soa = m_storage == Storage::CellSortedSoA;
+    SnapshotHeader header = {};
+    std::memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+    header.version = snapshotVersion;
+    header.byteOrder = snapshotByteOrder;
+    header.pointSize = sizeof(PointT);
+    header.scalarSize = sizeof(Scalar);
+    header.keySize = sizeof(KeyT);
+    header.cellRecordSize = sizeof(OccupiedCell);
+    header.dim = Dim;
+    header.pointDim = Traits::dim;
+    header.storage = static_cast<uint8_t>(m_storage);
+    header.cellKey = static_cast<uint8_t>(m_cellKey);
+    header.dense = m_dense;
+    header.tableShift = m_tableShift;
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      header.gridOrigin[axis] = m_gridOrigin[axis];
+      header.gridExtent[axis] = m_gridExtent[axis];
+    }
+    header.cellSize = static_cast<double>(m_cellSize);
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      header.lower[axis] = static_cast<double>(m_lower[axis]);
+      header.upper[axis] = static_cast<double>(m_upper[axis]);
+    }
+    header.numPoints = m_numPoints;
+    header.numEntries = m_numEntries;
+    header.numCellStarts = m_view.cellStart.size();
+    header.numCells = m_view.cells.size();
+    header.occupiedCells = m_occupiedCells;
+    header.indexOffset = align(sizeof(SnapshotHeader));
+    header.cellStartOffset = align(header.indexOffset + m_numEntries * sizeof(uint32_t));
+    header.cellsOffset = align(header.cellStartOffset + header.numCellStarts * sizeof(uint32_t));
+    header.pointsOffset = align(header.cellsOffset + header.numCells * sizeof(OccupiedCell));
+    header.coordsOffset = align(header.pointsOffset + (soa ? 0 : m_numEntries * sizeof(PointT)));
+    header.coordsStride = soa ? align(m_numEntries * sizeof(Scalar)) : 0;
+    header.fileSize = header.coordsOffset + Traits::dim * header.coordsStride;
+
+    // write beside the target and rename over it, processes still mapping the old file keep
+    // their pages instead of seeing it truncated under them
+    std::string temp = path + ".tmp";
+    std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+    uint64_t written = 0;
+    auto put = [&](uint64_t offset, const void* data, uint64_t bytes)
+    {
+      static const char zeros[snapshotAlign] = {};
+      out.write(zeros, static_cast<std::streamsize>(offset - written));
+      if(bytes > 0)
+      {
+        out.write(static_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+      }
+      written = offset + bytes;
+    };
+    put(0, &header, sizeof(header));
+    put(header.indexOffset, m_view.index.data(), m_numEntries * sizeof(uint32_t));
+    put(header.cellStartOffset, m_view.cellStart.data(), header.numCellStarts * sizeof(uint32_t));
+    put(header.cellsOffset, m_view.cells.data(), header.numCells * sizeof(OccupiedCell));
+    if(soa)
+    {
+      for(int axis = 0; axis < Traits::dim; ++axis)
+      {
+        put(header.coordsOffset + axis * header.coordsStride, m_view.coords[axis].data(), m_numEntries * sizeof(Scalar));
+      }
+    }
+    else
+    {
+      put(header.pointsOffset, m_view.points.data(), m_numEntries * sizeof(PointT));
+    }
+    put(header.fileSize, nullptr, 0);
+    out.close();
+    if(!out || std::rename(temp.c_str(), path.c_str()) != 0)
+    {
+      std::remove(temp.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  bool BasicSpatialHash<PointT, Dim, KeyT>::openSnapshot(const std::string& path) noexcept
+  {
+    using namespace spatialHashDetail;
+    clear();
+    if constexpr(!std::is_trivially_copyable<PointT>::value || !std::is_trivially_copyable<Scalar>::value)
+    {
+      return false;
+    }
+    if(!m_snapshot.open(path) || m_snapshot.size() < sizeof(SnapshotHeader))
+    {
+      m_snapshot.close();
+      return false;
+    }
+    const std::byte* data = m_snapshot.data();
+    SnapshotHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    bool soa = header.storage == static_cast<uint8_t>(Storage::CellSortedSoA);
+    // a dense grid has one cell start per grid cell, a hashed table a power of two of them
+    uint64_t gridCells = 1;
+    for(int axis = 0; axis < Dim && header.dense; ++axis)
+    {
+      gridCells = header.gridExtent[axis] > 0 ? std::min<uint64_t>(gridCells * header.gridExtent[axis], maxDenseCells + 1) : maxDenseCells + 1;
+    }
+    bool tableValid = header.dense ? header.dense == 1 && gridCells <= maxDenseCells && header.numCellStarts == gridCells + 1
+                                   : header.tableShift >= 32 && header.tableShift <= 60 &&
+                                     header.numCellStarts == (uint64_t(1) << (64 - header.tableShift)) + 1;
+    // count items of size bytes at offset lie inside the file
+    auto fits = [&](uint64_t offset, uint64_t count, uint64_t size)
+    {
+      return offset % snapshotAlign == 0 && offset <= header.fileSize && count <= (header.fileSize - offset) / size;
+    };
+    bool valid = std::memcmp(header.magic, snapshotMagic, sizeof(header.magic)) == 0 &&
+                 header.version == snapshotVersion && header.byteOrder == snapshotByteOrder &&
+                 header.pointSize == sizeof(PointT) && header.scalarSize == sizeof(Scalar) &&
+                 header.keySize == sizeof(KeyT) && header.cellRecordSize == sizeof(OccupiedCell) &&
+                 header.dim == Dim && header.pointDim == Traits::dim &&
+                 (header.storage == static_cast<uint8_t>(Storage::CellSorted) || soa) &&
+                 header.cellKey <= static_cast<uint8_t>(CellKey::Auto) &&
+                 header.fileSize == m_snapshot.size() && tableValid &&
+                 header.numEntries <= header.numPoints && header.numPoints <= std::numeric_limits<uint32_t>::max() &&
+                 fits(header.indexOffset, header.numEntries, sizeof(uint32_t)) &&
+                 fits(header.cellStartOffset, header.numCellStarts, sizeof(uint32_t)) &&
+                 fits(header.cellsOffset, header.numCells, sizeof(OccupiedCell)) &&
+                 (soa ? header.coordsStride % snapshotAlign == 0 && header.coordsStride >= header.numEntries * sizeof(Scalar) &&
+                        fits(header.coordsOffset, Traits::dim, header.coordsStride)
+                      : fits(header.pointsOffset, header.numEntries, sizeof(PointT)));
+    // every index the queries follow must stay in its array, so the buckets run in order from the
+    // first entry to the last, the ids name points and the occupied cells start in order on entries.
+    // One pass over the index and tables, the coordinates themselves are trusted
+    if(valid)
+    {
+      const uint32_t* cellStart = reinterpret_cast<const uint32_t*>(data + header.cellStartOffset);
+      valid = cellStart[0] == 0 && cellStart[header.numCellStarts - 1] == header.numEntries;
+      for(uint64_t b = 1; b < header.numCellStarts && valid; ++b)
+      {
+        valid = cellStart[b - 1] <= cellStart[b];
+      }
+      const uint32_t* index = reinterpret_cast<const uint32_t*>(data + header.indexOffset);
+      for(uint64_t e = 0; e < header.numEntries && valid; ++e)
+      {
+        valid = index[e] < header.numPoints;
+      }
+      OccupiedCell cell{};
+      for(uint64_t c = 0; c < header.numCells && valid; ++c)
+      {
+        uint32_t previous = cell.start;
+        std::memcpy(&cell, data + header.cellsOffset + c * sizeof(OccupiedCell), sizeof(cell));
+        valid = cell.start < header.numEntries && (c == 0 ? cell.start == 0 : cell.start > previous);
+      }
+    }
+    if(!valid)
+    {
+      m_snapshot.close();
+      return false;
+    }
+    m_storage = static_cast<Storage>(header.storage);
+    m_cellKey = static_cast<CellKey>(header.cellKey);
+    m_cellSize = static_cast<Scalar>(header.cellSize);
+    m_tableShift = header.tableShift;
+    m_dense = header.dense;
+    int stride = 1;
+    for(int axis = 0; axis < Dim && m_dense; ++axis)
+    {
+      m_gridOrigin[axis] = header.gridOrigin[axis];
+      m_gridExtent[axis] = header.gridExtent[axis];
+      m_gridStride[axis] = stride;
+      stride *= m_gridExtent[axis];
+    }
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      m_lower[axis] = static_cast<Scalar>(header.lower[axis]);
+      m_upper[axis] = static_cast<Scalar>(header.upper[axis]);
+    }
+    m_numPoints = header.numPoints;
+    m_numEntries = header.numEntries;
+    m_occupiedCells = header.occupiedCells;
+    m_view.index = {reinterpret_cast<const uint32_t*>(data + header.indexOffset), header.numEntries};
+    m_view.cellStart = {reinterpret_cast<const uint32_t*>(data + header.cellStartOffset), header.numCellStarts};
+    m_view.cells = {reinterpret_cast<const OccupiedCell*>(data + header.cellsOffset), header.numCells};
+    if(soa)
+    {
+      for(int axis = 0; axis < Traits::dim; ++axis)
+      {
+        m_view.coords[axis] = {reinterpret_cast<const Scalar*>(data + header.coordsOffset + axis * header.coordsStride), header.numEntries};
+      }
+    }
+    else
+    {
+      m_view.points = {reinterpret_cast<const PointT*>(data + header.pointsOffset), header.numEntries};
+    }
+    return true;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  std::vector<PointT> BasicSpatialHash<PointT, Dim, KeyT>::query(const PointT& point, Scalar radius) const noexcept
+  {
+    std::vector<PointT> result;
+    forEachInRadius(point, radius, [&result](uint32_t, const PointT& p){ result.push_back(p); });
+    return result;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::queryIndices(const PointT& point, Scalar radius, std::vector<uint32_t>& result) const noexcept
+  {
+    forEachInRadius(point, radius, [&result](uint32_t id, const PointT&){ result.push_back(id); });
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::queryBox(const PointT& lower, const PointT& upper, std::vector<uint32_t>& result) const noexcept
+  {
+    forEachInBox(lower, upper, [&result](uint32_t id, const PointT&){ result.push_back(id); });
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::querySegment(const PointT& a, const PointT& b, Scalar thickness, std::vector<uint32_t>& result) const noexcept
+  {
+    forEachOnSegment(a, b, thickness, [&result](uint32_t id, const PointT&){ result.push_back(id); });
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  bool BasicSpatialHash<PointT, Dim, KeyT>::firstOnSegment(const PointT& a, const PointT& b, Scalar thickness, SegmentHit& hit) const noexcept
+  {
+    spatialHashDetail::QueryScope scope(m_recorder);
+    Scalar length = 0;
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      length += (coord(b, axis) - coord(a, axis)) * (coord(b, axis) - coord(a, axis));
+    }
+    length = std::sqrt(length);
+    // a point found around a crossed cell is at most this far (in t) before where the walk
+    // entered that cell, the point is within reach + 1 cells of it along every axis
+    Scalar reach = std::ceil(std::max(thickness, Scalar(0)) / m_cellSize);
+    Scalar slack = length > 0 ? (reach + 1) * m_cellSize * std::sqrt(static_cast<Scalar>(Dim)) / length : std::numeric_limits<Scalar>::infinity();
+    bool found = false;
+    segmentQuery(a, b, thickness, [&](uint32_t id, const PointT& p, Scalar t)
+    {
+      if(!found || t < hit.t)
+      {
+        Scalar d = 0;
+        for(int axis = 0; axis < Dim; ++axis)
+        {
+          Scalar s = coord(p, axis) - coord(a, axis) - t * (coord(b, axis) - coord(a, axis));
+          d += s * s;
+        }
+        hit = {t, d, id, p};
+        found = true;
+      }
+    }, [&](Scalar t){ return !found || t - slack <= hit.t; });
+    scope.accept(found);
+    return found;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  auto BasicSpatialHash<PointT, Dim, KeyT>::occupiedBounds() const noexcept -> CellRange
+  {
+    CellRange bounds;
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      bounds.lo[axis] = hashCoord(m_lower[axis]);
+      bounds.hi[axis] = hashCoord(m_upper[axis]);
+    }
+    return bounds;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  bool BasicSpatialHash<PointT, Dim, KeyT>::clipSegment(const PointT& a, const Coords& direction, Scalar margin, Scalar& t0, Scalar& t1) const noexcept
+  {
+    // slabs, the part of the segment between the two faces of each axis
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      Scalar lo = m_lower[axis] - margin;
+      Scalar hi = m_upper[axis] + margin;
+      Scalar p = coord(a, axis);
+      if(direction[axis] == 0)
+      {
+        if(!(p >= lo && p <= hi))
+        {
+          return false;
+        }
+        continue;
+      }
+      Scalar enter = (lo - p) / direction[axis];
+      Scalar leave = (hi - p) / direction[axis];
+      if(enter > leave)
+      {
+        std::swap(enter, leave);
+      }
+      t0 = std::max(t0, enter);
+      t1 = std::min(t1, leave);
+    }
+    return t0 <= t1;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::queryBatch(const PointT* centres, size_t numCentres, Scalar radius, BatchResult& result) const noexcept
+  {
+    queryBatch(centres, numCentres, radius, nullptr, result);
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::queryBatch(const PointT* centres, size_t numCentres, const Scalar* radii, BatchResult& result) const noexcept
+  {
+    queryBatch(centres, numCentres, Scalar(0), radii, result);
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::queryBatch(const std::vector<PointT>& centres, Scalar radius, BatchResult& result) const noexcept
+  {
+    queryBatch(centres.data(), centres.size(), radius, nullptr, result);
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::beginBatch(size_t numCentres, BatchResult& result) noexcept
+  {
+    result.workers.resize(ThreadPool::global().numThreads());
+    for(auto& w : result.workers)
+    {
+      w.indices.clear();
+      w.points.clear();
+      w.chunks.clear();
+    }
+    result.offsets.resize(numCentres + 1);
+    result.offsets[0] = 0;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::queryBatch(const PointT* centres, size_t numCentres, Scalar radius, const Scalar* radii, BatchResult& result) const noexcept
+  {
+    spatialHashDetail::PhaseScope phase(m_recorder, "query batch", "query");
+    beginBatch(numCentres, result);
+    // each worker answers a run of centres into its own buffer, the count of centre i goes in
+    // offsets[i+1] which no other worker touches
+    ThreadPool::global().parallelFor(numCentres, [&](size_t begin, size_t end, size_t worker)
+    {
+      auto& buffer = result.workers[worker];
+      buffer.chunks.push_back({begin, end, buffer.indices.size()});
+      for(size_t i = begin; i < end; ++i)
+      {
+        size_t before = buffer.indices.size();
+        forEachInRadius(centres[i], radii ? radii[i] : radius, [&](uint32_t id, const PointT& p)
+        {
+          buffer.indices.push_back(id);
+          if(result.withPoints)
+          {
+            buffer.points.push_back(p);
+          }
+        });
+        result.offsets[i + 1] = buffer.indices.size() - before;
+      }
+    }, 64);
+    finishBatch(numCentres, result);
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::finishBatch(size_t numCentres, BatchResult& result) noexcept
+  {
+    auto& pool = ThreadPool::global();
+    for(size_t i = 0; i < numCentres; ++i)
+    {
+      result.offsets[i + 1] += result.offsets[i];
+    }
+    // each run of centres is contiguous in both the worker buffer and the output
+    result.indices.resize(result.offsets[numCentres]);
+    result.neighbours.resize(result.withPoints ? result.offsets[numCentres] : 0);
+    pool.parallelFor(result.workers.size(), [&](size_t begin, size_t end, size_t)
+    {
+      for(size_t w = begin; w < end; ++w)
+      {
+        const auto& buffer = result.workers[w];
+        for(const auto& chunk : buffer.chunks)
+        {
+          size_t count = result.offsets[chunk.end] - result.offsets[chunk.begin];
+          auto first = buffer.indices.begin() + chunk.bufferStart;
+          std::copy(first, first + count, result.indices.begin() + result.offsets[chunk.begin]);
+          if(result.withPoints)
+          {
+            auto firstPoint = buffer.points.begin() + chunk.bufferStart;
+            std::copy(firstPoint, firstPoint + count, result.neighbours.begin() + result.offsets[chunk.begin]);
+          }
+        }
+      }
+    }, 1);
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  size_t BasicSpatialHash<PointT, Dim, KeyT>::kNearest(const PointT& point, size_t k, Nearest* out) const noexcept
+  {
+    spatialHashDetail::QueryScope scope(m_recorder);
+    if(k == 0 || numPoints() == 0 || (cellSorted() && m_view.cellStart.empty()))
+    {
+      return 0;
+    }
+    // max heap on distance in out[0,found), the worst of the best k is on top
+    size_t found = 0;
+    auto closer = [](const Nearest& a, const Nearest& b){ return a.distanceSquared < b.distanceSquared; };
+    auto consider = [&](uint32_t id, const PointT& p)
+    {
+      Scalar d = distanceSquared(p, point);
+      if(found < k)
+      {
+        out[found++] = {d, id, p};
+        std::push_heap(out, out + found, closer);
+      }
+      else if(d < out[0].distanceSquared)
+      {
+        std::pop_heap(out, out + k, closer);
+        out[k - 1] = {d, id, p};
+        std::push_heap(out, out + k, closer);
+      }
+    };
+    auto worst = [&]
+    {
+      return found < k ? std::numeric_limits<Scalar>::infinity() : out[0].distanceSquared;
+    };
+    for(const auto& moved : m_moved)
+    {
+      consider(moved.id, moved.position);
+    }
+    Cell centre = cellOf(point);
+    // cells holding points, no shell needs to go past them
+    CellRange bounds = occupiedBounds();
+    int lastShell = 0;
+    // distance from the point to the nearest face of its cell, every cell outside shell s is at
+    // least s cells plus this far away
+    Scalar margin = std::numeric_limits<Scalar>::infinity();
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      lastShell = std::max({lastShell, centre[axis] - bounds.lo[axis], bounds.hi[axis] - centre[axis]});
+      Scalar x = coord(point, axis);
+      margin = std::min({margin, x - centre[axis] * m_cellSize, (centre[axis] + 1) * m_cellSize - x});
+    }
+    size_t walkCost = cellSorted() ? m_view.cells.size() : m_numPoints;
+    for(int s = 0; s <= lastShell; ++s)
+    {
+      // once the cube of shells probes more than a walk over everything would cost, do the walk
+      uint64_t side = 2 * static_cast<uint64_t>(s) + 1;
+      if(static_cast<double>(spatialHashDetail::power(side, Dim)) * probeCost > static_cast<double>(walkCost))
+      {
+        found = 0;
+        for(const auto& moved : m_moved)
+        {
+          consider(moved.id, moved.position);
+        }
+        CellRange all;
+        all.lo.fill(std::numeric_limits<int>::min());
+        all.hi.fill(std::numeric_limits<int>::max());
+        forEachOccupied(all, point, std::numeric_limits<Scalar>::infinity(), consider);
+        break;
+      }
+      // the faces of the cube of side 2s+1 clipped to the occupied cells, the last axis only
+      // visits its two ends unless another axis is already on a face
+      CellRange rows;
+      for(int axis = 0; axis < Dim; ++axis)
+      {
+        rows.lo[axis] = std::max(centre[axis] - s, bounds.lo[axis]);
+        rows.hi[axis] = std::min(centre[axis] + s, bounds.hi[axis]);
+      }
+      rows.lo[Dim - 1] = rows.hi[Dim - 1] = 0;
+      forEachCellIn(rows, [&](Cell cell)
+      {
+        bool onFace = s == 0;
+        for(int axis = 0; axis + 1 < Dim; ++axis)
+        {
+          onFace = onFace || std::abs(cell[axis] - centre[axis]) == s;
+        }
+        int step = onFace ? 1 : 2 * s;
+        for(int k = centre[Dim - 1] - s; k <= centre[Dim - 1] + s; k += step)
+        {
+          if(k >= bounds.lo[Dim - 1] && k <= bounds.hi[Dim - 1])
+          {
+            cell[Dim - 1] = k;
+            forEachInCell(cell, point, worst(), consider);
+          }
+        }
+      });
+      Scalar reach = s * m_cellSize + margin;
+      if(found == k && out[0].distanceSquared <= reach * reach)
+      {
+        break;
+      }
+    }
+    SPATIALHASH_TALLY(candidates, m_moved.size());
+    std::sort_heap(out, out + found, closer);
+    scope.accept(found);
+    return found;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  auto BasicSpatialHash<PointT, Dim, KeyT>::kNearest(const PointT& point, size_t k) const noexcept -> std::vector<Nearest>
+  {
+    std::vector<Nearest> result(std::min(k, numPoints()));
+    result.resize(kNearest(point, result.size(), result.data()));
+    return result;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::kNearestBatch(const PointT* centres, size_t numCentres, size_t k, BatchResult& result) const noexcept
+  {
+    spatialHashDetail::PhaseScope phase(m_recorder, "k nearest batch", "query");
+    beginBatch(numCentres, result);
+    ThreadPool::global().parallelFor(numCentres, [&](size_t begin, size_t end, size_t worker)
+    {
+      auto& buffer = result.workers[worker];
+      buffer.nearest.resize(k);
+      buffer.chunks.push_back({begin, end, buffer.indices.size()});
+      for(size_t i = begin; i < end; ++i)
+      {
+        size_t count = kNearest(centres[i], k, buffer.nearest.data());
+        for(size_t n = 0; n < count; ++n)
+        {
+          buffer.indices.push_back(buffer.nearest[n].id);
+          if(result.withPoints)
+          {
+            buffer.points.push_back(buffer.nearest[n].position);
+          }
+        }
+        result.offsets[i + 1] = count;
+      }
+    }, 64);
+    finishBatch(numCentres, result);
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::halfStencil(Scalar radius, std::vector<Cell>& stencil) const noexcept
+  {
+    stencil.clear();
+    int reach = std::max(1, static_cast<int>(std::ceil(radius / m_cellSize)));
+    CellRange cube;
+    cube.lo.fill(-reach);
+    cube.hi.fill(reach);
+    forEachCellIn(cube, [&](const Cell& offset)
+    {
+      // the forward half has its first non zero offset positive
+      int axis = 0;
+      while(axis < Dim && offset[axis] == 0)
+      {
+        ++axis;
+      }
+      if(axis == Dim || offset[axis] < 0)
+      {
+        return;
+      }
+      // closest two points of the cells can get, skip cells the radius can't reach
+      Scalar gap = 0;
+      for(axis = 0; axis < Dim; ++axis)
+      {
+        Scalar g = std::max(std::abs(offset[axis]) - 1, 0) * m_cellSize;
+        gap += g * g;
+      }
+      if(gap <= radius * radius)
+      {
+        stencil.push_back(offset);
+      }
+    });
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::buildNeighbourList(Scalar radius, NeighbourList& result) const noexcept
+  {
+    spatialHashDetail::PhaseScope phase(m_recorder, "neighbour list", "query");
+    spatialHashDetail::QueryScope scope(m_recorder);
+    auto& pool = ThreadPool::global();
+    std::vector<Cell> stencil;
+    halfStencil(radius, stencil);
+    result.workers.resize(pool.numThreads());
+    for(auto& pairs : result.workers)
+    {
+      pairs.clear();
+    }
+    // find each pair once
+    pool.parallelFor(numPairItems(), [&](size_t begin, size_t end, size_t worker)
+    {
+      // the workers' counts are their own, folded into the totals as each range finishes
+      spatialHashDetail::TallyScope share(m_recorder);
+      auto& pairs = result.workers[worker];
+      forEachPairInItems(begin, end, radius, stencil, [&](uint32_t a, uint32_t b, const PointT&, const PointT&)
+      {
+        share.accept();
+        pairs.emplace_back(a, b);
+      });
+    }, 256);
+    forEachMovedPair(radius, [&](uint32_t a, uint32_t b, const PointT&, const PointT&)
+    {
+      scope.accept();
+      result.workers[0].emplace_back(a, b);
+    });
+    // each thread owns a block of rows and reads every pair buffer, touching only the ends that
+    // fall in its rows. That reads the pairs once per thread but needs no atomics, which cost far
+    // more than the extra reads
+    size_t numIds = m_numPoints;
+    size_t numBlocks = pool.numThreads();
+    size_t rowsPerBlock = (numIds + numBlocks - 1) / numBlocks;
+    auto forEachEnd = [&](size_t block, auto&& func)
+    {
+      size_t lo = block * rowsPerBlock;
+      size_t hi = std::min(lo + rowsPerBlock, numIds);
+      for(const auto& pairs : result.workers)
+      {
+        for(const auto& pair : pairs)
+        {
+          if(pair.first >= lo && pair.first < hi)
+          {
+            func(pair.first, pair.second);
+          }
+          if(pair.second >= lo && pair.second < hi)
+          {
+            func(pair.second, pair.first);
+          }
+        }
+      }
+    };
+    auto& cursor = result.cursor;
+    cursor.assign(numIds, 0);
+    pool.parallelFor(numBlocks, [&](size_t begin, size_t end, size_t)
+    {
+      for(size_t block = begin; block < end; ++block)
+      {
+        forEachEnd(block, [&](uint32_t row, uint32_t){ ++cursor[row]; });
+      }
+    }, 1);
+    // the degrees become the row starts and the write cursors
+    result.offsets.resize(numIds + 1);
+    result.offsets[0] = 0;
+    for(size_t id = 0; id < numIds; ++id)
+    {
+      result.offsets[id + 1] = result.offsets[id] + cursor[id];
+      cursor[id] = static_cast<uint32_t>(result.offsets[id]);
+    }
+    result.indices.resize(result.offsets[numIds]);
+    pool.parallelFor(numBlocks, [&](size_t begin, size_t end, size_t)
+    {
+      for(size_t block = begin; block < end; ++block)
+      {
+        forEachEnd(block, [&](uint32_t row, uint32_t other){ result.indices[cursor[row]++] = other; });
+      }
+    }, 1);
+    // rows fill in whatever order the threads found the pairs, sort them so the list is repeatable
+    pool.parallelFor(numIds, [&](size_t begin, size_t end, size_t)
+    {
+      for(size_t id = begin; id < end; ++id)
+      {
+        std::sort(result.indices.begin() + result.offsets[id], result.indices.begin() + result.offsets[id + 1]);
+      }
+    }, 1024);
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  KeyT BasicSpatialHash<PointT, Dim, KeyT>::hash(const PointT& point) const noexcept
+  {
+    return hashIndex(cellOf(point));
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  void BasicSpatialHash<PointT, Dim, KeyT>::debug() const noexcept
+  {
+    auto print = [](const PointT& p)
+    {
+      std::cout<<'[';
+      for(int axis = 0; axis < Traits::dim; ++axis)
+      {
+        std::cout<<(axis ? "," : "")<<coord(p, axis);
+      }
+      std::cout<<']';
+    };
+   std::cout<<"************************************\n";
+    for(uint32_t b = 0; b + 1 < m_view.cellStart.size(); ++b)
+    {
+      if(m_view.cellStart[b] == m_view.cellStart[b + 1])
+      {
+        continue;
+      }
+      std::cout<<"bucket "<<b<<'\n';
+      for(uint32_t e = m_view.cellStart[b]; e < m_view.cellStart[b + 1]; ++e)
+      {
+        PointT p = sortedPoint(e);
+        if(!dead(p))
+        {
+          std::cout<<"point "<<m_view.index[e]<<' ';
+          print(p);
+          std::cout<<'\n';
+        }
+      }
+    }
+    for(const auto& moved : m_moved)
+    {
+      std::cout<<"moved "<<moved.id<<' ';
+      print(moved.position);
+      std::cout<<'\n';
+    }
+    m_hashTable.forEach([&](KeyT key, const auto& ids)
+    {
+      std::cout<<"hash "<<key<<'\n';
+      for(auto id : ids)
+      {
+        std::cout<<"point "<<id<<' ';
+        print(hashMapPoints()[id]);
+        std::cout<<'\n';
+      }
+    });
+    std::cout<<"************************************\n";
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  inline PointT BasicSpatialHash<PointT, Dim, KeyT>::sortedPoint(uint32_t e) const noexcept
+  {
+    if(m_storage == Storage::CellSortedSoA)
+    {
+      return soaPoint(e);
+    }
+    return m_view.points.empty() ? m_external[m_view.index[e]] : m_view.points[e];
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  auto BasicSpatialHash<PointT, Dim, KeyT>::cellStats() const noexcept -> CellStats
+  {
+    CellStats stats;
+    stats.points = numPoints();
+    // exact cell of each point in a bucket, these are independent of the key mode
+    std::vector<Cell> cells;
+    auto addBucket = [&](auto begin, auto end, auto pointOf)
+    {
+      size_t count = static_cast<size_t>(end - begin);
+      size_t bin = 0;
+      for(size_t c = count; c != 0 && bin + 1 < stats.occupancy.size(); c >>= 1)
+      {
+        ++bin;
+      }
+      ++stats.occupancy[bin];
+      if(count == 0)
+      {
+        return;
+      }
+      cells.clear();
+      for(auto it = begin; it != end; ++it)
+      {
+        PointT p = pointOf(it);
+        // tombstones left by moved and removed points still cost a test but belong to no cell
+        if(!dead(p))
+        {
+          cells.push_back(cellOf(p));
+        }
+      }
+      size_t live = cells.size();
+      std::sort(cells.begin(), cells.end());
+      size_t numCells = static_cast<size_t>(std::unique(cells.begin(), cells.end()) - cells.begin());
+      ++stats.buckets;
+      stats.cells += numCells;
+      stats.sharedBuckets += numCells > 1;
+      stats.maxBucket = std::max(stats.maxBucket, count);
+      // probing each cell once tests every point of the bucket, only its own points can match
+      stats.wastedTests += count * std::max<size_t>(numCells, 1) - live;
+    };
+    if(cellSorted())
+    {
+      for(uint32_t b = 0; b + 1 < m_view.cellStart.size(); ++b)
+      {
+        addBucket(m_view.cellStart[b], m_view.cellStart[b + 1], [this](uint32_t e){ return sortedPoint(e); });
+      }
+    }
+    else
+    {
+      const PointT* points = hashMapPoints();
+      m_hashTable.forEach([&](KeyT, const auto& ids)
+      {
+        addBucket(ids.begin(), ids.end(), [points](auto it){ return points[*it]; });
+      });
+      stats.occupancy[0] += m_hashTable.capacity() - m_hashTable.size();
+    }
+    return stats;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  size_t BasicSpatialHash<PointT, Dim, KeyT>::bytesUsed() const noexcept
+  {
+    auto bytes = [](const auto& v){ return v.capacity() * sizeof(v[0]); };
+    size_t total = sizeof(*this) + m_arena.capacity() + m_bucketCounterSize * sizeof(std::atomic<uint32_t>);
+    total += bytes(m_points) + bytes(m_removed) + bytes(m_sortedPoints) + bytes(m_sortedIndex) + bytes(m_cellStart);
+    total += bytes(m_cellList) + bytes(m_entryOf) + bytes(m_moved) + bytes(m_movedSlot) + bytes(m_pointKey);
+    total += bytes(m_pointBucket) + bytes(m_boxMin) + bytes(m_boxMax) + bytes(m_scanSum) + bytes(m_scanNonZero) + bytes(m_lastMove);
+    for(const auto& coords : m_sortedCoords)
+    {
+      total += bytes(coords);
+    }
+    for(const auto& scratch : m_sortScratch)
+    {
+      total += bytes(scratch.entries);
+    }
+    for(const auto& crossings : m_crossings)
+    {
+      total += bytes(crossings);
+    }
+    // the table's own arrays, its id lists come from the arena unless a resource was given
+    total += m_hashTable.capacity() * (1 + sizeof(KeyT) + sizeof(std::pmr::vector<uint32_t>));
+    if(m_bucketResource != &m_arena)
+    {
+      m_hashTable.forEach([&](KeyT, const auto& ids){ total += bytes(ids); });
+    }
+    return total;
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  bool BasicSpatialHash<PointT, Dim, KeyT>::writeStatsJson(const std::string& path) const noexcept
+  {
+    static const char* storageNames[] = {"HashMap", "CellSorted", "CellSortedSoA"};
+    static const char* keyNames[] = {"Hashed", "Packed", "Morton", "Dense", "Auto"};
+    CellStats cells = cellStats();
+    QueryStats queries = queryStats();
+    std::ofstream out(path, std::ios::trunc);
+    out << "{\n  \"enabled\": " << (spatialHashDetail::StatsRecorder::enabled ? "true" : "false")
+        << ",\n  \"storage\": \"" << storageNames[static_cast<int>(m_storage)]
+        << "\",\n  \"cellKey\": \"" << keyNames[static_cast<int>(m_cellKey)]
+        << "\",\n  \"dense\": " << (m_dense ? "true" : "false")
+        << ",\n  \"cellSize\": " << m_cellSize
+        << ",\n  \"points\": " << cells.points << ",\n  \"cells\": " << cells.cells
+        << ",\n  \"buckets\": " << cells.buckets << ",\n  \"collisions\": " << cells.sharedBuckets
+        << ",\n  \"maxBucket\": " << cells.maxBucket << ",\n  \"wastedTests\": " << cells.wastedTests
+        << ",\n  \"occupancy\": [";
+    for(size_t bin = 0; bin < cells.occupancy.size(); ++bin)
+    {
+      out << (bin ? ", " : "") << cells.occupancy[bin];
+    }
+    out << "],\n  \"bytesUsed\": " << bytesUsed() << ",\n  \"mappedBytes\": " << m_snapshot.size()
+        << ",\n  \"allocationsLastBuild\": " << m_allocations
+        << ",\n  \"queries\": {\"count\": " << queries.queries << ", \"cellsVisited\": " << queries.cellsVisited
+        << ", \"emptyProbes\": " << queries.emptyProbes << ", \"candidates\": " << queries.candidates
+        << ", \"accepted\": " << queries.accepted << ", \"nanoseconds\": " << queries.nanoseconds
+        << "},\n  \"phases\": [";
+    bool first = true;
+    for(const auto& event : m_recorder.events())
+    {
+      out << (first ? "\n    " : ",\n    ") << "{\"name\": \"" << event.name << "\", \"category\": \"" << event.category
+          << "\", \"start\": " << event.start << ", \"nanoseconds\": " << event.duration << '}';
+      first = false;
+    }
+    out << (first ? "]\n}\n" : "\n  ]\n}\n");
+    out.close();
+    return static_cast<bool>(out);
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  bool BasicSpatialHash<PointT, Dim, KeyT>::writeChromeTrace(const std::string& path) const noexcept
+  {
+    std::ofstream out(path, std::ios::trunc);
+    m_recorder.writeChromeTrace(out);
+    out.close();
+    return static_cast<bool>(out);
+  }
+
+  template<typename PointT, int Dim, typename KeyT>
+  size_t BasicSpatialHash<PointT, Dim, KeyT>::size() const noexcept
+  {
+    if(cellSorted())
+    {
+      return m_occupiedCells;
+    }
+    return m_hashTable.size();
+  }
+
+#endif
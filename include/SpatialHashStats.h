@@ -0,0 +1,186 @@
+#ifndef SPATIALHASHSTATS_H_
+#define SPATIALHASHSTATS_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// cmake -DSPATIALHASH_STATS=ON counts the work of every query and times the build phases. Off by
+// default, the counting macro and the scopes below then compile to nothing
+#ifndef SPATIALHASH_STATS
+#define SPATIALHASH_STATS 0
+#endif
+
+/// @brief work done by the radius and nearest neighbour queries. A probe is one cell looked up,
+/// it is empty when the cell holds nothing, candidates are the points distance tested and
+/// accepted the ones reported
+struct QueryStats
+{
+  uint64_t queries = 0;
+  uint64_t cellsVisited = 0;
+  uint64_t emptyProbes = 0;
+  uint64_t candidates = 0;
+  uint64_t accepted = 0;
+  uint64_t nanoseconds = 0;
+  double acceptRate() const noexcept { return candidates ? static_cast<double>(accepted) / candidates : 0.0; }
+};
+
+namespace spatialHashDetail
+{
+  /// @brief a timed phase, times in nanoseconds from when the recorder was made
+  struct TraceEvent
+  {
+    const char* name;
+    const char* category;
+    int64_t start;
+    int64_t duration;
+    uint32_t thread;
+  };
+
+#if SPATIALHASH_STATS
+  /// the counts of the query running on this thread, added to its hash's totals when it ends
+  inline thread_local QueryStats tally;
+#define SPATIALHASH_TALLY(field, n) (spatialHashDetail::tally.field += (n))
+
+  /// @brief a hash's query totals and phase times, safe to feed from the batch workers
+  class StatsRecorder
+  {
+  public:
+    static constexpr bool enabled = true;
+    /// oldest events are dropped beyond this
+    static constexpr size_t maxEvents = 1 << 16;
+    QueryStats queryStats() const noexcept;
+    void addQuery(const QueryStats& query) noexcept;
+    void addEvent(const char* name, const char* category, std::chrono::steady_clock::time_point start,
+                  std::chrono::steady_clock::time_point end) noexcept;
+    std::vector<TraceEvent> events() const;
+    void reset() noexcept;
+    /// the events in the Chrome trace event format read by chrome://tracing and Perfetto
+    void writeChromeTrace(std::ostream& out) const;
+
+  private:
+    std::atomic<uint64_t> m_queries{0};
+    std::atomic<uint64_t> m_cellsVisited{0};
+    std::atomic<uint64_t> m_emptyProbes{0};
+    std::atomic<uint64_t> m_candidates{0};
+    std::atomic<uint64_t> m_accepted{0};
+    std::atomic<uint64_t> m_nanoseconds{0};
+    mutable std::mutex m_mutex;
+    std::vector<TraceEvent> m_events;
+    size_t m_nextEvent = 0;
+    std::chrono::steady_clock::time_point m_origin = std::chrono::steady_clock::now();
+  };
+
+  /// @brief times a phase into a recorder
+  class PhaseScope
+  {
+  public:
+    PhaseScope(StatsRecorder& recorder, const char* name, const char* category="build") noexcept :
+      m_recorder(recorder), m_name(name), m_category(category), m_start(std::chrono::steady_clock::now()) {}
+    ~PhaseScope() { m_recorder.addEvent(m_name, m_category, m_start, std::chrono::steady_clock::now()); }
+    PhaseScope(const PhaseScope&) = delete;
+    PhaseScope& operator=(const PhaseScope&) = delete;
+    /// end this phase and start the next one of a sequence
+    void next(const char* name) noexcept
+    {
+      auto now = std::chrono::steady_clock::now();
+      m_recorder.addEvent(m_name, m_category, m_start, now);
+      m_name = name;
+      m_start = now;
+    }
+
+  private:
+    StatsRecorder& m_recorder;
+    const char* m_name;
+    const char* m_category;
+    std::chrono::steady_clock::time_point m_start;
+  };
+
+  /// @brief brackets one query, the tally of a query it runs inside is put aside until it ends
+  class QueryScope
+  {
+  public:
+    explicit QueryScope(StatsRecorder& recorder) noexcept :
+      m_recorder(recorder), m_outer(tally), m_start(std::chrono::steady_clock::now())
+    {
+      tally = QueryStats();
+    }
+    ~QueryScope()
+    {
+      tally.queries = 1;
+      tally.nanoseconds = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count());
+      m_recorder.addQuery(tally);
+      tally = m_outer;
+    }
+    QueryScope(const QueryScope&) = delete;
+    QueryScope& operator=(const QueryScope&) = delete;
+    void accept(uint64_t count=1) noexcept { tally.accepted += count; }
+
+  private:
+    StatsRecorder& m_recorder;
+    QueryStats m_outer;
+    std::chrono::steady_clock::time_point m_start;
+  };
+
+  /// @brief collects a worker's share of a query run across the pool, its counts are added to the
+  /// totals without counting another query, the QueryScope on the calling thread does that
+  class TallyScope
+  {
+  public:
+    explicit TallyScope(StatsRecorder& recorder) noexcept : m_recorder(recorder), m_outer(tally)
+    {
+      tally = QueryStats();
+    }
+    ~TallyScope()
+    {
+      m_recorder.addQuery(tally);
+      tally = m_outer;
+    }
+    TallyScope(const TallyScope&) = delete;
+    TallyScope& operator=(const TallyScope&) = delete;
+    void accept(uint64_t count=1) noexcept { tally.accepted += count; }
+
+  private:
+    StatsRecorder& m_recorder;
+    QueryStats m_outer;
+  };
+#else
+#define SPATIALHASH_TALLY(field, n) ((void)0)
+
+  class StatsRecorder
+  {
+  public:
+    static constexpr bool enabled = false;
+    QueryStats queryStats() const noexcept { return QueryStats(); }
+    std::vector<TraceEvent> events() const { return {}; }
+    void reset() noexcept {}
+    void writeChromeTrace(std::ostream& out) const { out << "{\"traceEvents\":[]}\n"; }
+  };
+
+  class PhaseScope
+  {
+  public:
+    PhaseScope(StatsRecorder&, const char*, const char* ="build") noexcept {}
+    void next(const char*) noexcept {}
+  };
+
+  class QueryScope
+  {
+  public:
+    explicit QueryScope(StatsRecorder&) noexcept {}
+    void accept(uint64_t =1) noexcept {}
+  };
+
+  class TallyScope
+  {
+  public:
+    explicit TallyScope(StatsRecorder&) noexcept {}
+    void accept(uint64_t =1) noexcept {}
+  };
+#endif
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+#include <atomic>
+#include <cstddef>
+
+/// @brief a small persistent pool used to split loops over the cores, the calling thread
+/// takes part in the work so a pool of n threads has n-1 workers
+class ThreadPool
+{
+public:
+  /// @brief func(begin, end, worker) where worker is in [0, numThreads()) and unique to the
+  /// thread running the chunk, useful for per thread buffers. Only refers to the callable, unlike
+  /// std::function it never allocates, so it must not outlive the call it is passed to
+  class RangeFunc
+  {
+  public:
+    template<typename Func, typename = std::enable_if_t<!std::is_same_v<std::decay_t<Func>, RangeFunc>>>
+    RangeFunc(Func&& func) noexcept :
+      m_object(const_cast<void*>(static_cast<const void*>(&func))),
+      m_call([](void* object, size_t begin, size_t end, size_t worker)
+      {
+        (*static_cast<std::remove_reference_t<Func>*>(object))(begin, end, worker);
+      })
+    {
+    }
+    void operator()(size_t begin, size_t end, size_t worker) const { m_call(m_object, begin, end, worker); }
+
+  private:
+    void* m_object;
+    void (*m_call)(void*, size_t, size_t, size_t);
+  };
+
+  explicit ThreadPool(size_t numThreads=std::thread::hardware_concurrency());
+  ~ThreadPool();
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  size_t numThreads() const noexcept { return m_workers.size() + 1; }
+  /// @brief run func over [0,count) in chunks of at least minChunk and wait for it to finish,
+  /// runs serially when the range is small or when called from inside a pool job
+  void parallelFor(size_t count, const RangeFunc& func, size_t minChunk=1024) noexcept;
+  /// @brief pool shared by the SpatialHash builders and queries
+  static ThreadPool& global();
+
+private:
+  void workerLoop(size_t worker) noexcept;
+  void runChunks(size_t worker) noexcept;
+
+  std::vector<std::thread> m_workers;
+  std::mutex m_jobMutex;
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_done;
+  const RangeFunc* m_func = nullptr;
+  size_t m_count = 0;
+  size_t m_chunk = 0;
+  std::atomic<size_t> m_next{0};
+  size_t m_generation = 0;
+  size_t m_active = 0;
+  bool m_stop = false;
+};
+
+#endif
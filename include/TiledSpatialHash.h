@@ -0,0 +1,561 @@
+#ifndef TILEDSPATIALHASH_H_
+#define TILEDSPATIALHASH_H_
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "SpatialHash.h"
+#include "MappedFile.h"
+
+namespace spatialHashDetail
+{
+  /// @brief first bytes of the tiles.manifest file of a tiled hash, a Dim int tile coordinate and a
+  /// uint64 point count per tile follow. A tile of count points has ceil(count / partPoints) parts
+  struct TileManifestHeader
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t pointSize;
+    uint32_t scalarSize;
+    int32_t dim;
+    int32_t tileCells;
+    uint32_t partPoints;
+    double cellSize;
+    uint64_t numPoints;
+    uint64_t numTiles;
+  };
+  constexpr char tileManifestMagic[8] = {'S', 'P', 'T', 'I', 'L', 'E', 'S', '\0'};
+  constexpr uint32_t tileManifestVersion = 2;
+}
+
+/// @brief out of core spatial hash for point sets bigger than memory. Points are streamed in
+/// chunks and partitioned into tiles of tileCells^Dim cells, each tile is built on its own and
+/// saved as a snapshot in a directory. A tile denser than maxTilePoints is saved as several parts
+/// holding consecutive runs of its points, each built and mapped on its own. Queries map only the
+/// tile parts their box overlaps through an LRU cache, so memory is set by the Config and not by
+/// the size or clustering of the data. Ids are the order the points were read in. Queries update
+/// the cache so one object serves one thread
+template<typename PointT = Vec3f, int Dim = PointTraits<PointT>::dim, typename KeyT = uint64_t>
+class BasicTiledSpatialHash
+{
+public:
+  using Hash = BasicSpatialHash<PointT, Dim, KeyT>;
+  using Traits = PointTraits<PointT>;
+  using Scalar = typename Traits::Scalar;
+  using Cell = typename Hash::Cell;
+
+  struct Config
+  {
+    Scalar cellSize = 1;
+    /// cells along each side of a tile
+    int tileCells = 64;
+    /// points read from the source at a time
+    size_t chunkPoints = size_t(1) << 20;
+    /// bytes of partitioned points held before they are appended to the tile files
+    size_t spillBytes = size_t(64) << 20;
+    /// most points built into one snapshot, denser tiles are split into parts of this many
+    size_t maxTilePoints = size_t(1) << 22;
+    /// bytes of tiles the query cache keeps mapped
+    size_t cacheBytes = size_t(512) << 20;
+    typename Hash::Storage storage = Hash::Storage::CellSortedSoA;
+    typename Hash::CellKey cellKey = Hash::CellKey::Packed;
+  };
+
+  explicit BasicTiledSpatialHash(const Config& config=Config()) noexcept : m_config(config) {}
+  BasicTiledSpatialHash(const BasicTiledSpatialHash&) = delete;
+  BasicTiledSpatialHash& operator=(const BasicTiledSpatialHash&) = delete;
+
+  /// @brief stream the points from read(PointT* buffer, size_t max), which returns how many it
+  /// wrote and 0 at the end, into tiles under directory. Peak memory is a chunk plus spillBytes
+  /// plus the build of one tile part of at most maxTilePoints points. Returns false if a file
+  /// can't be written
+  template<typename Read>
+  bool build(const std::string& directory, Read&& read) noexcept;
+  /// @brief build from an iterator range of points
+  template<typename Iterator>
+  bool build(const std::string& directory, Iterator first, Iterator last) noexcept;
+  /// @brief build from a file of raw PointT records
+  bool buildFromFile(const std::string& directory, const std::string& path) noexcept;
+  /// @brief use the tiles a build wrote to directory, maybe from another process. The cell and
+  /// tile size come from the directory
+  bool open(const std::string& directory) noexcept;
+
+  /// @brief call func(id, position) for every point within radius, the position is only valid
+  /// during the call
+  template<typename Func>
+  void forEachInRadius(const PointT& point, Scalar radius, Func&& func) noexcept;
+  void queryIndices(const PointT& point, Scalar radius, std::vector<uint64_t>& result) noexcept;
+  std::vector<PointT> query(const PointT& point, Scalar radius) noexcept;
+
+  const Config& config() const noexcept { return m_config; }
+  size_t numPoints() const noexcept { return m_numPoints; }
+  size_t numTiles() const noexcept { return m_tiles.size(); }
+  /// @brief snapshots the tiles were saved as, more than numTiles when dense tiles were split
+  size_t numTileParts() const noexcept;
+  /// @brief bytes of the tile parts mapped right now
+  size_t residentBytes() const noexcept { return m_residentBytes; }
+  /// @brief tile parts mapped since the build or open, and lookups that found the part already mapped
+  size_t tileLoads() const noexcept { return m_tileLoads; }
+  size_t cacheHits() const noexcept { return m_cacheHits; }
+  /// @brief unmap every tile part
+  void clearCache() noexcept;
+
+private:
+  /// what a build appends to the spill file of a tile
+  struct SpillRecord { uint64_t id; PointT point; };
+  /// a tile and the index of one of its parts
+  using TilePart = std::pair<Cell, uint64_t>;
+  struct CachedTile
+  {
+    std::unique_ptr<Hash> hash;
+    MappedFile ids;
+    size_t bytes = 0;
+    typename std::list<TilePart>::iterator lru;
+  };
+  Config m_config;
+  std::string m_directory;
+  /// points in each tile
+  std::map<Cell, uint64_t> m_tiles;
+  size_t m_numPoints = 0;
+  std::map<TilePart, CachedTile> m_cache;
+  /// most recently used part first
+  std::list<TilePart> m_lru;
+  size_t m_residentBytes = 0;
+  size_t m_tileLoads = 0;
+  size_t m_cacheHits = 0;
+
+  int cellCoord(Scalar coord) const noexcept { return static_cast<int>(std::floor(coord / m_config.cellSize)); }
+  /// floor division so negative cells land in negative tiles
+  int tileCoord(Scalar coord) const noexcept
+  {
+    int c = cellCoord(coord);
+    return c >= 0 ? c / m_config.tileCells : -((-c - 1) / m_config.tileCells) - 1;
+  }
+  Cell tileOf(const PointT& p) const noexcept;
+  uint64_t numParts(uint64_t count) const noexcept { return (count + m_config.maxTilePoints - 1) / m_config.maxTilePoints; }
+  std::string tilePath(const Cell& tile, const char* extension) const noexcept;
+  std::string partPath(const TilePart& part, const char* extension) const noexcept;
+  std::string manifestPath() const noexcept { return m_directory + "/tiles.manifest"; }
+  bool flushSpill(std::map<Cell, std::vector<SpillRecord>>& buffers, std::map<Cell, uint64_t>& spilled) noexcept;
+  bool buildTile(const Cell& tile, uint64_t count) noexcept;
+  bool writeManifest() const noexcept;
+  /// the tile part mapped and at the front of the LRU list, nullptr if it can't be opened
+  CachedTile* cachedTile(const TilePart& part) noexcept;
+  void evict() noexcept;
+};
+
+template<typename PointT, int Dim, typename KeyT>
+auto BasicTiledSpatialHash<PointT, Dim, KeyT>::tileOf(const PointT& p) const noexcept -> Cell
+{
+  Cell tile;
+  for(int axis = 0; axis < Dim; ++axis)
+  {
+    tile[axis] = tileCoord(Traits::get(p, axis));
+  }
+  return tile;
+}
+
+template<typename PointT, int Dim, typename KeyT>
+std::string BasicTiledSpatialHash<PointT, Dim, KeyT>::tilePath(const Cell& tile, const char* extension) const noexcept
+{
+  std::string path = m_directory + "/tile";
+  for(int axis = 0; axis < Dim; ++axis)
+  {
+    path += '_' + std::to_string(tile[axis]);
+  }
+  return path + extension;
+}
+
+template<typename PointT, int Dim, typename KeyT>
+std::string BasicTiledSpatialHash<PointT, Dim, KeyT>::partPath(const TilePart& part, const char* extension) const noexcept
+{
+  return tilePath(part.first, ("_p" + std::to_string(part.second) + extension).c_str());
+}
+
+template<typename PointT, int Dim, typename KeyT>
+size_t BasicTiledSpatialHash<PointT, Dim, KeyT>::numTileParts() const noexcept
+{
+  size_t parts = 0;
+  for(const auto& entry : m_tiles)
+  {
+    parts += numParts(entry.second);
+  }
+  return parts;
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Read>
+bool BasicTiledSpatialHash<PointT, Dim, KeyT>::build(const std::string& directory, Read&& read) noexcept
+{
+  // the spill files and snapshots hold raw point bytes
+  if constexpr(!std::is_trivially_copyable<PointT>::value)
+  {
+    return false;
+  }
+  clearCache();
+  m_tiles.clear();
+  m_numPoints = 0;
+  m_directory = directory;
+  std::error_code error;
+  std::filesystem::create_directories(directory, error);
+  // a part is one hash so its local ids must fit in 32 bits
+  if(error || m_config.cellSize <= 0 || m_config.tileCells <= 0 || m_config.maxTilePoints == 0 ||
+     m_config.maxTilePoints > std::numeric_limits<uint32_t>::max())
+  {
+    return false;
+  }
+  // partition the chunks into per tile buffers and append those to the tile spill files whenever
+  // they outgrow spillBytes, only the count of each tile stays in memory
+  std::vector<PointT> chunk(std::max<size_t>(m_config.chunkPoints, 1));
+  std::map<Cell, std::vector<SpillRecord>> buffers;
+  std::map<Cell, uint64_t> spilled;
+  size_t buffered = 0;
+  uint64_t id = 0;
+  size_t count;
+  while((count = read(chunk.data(), chunk.size())) > 0)
+  {
+    for(size_t i = 0; i < count; ++i, ++id)
+    {
+      const PointT& p = chunk[i];
+      // NaN points have no cell, their id is skipped
+      if(std::isnan(Traits::get(p, 0)))
+      {
+        continue;
+      }
+      buffers[tileOf(p)].push_back({id, p});
+      if(++buffered * sizeof(SpillRecord) >= m_config.spillBytes)
+      {
+        if(!flushSpill(buffers, spilled))
+        {
+          return false;
+        }
+        buffered = 0;
+      }
+    }
+  }
+  if(!flushSpill(buffers, spilled))
+  {
+    return false;
+  }
+  std::vector<PointT>().swap(chunk);
+  // one tile part in memory at a time
+  for(const auto& [tile, tileCount] : spilled)
+  {
+    if(!buildTile(tile, tileCount))
+    {
+      return false;
+    }
+    m_tiles[tile] = tileCount;
+    m_numPoints += tileCount;
+  }
+  return writeManifest();
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Iterator>
+bool BasicTiledSpatialHash<PointT, Dim, KeyT>::build(const std::string& directory, Iterator first, Iterator last) noexcept
+{
+  return build(directory, [&](PointT* buffer, size_t max)
+  {
+    size_t count = 0;
+    for(; count < max && first != last; ++count, ++first)
+    {
+      buffer[count] = *first;
+    }
+    return count;
+  });
+}
+
+template<typename PointT, int Dim, typename KeyT>
+bool BasicTiledSpatialHash<PointT, Dim, KeyT>::buildFromFile(const std::string& directory, const std::string& path) noexcept
+{
+  std::ifstream in(path, std::ios::binary);
+  if(!in)
+  {
+    return false;
+  }
+  return build(directory, [&](PointT* buffer, size_t max)
+  {
+    in.read(reinterpret_cast<char*>(buffer), static_cast<std::streamsize>(max * sizeof(PointT)));
+    return static_cast<size_t>(in.gcount()) / sizeof(PointT);
+  });
+}
+
+template<typename PointT, int Dim, typename KeyT>
+bool BasicTiledSpatialHash<PointT, Dim, KeyT>::flushSpill(std::map<Cell, std::vector<SpillRecord>>& buffers, std::map<Cell, uint64_t>& spilled) noexcept
+{
+  for(const auto& [tile, records] : buffers)
+  {
+    // the first write of a build truncates what an earlier build left behind
+    auto& written = spilled[tile];
+    std::ofstream out(tilePath(tile, ".spill"), std::ios::binary | (written == 0 ? std::ios::trunc : std::ios::app));
+    out.write(reinterpret_cast<const char*>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(SpillRecord)));
+    if(!out)
+    {
+      return false;
+    }
+    written += records.size();
+  }
+  // dropping the vectors rather than clearing them gives their memory back
+  buffers.clear();
+  return true;
+}
+
+template<typename PointT, int Dim, typename KeyT>
+bool BasicTiledSpatialHash<PointT, Dim, KeyT>::buildTile(const Cell& tile, uint64_t count) noexcept
+{
+  // the spill file is read a part at a time so a dense tile never needs all its points in memory
+  std::string spill = tilePath(tile, ".spill");
+  std::ifstream in(spill, std::ios::binary);
+  std::vector<SpillRecord> records;
+  std::vector<PointT> points;
+  std::vector<uint64_t> ids;
+  for(uint64_t part = 0; part < numParts(count); ++part)
+  {
+    size_t size = static_cast<size_t>(std::min<uint64_t>(count - part * m_config.maxTilePoints, m_config.maxTilePoints));
+    records.resize(size);
+    in.read(reinterpret_cast<char*>(records.data()), static_cast<std::streamsize>(size * sizeof(SpillRecord)));
+    if(!in)
+    {
+      return false;
+    }
+    points.resize(size);
+    ids.resize(size);
+    for(size_t i = 0; i < size; ++i)
+    {
+      points[i] = records[i].point;
+      ids[i] = records[i].id;
+    }
+    Hash hash(m_config.cellSize, m_config.storage, m_config.cellKey);
+    hash.build(points);
+    // the part's local ids are its positions in the ids file
+    std::ofstream out(partPath({tile, part}, ".ids"), std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(ids.data()), static_cast<std::streamsize>(size * sizeof(uint64_t)));
+    out.close();
+    if(!out || !hash.saveSnapshot(partPath({tile, part}, ".snap")))
+    {
+      return false;
+    }
+  }
+  in.close();
+  std::remove(spill.c_str());
+  return true;
+}
+
+template<typename PointT, int Dim, typename KeyT>
+bool BasicTiledSpatialHash<PointT, Dim, KeyT>::writeManifest() const noexcept
+{
+  using namespace spatialHashDetail;
+  TileManifestHeader header = {};
+  std::memcpy(header.magic, tileManifestMagic, sizeof(header.magic));
+  header.version = tileManifestVersion;
+  header.pointSize = sizeof(PointT);
+  header.scalarSize = sizeof(Scalar);
+  header.dim = Dim;
+  header.tileCells = m_config.tileCells;
+  header.partPoints = static_cast<uint32_t>(m_config.maxTilePoints);
+  header.cellSize = static_cast<double>(m_config.cellSize);
+  header.numPoints = m_numPoints;
+  header.numTiles = m_tiles.size();
+  std::ofstream out(manifestPath(), std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  for(const auto& [tile, count] : m_tiles)
+  {
+    out.write(reinterpret_cast<const char*>(tile.data()), sizeof(tile));
+    out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+  }
+  out.close();
+  return static_cast<bool>(out);
+}
+
+template<typename PointT, int Dim, typename KeyT>
+bool BasicTiledSpatialHash<PointT, Dim, KeyT>::open(const std::string& directory) noexcept
+{
+  using namespace spatialHashDetail;
+  clearCache();
+  m_tiles.clear();
+  m_numPoints = 0;
+  m_directory = directory;
+  std::ifstream in(manifestPath(), std::ios::binary);
+  TileManifestHeader header;
+  if(!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+     std::memcmp(header.magic, tileManifestMagic, sizeof(header.magic)) != 0 ||
+     header.version != tileManifestVersion || header.pointSize != sizeof(PointT) ||
+     header.scalarSize != sizeof(Scalar) || header.dim != Dim || header.tileCells <= 0 || header.partPoints == 0 ||
+     header.cellSize <= 0)
+  {
+    return false;
+  }
+  m_config.cellSize = static_cast<Scalar>(header.cellSize);
+  m_config.tileCells = header.tileCells;
+  m_config.maxTilePoints = header.partPoints;
+  for(uint64_t t = 0; t < header.numTiles; ++t)
+  {
+    Cell tile;
+    uint64_t count;
+    if(!in.read(reinterpret_cast<char*>(tile.data()), sizeof(tile)) || !in.read(reinterpret_cast<char*>(&count), sizeof(count)))
+    {
+      m_tiles.clear();
+      return false;
+    }
+    m_tiles[tile] = count;
+  }
+  m_numPoints = header.numPoints;
+  return true;
+}
+
+template<typename PointT, int Dim, typename KeyT>
+auto BasicTiledSpatialHash<PointT, Dim, KeyT>::cachedTile(const TilePart& part) noexcept -> CachedTile*
+{
+  auto it = m_cache.find(part);
+  if(it != m_cache.end())
+  {
+    ++m_cacheHits;
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+    return &it->second;
+  }
+  // the mapped files can't be moved so the entry is filled in place
+  auto& cached = m_cache[part];
+  std::string snapshot = partPath(part, ".snap");
+  cached.hash = std::make_unique<Hash>(m_config.cellSize, m_config.storage, m_config.cellKey);
+  if(!cached.hash->openSnapshot(snapshot) || !cached.ids.open(partPath(part, ".ids")) ||
+     cached.ids.size() < cached.hash->numIds() * sizeof(uint64_t))
+  {
+    m_cache.erase(part);
+    return nullptr;
+  }
+  ++m_tileLoads;
+  std::error_code error;
+  cached.bytes = static_cast<size_t>(std::filesystem::file_size(snapshot, error)) + cached.ids.size();
+  m_residentBytes += cached.bytes;
+  m_lru.push_front(part);
+  cached.lru = m_lru.begin();
+  evict();
+  return &cached;
+}
+
+template<typename PointT, int Dim, typename KeyT>
+void BasicTiledSpatialHash<PointT, Dim, KeyT>::evict() noexcept
+{
+  // the front part is the one about to be used so it always stays
+  while(m_residentBytes > m_config.cacheBytes && m_lru.size() > 1)
+  {
+    auto it = m_cache.find(m_lru.back());
+    m_residentBytes -= it->second.bytes;
+    m_cache.erase(it);
+    m_lru.pop_back();
+  }
+}
+
+template<typename PointT, int Dim, typename KeyT>
+void BasicTiledSpatialHash<PointT, Dim, KeyT>::clearCache() noexcept
+{
+  m_cache.clear();
+  m_lru.clear();
+  m_residentBytes = 0;
+}
+
+template<typename PointT, int Dim, typename KeyT>
+template<typename Func>
+void BasicTiledSpatialHash<PointT, Dim, KeyT>::forEachInRadius(const PointT& point, Scalar radius, Func&& func) noexcept
+{
+  if(m_tiles.empty())
+  {
+    return;
+  }
+  Cell lo;
+  Cell hi;
+  double numInRange = 1;
+  for(int axis = 0; axis < Dim; ++axis)
+  {
+    lo[axis] = tileCoord(Traits::get(point, axis) - radius);
+    hi[axis] = tileCoord(Traits::get(point, axis) + radius);
+    numInRange *= static_cast<double>(hi[axis]) - lo[axis] + 1;
+  }
+  auto visit = [&](const Cell& tile, uint64_t count)
+  {
+    for(uint64_t part = 0; part < numParts(count); ++part)
+    {
+      CachedTile* cached = cachedTile({tile, part});
+      if(cached == nullptr)
+      {
+        continue;
+      }
+      const uint64_t* ids = reinterpret_cast<const uint64_t*>(cached->ids.data());
+      cached->hash->forEachInRadius(point, radius, [&](uint32_t id, const PointT& p){ func(ids[id], p); });
+    }
+  };
+  auto inRange = [&](const Cell& tile)
+  {
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+      if(tile[axis] < lo[axis] || tile[axis] > hi[axis])
+      {
+        return false;
+      }
+    }
+    return true;
+  };
+  // a huge radius walks the tile list instead of the empty tiles of its box
+  if(numInRange > static_cast<double>(m_tiles.size()))
+  {
+    for(const auto& entry : m_tiles)
+    {
+      if(inRange(entry.first))
+      {
+        visit(entry.first, entry.second);
+      }
+    }
+    return;
+  }
+  Cell tile = lo;
+  while(true)
+  {
+    auto it = m_tiles.find(tile);
+    if(it != m_tiles.end())
+    {
+      visit(tile, it->second);
+    }
+    int axis = Dim - 1;
+    while(axis >= 0 && tile[axis] == hi[axis])
+    {
+      tile[axis] = lo[axis];
+      --axis;
+    }
+    if(axis < 0)
+    {
+      break;
+    }
+    ++tile[axis];
+  }
+}
+
+template<typename PointT, int Dim, typename KeyT>
+void BasicTiledSpatialHash<PointT, Dim, KeyT>::queryIndices(const PointT& point, Scalar radius, std::vector<uint64_t>& result) noexcept
+{
+  forEachInRadius(point, radius, [&](uint64_t id, const PointT&){ result.push_back(id); });
+}
+
+template<typename PointT, int Dim, typename KeyT>
+std::vector<PointT> BasicTiledSpatialHash<PointT, Dim, KeyT>::query(const PointT& point, Scalar radius) noexcept
+{
+  std::vector<PointT> result;
+  forEachInRadius(point, radius, [&](uint64_t, const PointT& p){ result.push_back(p); });
+  return result;
+}
+
+/// @brief the tiled hash of Vec3f points, compiled once in TiledSpatialHash.cpp
+using TiledSpatialHash = BasicTiledSpatialHash<Vec3f>;
+extern template class BasicTiledSpatialHash<Vec3f>;
+
+#endif
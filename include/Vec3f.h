@@ -0,0 +1,31 @@
+#ifndef VEC3F_H_
+#define VEC3F_H_
+
+#include <array>
+#include <cstddef>
+#include "PointTraits.h"
+
+/// @brief minimal 3 float point for builds without NGL, the headless SpatialHash stores these.
+/// The members are named like ngl::Vec3 so code moving points between the two reads the same
+struct Vec3f
+{
+  float m_x = 0.0f;
+  float m_y = 0.0f;
+  float m_z = 0.0f;
+  constexpr Vec3f() noexcept = default;
+  constexpr Vec3f(float x, float y, float z) noexcept : m_x(x), m_y(y), m_z(z) {}
+  constexpr float operator[](size_t axis) const noexcept { return axis == 0 ? m_x : (axis == 1 ? m_y : m_z); }
+  constexpr bool operator==(const Vec3f& v) const noexcept { return m_x == v.m_x && m_y == v.m_y && m_z == v.m_z; }
+  constexpr bool operator!=(const Vec3f& v) const noexcept { return !(*this == v); }
+};
+
+template<>
+struct PointTraits<Vec3f>
+{
+  using Scalar = float;
+  static constexpr int dim = 3;
+  static float get(const Vec3f& p, int axis) noexcept { return p[static_cast<size_t>(axis)]; }
+  static Vec3f make(const std::array<float, 3>& c) noexcept { return Vec3f(c[0], c[1], c[2]); }
+};
+
+#endif
@@ -0,0 +1,113 @@
+#include "BucketArena.h"
+#include <algorithm>
+#include <new>
+
+  BucketArena::BucketArena(size_t blockSize, std::pmr::memory_resource* upstream) noexcept :
+    m_upstream(upstream), m_blockSize(blockSize)
+  {
+  }
+
+  BucketArena::~BucketArena()
+  {
+    releaseBlocks();
+  }
+
+  void BucketArena::releaseBlocks() noexcept
+  {
+    for(const auto& block : m_blocks)
+    {
+      m_upstream->deallocate(block.data, block.size, maxAlign);
+    }
+    m_blocks.clear();
+  }
+
+  size_t BucketArena::capacity() const noexcept
+  {
+    size_t total = 0;
+    for(const auto& block : m_blocks)
+    {
+      total += block.size;
+    }
+    return total;
+  }
+
+  size_t BucketArena::sizeClass(size_t bytes, size_t alignment) noexcept
+  {
+    size_t size = std::max({bytes, alignment, sizeof(FreeNode)});
+    size_t cls = 0;
+    while((size_t(1) << cls) < size)
+    {
+      ++cls;
+    }
+    return cls;
+  }
+
+  void BucketArena::addBlock(size_t minSize)
+  {
+    // grow geometrically so a big first build only takes a few blocks
+    size_t size = std::max({m_blockSize, minSize, capacity()});
+    m_blocks.push_back({static_cast<std::byte*>(m_upstream->allocate(size, maxAlign)), size});
+    ++m_upstreamAllocations;
+    m_current = m_blocks.size() - 1;
+    m_offset = 0;
+  }
+
+  void* BucketArena::do_allocate(size_t bytes, size_t alignment)
+  {
+    if(alignment > maxAlign)
+    {
+      ++m_upstreamAllocations;
+      return m_upstream->allocate(bytes, alignment);
+    }
+    size_t cls = sizeClass(bytes, alignment);
+    if(m_free[cls] != nullptr)
+    {
+      FreeNode* node = m_free[cls];
+      m_free[cls] = node->next;
+      return node;
+    }
+    size_t size = size_t(1) << cls;
+    size_t align = std::min(size, maxAlign);
+    for(;;)
+    {
+      if(m_current < m_blocks.size())
+      {
+        const auto& block = m_blocks[m_current];
+        size_t offset = (m_offset + align - 1) & ~(align - 1);
+        if(offset + size <= block.size)
+        {
+          m_offset = offset + size;
+          return block.data + offset;
+        }
+        // the tail of this block is too small, carry on in the next one
+        ++m_current;
+        m_offset = 0;
+        continue;
+      }
+      addBlock(size);
+    }
+  }
+
+  void BucketArena::do_deallocate(void* p, size_t bytes, size_t alignment)
+  {
+    if(alignment > maxAlign)
+    {
+      m_upstream->deallocate(p, bytes, alignment);
+      return;
+    }
+    size_t cls = sizeClass(bytes, alignment);
+    m_free[cls] = new(p) FreeNode{m_free[cls]};
+  }
+
+  void BucketArena::reset() noexcept
+  {
+    std::fill(std::begin(m_free), std::end(m_free), nullptr);
+    if(m_blocks.size() > 1)
+    {
+      size_t total = capacity();
+      releaseBlocks();
+      addBlock(total);
+    }
+    m_current = 0;
+    m_offset = 0;
+  }
@@ -0,0 +1,3 @@
+#include "BufferedSpatialHash.h"
+
+template class BasicBufferedSpatialHash<Vec3f>;
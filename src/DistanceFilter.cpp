@@ -0,0 +1,165 @@
+#include "DistanceFilter.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+  #define DISTANCEFILTER_X86
+  #include <immintrin.h>
+#endif
+// gcc and clang can build the AVX2 kernel into a baseline binary and check the cpu at runtime,
+// other compilers only get it when the whole build targets AVX2
+#if defined(DISTANCEFILTER_X86) && (defined(__GNUC__) || defined(__clang__))
+  #define DISTANCEFILTER_AVX2
+  #define DISTANCEFILTER_TARGET_AVX2 __attribute__((target("avx2,popcnt")))
+#elif defined(DISTANCEFILTER_X86) && defined(__AVX2__)
+  #define DISTANCEFILTER_AVX2
+  #define DISTANCEFILTER_TARGET_AVX2
+#endif
+
+namespace
+{
+  using Kernel = uint32_t(*)(const float*, const float*, const float*, uint32_t, float, float, float, float, uint32_t*);
+
+#if defined(DISTANCEFILTER_X86)
+  /// lane numbers of the set bits of each 8 bit mask packed to the front, adding the block
+  /// start gives the survivors' offsets ready to store
+  struct CompactTable
+  {
+    alignas(32) uint32_t lanes[256][8];
+    constexpr CompactTable() : lanes{}
+    {
+      for(uint32_t mask = 0; mask < 256; ++mask)
+      {
+        uint32_t n = 0;
+        for(uint32_t bit = 0; bit < 8; ++bit)
+        {
+          if(mask & (1u << bit))
+          {
+            lanes[mask][n++] = bit;
+          }
+        }
+      }
+    }
+  };
+  constexpr CompactTable s_compact;
+
+  inline uint32_t popcount(uint32_t v) noexcept
+  {
+    uint32_t n = 0;
+    for(; v; v &= v - 1)
+    {
+      ++n;
+    }
+    return n;
+  }
+
+  uint32_t filterSSE2(const float* x, const float* y, const float* z, uint32_t count,
+                      float cx, float cy, float cz, float radiusSquared, uint32_t* out) noexcept
+  {
+    const __m128 vx = _mm_set1_ps(cx);
+    const __m128 vy = _mm_set1_ps(cy);
+    const __m128 vz = _mm_set1_ps(cz);
+    const __m128 vr = _mm_set1_ps(radiusSquared);
+    uint32_t n = 0;
+    uint32_t i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+      __m128 dx = _mm_sub_ps(_mm_loadu_ps(x + i), vx);
+      __m128 dy = _mm_sub_ps(_mm_loadu_ps(y + i), vy);
+      __m128 dz = _mm_sub_ps(_mm_loadu_ps(z + i), vz);
+      __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+      uint32_t mask = static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(d2, vr)));
+      __m128i lanes = _mm_load_si128(reinterpret_cast<const __m128i*>(s_compact.lanes[mask]));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + n), _mm_add_epi32(lanes, _mm_set1_epi32(static_cast<int>(i))));
+      n += popcount(mask);
+    }
+    return n + DistanceFilter::scalar(x + i, y + i, z + i, count - i, cx, cy, cz, radiusSquared, out + n, i);
+  }
+#endif
+
+#if defined(DISTANCEFILTER_AVX2)
+  DISTANCEFILTER_TARGET_AVX2
+  uint32_t filterAVX2(const float* x, const float* y, const float* z, uint32_t count,
+                      float cx, float cy, float cz, float radiusSquared, uint32_t* out) noexcept
+  {
+    const __m256 vx = _mm256_set1_ps(cx);
+    const __m256 vy = _mm256_set1_ps(cy);
+    const __m256 vz = _mm256_set1_ps(cz);
+    const __m256 vr = _mm256_set1_ps(radiusSquared);
+    uint32_t n = 0;
+    uint32_t i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+      __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), vx);
+      __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + i), vy);
+      __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z + i), vz);
+      // no fma so the result matches the scalar test bit for bit
+      __m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+      uint32_t mask = static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(d2, vr, _CMP_LE_OQ)));
+      __m256i lanes = _mm256_load_si256(reinterpret_cast<const __m256i*>(s_compact.lanes[mask]));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + n), _mm256_add_epi32(lanes, _mm256_set1_epi32(static_cast<int>(i))));
+      n += static_cast<uint32_t>(_mm_popcnt_u32(mask));
+    }
+    return n + DistanceFilter::scalar(x + i, y + i, z + i, count - i, cx, cy, cz, radiusSquared, out + n, i);
+  }
+#endif
+
+  struct Selected
+  {
+    Kernel kernel;
+    const char* name;
+  };
+
+  Selected select() noexcept
+  {
+#if defined(DISTANCEFILTER_AVX2)
+  #if defined(__GNUC__) || defined(__clang__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+  #endif
+    {
+      return {filterAVX2, "avx2"};
+    }
+#endif
+#if defined(DISTANCEFILTER_X86)
+    return {filterSSE2, "sse2"};
+#else
+    return {[](const float* x, const float* y, const float* z, uint32_t count,
+               float cx, float cy, float cz, float radiusSquared, uint32_t* out) noexcept
+            {
+              return DistanceFilter::scalar(x, y, z, count, cx, cy, cz, radiusSquared, out);
+            }, "scalar"};
+#endif
+  }
+
+  const Selected& selected() noexcept
+  {
+    static const Selected s = select();
+    return s;
+  }
+}
+
+  uint32_t DistanceFilter::filter(const float* x, const float* y, const float* z, uint32_t count,
+                                  float cx, float cy, float cz, float radiusSquared, uint32_t* out) noexcept
+  {
+    return selected().kernel(x, y, z, count, cx, cy, cz, radiusSquared, out);
+  }
+
+  const char* DistanceFilter::isa() noexcept
+  {
+    return selected().name;
+  }
+
+  uint32_t DistanceFilter::scalar(const float* x, const float* y, const float* z, uint32_t count,
+                                  float cx, float cy, float cz, float radiusSquared, uint32_t* out, uint32_t base) noexcept
+  {
+    uint32_t n = 0;
+    for(uint32_t i = 0; i < count; ++i)
+    {
+      float dx = x[i] - cx;
+      float dy = y[i] - cy;
+      float dz = z[i] - cz;
+      // branch free store, out[n] is overwritten until a survivor moves n on
+      out[n] = base + i;
+      n += (dx * dx + dy * dy + dz * dz) <= radiusSquared;
+    }
+    return n;
+  }
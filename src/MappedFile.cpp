@@ -0,0 +1,101 @@
+#include "MappedFile.h"
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+  MappedFile::~MappedFile()
+  {
+    close();
+  }
+
+#ifdef _WIN32
+  bool MappedFile::open(const std::string& path) noexcept
+  {
+    close();
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(file == INVALID_HANDLE_VALUE)
+    {
+      return false;
+    }
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+    {
+      CloseHandle(file);
+      return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if(data == nullptr)
+    {
+      if(mapping)
+      {
+        CloseHandle(mapping);
+      }
+      CloseHandle(file);
+      return false;
+    }
+    m_file = file;
+    m_mapping = mapping;
+    m_data = static_cast<const std::byte*>(data);
+    m_size = static_cast<size_t>(size.QuadPart);
+    return true;
+  }
+
+  void MappedFile::close() noexcept
+  {
+    if(m_data)
+    {
+      UnmapViewOfFile(m_data);
+      CloseHandle(m_mapping);
+      CloseHandle(m_file);
+    }
+    m_data = nullptr;
+    m_size = 0;
+    m_file = nullptr;
+    m_mapping = nullptr;
+  }
+#else
+  bool MappedFile::open(const std::string& path) noexcept
+  {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+    {
+      return false;
+    }
+    struct stat info;
+    if(fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+      ::close(fd);
+      return false;
+    }
+    size_t size = static_cast<size_t>(info.st_size);
+    void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping keeps its own reference to the file
+    ::close(fd);
+    if(data == MAP_FAILED)
+    {
+      return false;
+    }
+    m_data = static_cast<const std::byte*>(data);
+    m_size = size;
+    return true;
+  }
+
+  void MappedFile::close() noexcept
+  {
+    if(m_data)
+    {
+      munmap(const_cast<std::byte*>(m_data), m_size);
+    }
+    m_data = nullptr;
+    m_size = 0;
+  }
+#endif
@@ -16,7 +16,8 @@ NGLScene::NGLScene()
 {
   // re-size the widget to that of the parent (in this case the GLFrame passed in on construction)
   setTitle("Spatial Hash Demo");
-  m_hash = std::make_unique<SpatialHash>(1.0f);
+  m_hash = std::make_unique<NGLSpatialHash>(1.0f, NGLSpatialHash::Storage::CellSortedSoA, NGLSpatialHash::CellKey::Auto);
+  m_queryCache = std::make_unique<BasicQueryCache<ngl::Vec3>>(*m_hash);
 }
 
 
@@ -35,7 +36,14 @@ void NGLScene::generatePoints(size_t _num)
   }
   m_colours.clear();
   m_colours=ngl::generateDistinctColours(m_numPoints);
-
+  // lay the points out along a Hilbert curve so a cell's points and their colours sit together
+  std::vector<uint32_t> order;
+  NGLSpatialHash::spatialOrder(m_points,m_radius,NGLSpatialHash::Curve::Hilbert,order);
+  NGLSpatialHash::permute(order,m_points);
+  NGLSpatialHash::permute(order,m_colours);
+  // keep the hash ids in step with m_colours
+  m_rebuildHash=true;
+  updateHash();
 }
 
 void NGLScene::resizeGL(int _w , int _h)
@@ -74,10 +82,20 @@ void NGLScene::initializeGL()
 
 void NGLScene::updateHash()
 {
-  m_hash->clear();
-  for(auto p : m_points)
+  // let the hash size its cells for the current radius and point spread
+  // a full build is only needed when the points or the radius change, otherwise the points are
+  // moved in place which only touches the ones changing cell
+  if(m_rebuildHash)
+  {
+    m_hash->setAutoCellSize(true,m_radius);
+    // the points are spawned in the m_dim cube so the cells can be a dense grid over it
+    m_hash->setDomain(ngl::Vec3(-m_dim,-m_dim,-m_dim),ngl::Vec3(m_dim,m_dim,m_dim));
+    m_hash->build(m_points);
+    m_rebuildHash=false;
+  }
+  else
   {
-    m_hash->insert(p);
+    m_hash->applyMoves(m_points);
   }
 }
 
@@ -111,16 +129,19 @@ void NGLScene::paintGL()
       ngl::VAOPrimitives::draw("sphere");
     }
   }
-  auto spheres=m_hash->query(m_hashPos,m_radius);
   std::vector<ngl::Vec3> data;
-  for(auto s : spheres)
+  size_t found=0;
+  const auto &result=m_queryCache->query(m_hashPos,m_radius);
+  for(size_t r=0; r<result.ids.size(); ++r)
   {
-    tx.setPosition(s);
+    const auto &p=result.points[r];
+    tx.setPosition(p);
     data.push_back(m_hashPos);
-    data.push_back(s);
+    data.push_back(p);
     ngl::ShaderLib::setUniform("MVP",m_projection*m_view*m_mouseGlobalTX*tx.getMatrix());
     ngl::ShaderLib::setUniform("colour",1.0f,0.0f,0.0f);
     ngl::VAOPrimitives::draw("cube");
+    ++found;
   }
 
 
@@ -154,8 +175,10 @@ void NGLScene::paintGL()
   text = fmt::format("Position [{},{},{}] Dimension {} ", m_hashPos.m_x, m_hashPos.m_y, m_hashPos.m_z,m_dim);
   m_text->renderText(10, 680, text);
   
-  text = fmt::format("Num Points {} Hash Size {} Found {} ",m_points.size(),m_hash->size(), spheres.size());
+  text = fmt::format("Num Points {} Hash Size {} Cell Size {:.2f} Found {} ",m_points.size(),m_hash->size(),m_hash->cellSize(), found);
   m_text->renderText(10, 660, text);
+  text = fmt::format("Allocations last build {} ",m_hash->allocationsLastBuild());
+  m_text->renderText(10, 640, text);
   
 
 
@@ -183,10 +206,12 @@ void NGLScene::keyPressEvent(QKeyEvent *_event)
   case Qt::Key_Equal :
     m_radius+=1.0f;
     std::clamp(m_radius,2.0f,20.0f);
+    m_rebuildHash=true;
     break;
   case Qt::Key_Minus :
     m_radius-=1.0f;
     std::clamp(m_radius,2.0f,20.0f);
+    m_rebuildHash=true;
     break;
 
 
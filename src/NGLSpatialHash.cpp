@@ -0,0 +1,4 @@
+#include "NGLSpatialHash.h"
+
+// the demo's ngl::Vec3 hash is compiled once here
+template class BasicSpatialHash<ngl::Vec3>;
@@ -0,0 +1,3 @@
+#include "QueryCache.h"
+
+template class BasicQueryCache<Vec3f>;
@@ -0,0 +1,95 @@
+#include "SpatialHashStats.h"
+
+#if SPATIALHASH_STATS
+#include <algorithm>
+#include <functional>
+#include <iomanip>
+#include <thread>
+
+namespace spatialHashDetail
+{
+  QueryStats StatsRecorder::queryStats() const noexcept
+  {
+    QueryStats stats;
+    stats.queries = m_queries.load(std::memory_order_relaxed);
+    stats.cellsVisited = m_cellsVisited.load(std::memory_order_relaxed);
+    stats.emptyProbes = m_emptyProbes.load(std::memory_order_relaxed);
+    stats.candidates = m_candidates.load(std::memory_order_relaxed);
+    stats.accepted = m_accepted.load(std::memory_order_relaxed);
+    stats.nanoseconds = m_nanoseconds.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+  void StatsRecorder::addQuery(const QueryStats& query) noexcept
+  {
+    m_queries.fetch_add(query.queries, std::memory_order_relaxed);
+    m_cellsVisited.fetch_add(query.cellsVisited, std::memory_order_relaxed);
+    m_emptyProbes.fetch_add(query.emptyProbes, std::memory_order_relaxed);
+    m_candidates.fetch_add(query.candidates, std::memory_order_relaxed);
+    m_accepted.fetch_add(query.accepted, std::memory_order_relaxed);
+    m_nanoseconds.fetch_add(query.nanoseconds, std::memory_order_relaxed);
+  }
+
+  void StatsRecorder::addEvent(const char* name, const char* category, std::chrono::steady_clock::time_point start,
+                               std::chrono::steady_clock::time_point end) noexcept
+  {
+    using std::chrono::duration_cast;
+    using std::chrono::nanoseconds;
+    // small stable numbers for the trace viewer's thread rows
+    auto thread = static_cast<uint32_t>(std::hash<std::thread::id>()(std::this_thread::get_id()) % 100000);
+    TraceEvent event{name, category, duration_cast<nanoseconds>(start - m_origin).count(), duration_cast<nanoseconds>(end - start).count(), thread};
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // a ring once full so a long run keeps its latest builds
+    if(m_events.size() < maxEvents)
+    {
+      m_events.push_back(event);
+    }
+    else
+    {
+      m_events[m_nextEvent] = event;
+    }
+    m_nextEvent = (m_nextEvent + 1) % maxEvents;
+  }
+
+  std::vector<TraceEvent> StatsRecorder::events() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<TraceEvent> events = m_events;
+    if(events.size() == maxEvents)
+    {
+      std::rotate(events.begin(), events.begin() + static_cast<std::ptrdiff_t>(m_nextEvent), events.end());
+    }
+    return events;
+  }
+
+  void StatsRecorder::reset() noexcept
+  {
+    m_queries.store(0, std::memory_order_relaxed);
+    m_cellsVisited.store(0, std::memory_order_relaxed);
+    m_emptyProbes.store(0, std::memory_order_relaxed);
+    m_candidates.store(0, std::memory_order_relaxed);
+    m_accepted.store(0, std::memory_order_relaxed);
+    m_nanoseconds.store(0, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_events.clear();
+    m_nextEvent = 0;
+  }
+
+  void StatsRecorder::writeChromeTrace(std::ostream& out) const
+  {
+    // complete ("X") events with microsecond times, nesting shows as stacked slices
+    auto flags = out.flags();
+    out << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    for(const auto& event : events())
+    {
+      out << (first ? "\n" : ",\n") << "{\"name\":\"" << event.name << "\",\"cat\":\"" << event.category
+          << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread << ",\"ts\":" << event.start / 1000.0
+          << ",\"dur\":" << event.duration / 1000.0 << '}';
+      first = false;
+    }
+    out << "\n]}\n";
+    out.flags(flags);
+  }
+}
+#endif
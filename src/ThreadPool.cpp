@@ -0,0 +1,106 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+namespace
+{
+  // set while a thread is running a pool job so nested parallelFor calls run inline
+  thread_local bool t_inPool = false;
+}
+
+  ThreadPool::ThreadPool(size_t numThreads)
+  {
+    numThreads = std::max<size_t>(numThreads, 1);
+    for(size_t i = 1; i < numThreads; ++i)
+    {
+      m_workers.emplace_back([this, i]{ workerLoop(i); });
+    }
+  }
+
+  ThreadPool::~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_wake.notify_all();
+    for(auto& t : m_workers)
+    {
+      t.join();
+    }
+  }
+
+  ThreadPool& ThreadPool::global()
+  {
+    static ThreadPool pool;
+    return pool;
+  }
+
+  void ThreadPool::parallelFor(size_t count, const RangeFunc& func, size_t minChunk) noexcept
+  {
+    if(count == 0)
+    {
+      return;
+    }
+    minChunk = std::max<size_t>(minChunk, 1);
+    if(m_workers.empty() || count <= minChunk || t_inPool)
+    {
+      func(0, count, 0);
+      return;
+    }
+    // only one job at a time, other callers wait here
+    std::lock_guard<std::mutex> job(m_jobMutex);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_func = &func;
+      m_count = count;
+      // a few chunks per thread so uneven work still balances
+      m_chunk = std::max(minChunk, count / (numThreads() * 4));
+      m_next = 0;
+      m_active = m_workers.size();
+      ++m_generation;
+    }
+    m_wake.notify_all();
+    t_inPool = true;
+    runChunks(0);
+    t_inPool = false;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this]{ return m_active == 0; });
+    m_func = nullptr;
+  }
+
+  void ThreadPool::workerLoop(size_t worker) noexcept
+  {
+    t_inPool = true;
+    size_t seen = 0;
+    for(;;)
+    {
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wake.wait(lock, [&]{ return m_stop || m_generation != seen; });
+        if(m_stop)
+        {
+          return;
+        }
+        seen = m_generation;
+      }
+      runChunks(worker);
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if(--m_active == 0)
+      {
+        m_done.notify_one();
+      }
+    }
+  }
+
+  void ThreadPool::runChunks(size_t worker) noexcept
+  {
+    for(;;)
+    {
+      size_t begin = m_next.fetch_add(m_chunk);
+      if(begin >= m_count)
+      {
+        return;
+      }
+      (*m_func)(begin, std::min(begin + m_chunk, m_count), worker);
+    }
+  }
@@ -0,0 +1,3 @@
+#include "TiledSpatialHash.h"
+
+template class BasicTiledSpatialHash<Vec3f>;
@@ -0,0 +1,1223 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory_resource>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "DistanceFilter.h"
+#include "FlatCellMap.h"
+#include "QueryCache.h"
+#include "SpatialHash.h"
+#include "BufferedSpatialHash.h"
+#include "TiledSpatialHash.h"
+
+// only the Vec3f hash is compiled in the library, these make sure every member of the double
+// and 32 bit key instances compiles too, BasicSpatialHashTypes below runs them
+template class BasicSpatialHash<std::array<double, 2>>;
+template class BasicSpatialHash<Vec3f, 3, uint32_t>;
+
+// every query is checked against a brute force search over a copy of the points, live[i] false
+// once point i is removed
+namespace
+{
+  using Storage = SpatialHash::Storage;
+  using CellKey = SpatialHash::CellKey;
+
+  struct Reference
+  {
+    std::vector<Vec3f> points;
+    std::vector<bool> live;
+  };
+
+  float distanceSquared(const Vec3f& a, const Vec3f& b)
+  {
+    float dx = a.m_x - b.m_x;
+    float dy = a.m_y - b.m_y;
+    float dz = a.m_z - b.m_z;
+    return dx * dx + dy * dy + dz * dz;
+  }
+
+  std::vector<Vec3f> randomPoints(size_t count, float extent, unsigned seed)
+  {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> u(-extent, extent);
+    std::vector<Vec3f> points(count);
+    for(auto& p : points)
+    {
+      p = Vec3f(u(rng), u(rng), u(rng));
+    }
+    return points;
+  }
+
+  std::vector<uint32_t> sorted(std::vector<uint32_t> ids)
+  {
+    std::sort(ids.begin(), ids.end());
+    return ids;
+  }
+
+  std::vector<Vec3f> sorted(std::vector<Vec3f> points)
+  {
+    std::sort(points.begin(), points.end(), [](const Vec3f& a, const Vec3f& b)
+    {
+      return std::tie(a.m_x, a.m_y, a.m_z) < std::tie(b.m_x, b.m_y, b.m_z);
+    });
+    return points;
+  }
+
+  std::vector<uint32_t> bruteRadius(const Reference& ref, const Vec3f& centre, float radius)
+  {
+    std::vector<uint32_t> ids;
+    for(uint32_t i = 0; i < ref.points.size(); ++i)
+    {
+      if(ref.live[i] && distanceSquared(ref.points[i], centre) <= radius * radius)
+      {
+        ids.push_back(i);
+      }
+    }
+    return ids;
+  }
+
+  std::vector<uint32_t> bruteBox(const Reference& ref, const Vec3f& lower, const Vec3f& upper)
+  {
+    std::vector<uint32_t> ids;
+    for(uint32_t i = 0; i < ref.points.size(); ++i)
+    {
+      bool inside = ref.live[i];
+      for(size_t axis = 0; axis < 3; ++axis)
+      {
+        inside = inside && ref.points[i][axis] >= lower[axis] && ref.points[i][axis] <= upper[axis];
+      }
+      if(inside)
+      {
+        ids.push_back(i);
+      }
+    }
+    return ids;
+  }
+
+  /// the ids within thickness of the segment and the t each projects to, the same sums as the hash
+  std::vector<std::pair<uint32_t, float>> bruteSegment(const Reference& ref, const Vec3f& a, const Vec3f& b, float thickness)
+  {
+    float direction[3] = {b.m_x - a.m_x, b.m_y - a.m_y, b.m_z - a.m_z};
+    float lengthSquared = direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2];
+    std::vector<std::pair<uint32_t, float>> hits;
+    for(uint32_t i = 0; i < ref.points.size(); ++i)
+    {
+      if(!ref.live[i])
+      {
+        continue;
+      }
+      const Vec3f& p = ref.points[i];
+      float t = 0;
+      if(lengthSquared > 0)
+      {
+        for(size_t axis = 0; axis < 3; ++axis)
+        {
+          t += (p[axis] - a[axis]) * direction[axis];
+        }
+        t = std::clamp(t / lengthSquared, 0.0f, 1.0f);
+      }
+      float d = 0;
+      for(size_t axis = 0; axis < 3; ++axis)
+      {
+        float s = p[axis] - a[axis] - t * direction[axis];
+        d += s * s;
+      }
+      if(d <= thickness * thickness)
+      {
+        hits.emplace_back(i, t);
+      }
+    }
+    return hits;
+  }
+
+  std::set<std::pair<uint32_t, uint32_t>> brutePairs(const Reference& ref, float radius)
+  {
+    std::set<std::pair<uint32_t, uint32_t>> pairs;
+    for(uint32_t a = 0; a < ref.points.size(); ++a)
+    {
+      for(uint32_t b = a + 1; b < ref.points.size() && ref.live[a]; ++b)
+      {
+        if(ref.live[b] && distanceSquared(ref.points[a], ref.points[b]) <= radius * radius)
+        {
+          pairs.emplace(a, b);
+        }
+      }
+    }
+    return pairs;
+  }
+
+  /// run every query type at the given centres and compare with the brute force
+  void expectMatches(const SpatialHash& hash, const Reference& ref, const std::vector<Vec3f>& centres)
+  {
+    size_t numLive = static_cast<size_t>(std::count(ref.live.begin(), ref.live.end(), true));
+    ASSERT_EQ(hash.numPoints(), numLive);
+    for(size_t i = 0; i < centres.size(); ++i)
+    {
+      const Vec3f& c = centres[i];
+      float radius = i % 3 == 0 ? 0.4f : (i % 3 == 1 ? 1.3f : 3.5f);
+      std::vector<uint32_t> ids;
+      hash.queryIndices(c, radius, ids);
+      auto want = bruteRadius(ref, c, radius);
+      EXPECT_EQ(sorted(ids), want) << "radius " << radius << " query " << i;
+      // the visitor hands over the position stored for each id
+      hash.forEachInRadius(c, radius, [&](uint32_t id, const Vec3f& p)
+      {
+        ASSERT_LT(id, ref.points.size());
+        EXPECT_TRUE(ref.live[id]);
+        EXPECT_EQ(p, ref.points[id]);
+      });
+      std::vector<Vec3f> positions;
+      for(auto id : want)
+      {
+        positions.push_back(ref.points[id]);
+      }
+      EXPECT_EQ(sorted(hash.query(c, radius)), sorted(positions)) << "radius " << radius << " query " << i;
+
+      Vec3f lower(c.m_x - radius, c.m_y - 0.5f * radius, c.m_z - 2.0f * radius);
+      Vec3f upper(c.m_x + radius, c.m_y + 0.5f * radius, c.m_z + 0.2f);
+      ids.clear();
+      hash.queryBox(lower, upper, ids);
+      EXPECT_EQ(sorted(ids), bruteBox(ref, lower, upper)) << "box query " << i;
+
+      const Vec3f& end = centres[(i + 1) % centres.size()];
+      float thickness = i % 2 ? 0.3f : 1.1f;
+      auto hits = bruteSegment(ref, c, end, thickness);
+      std::vector<uint32_t> onSegment;
+      for(const auto& hit : hits)
+      {
+        onSegment.push_back(hit.first);
+      }
+      ids.clear();
+      hash.querySegment(c, end, thickness, ids);
+      EXPECT_EQ(sorted(ids), onSegment) << "segment query " << i;
+      SpatialHash::SegmentHit first;
+      bool found = hash.firstOnSegment(c, end, thickness, first);
+      ASSERT_EQ(found, !hits.empty()) << "first on segment " << i;
+      if(found)
+      {
+        float nearest = std::min_element(hits.begin(), hits.end(), [](const auto& x, const auto& y){ return x.second < y.second; })->second;
+        EXPECT_EQ(first.t, nearest) << "first on segment " << i;
+      }
+
+      size_t k = 1 + i % 12;
+      auto nearest = hash.kNearest(c, k);
+      std::vector<float> distances;
+      for(uint32_t id = 0; id < ref.points.size(); ++id)
+      {
+        if(ref.live[id])
+        {
+          distances.push_back(distanceSquared(ref.points[id], c));
+        }
+      }
+      std::sort(distances.begin(), distances.end());
+      distances.resize(std::min(k, distances.size()));
+      ASSERT_EQ(nearest.size(), distances.size()) << "kNearest " << i;
+      for(size_t n = 0; n < nearest.size(); ++n)
+      {
+        EXPECT_TRUE(ref.live[nearest[n].id]);
+        EXPECT_EQ(nearest[n].distanceSquared, distances[n]) << "kNearest " << i << " rank " << n;
+        EXPECT_EQ(nearest[n].distanceSquared, distanceSquared(ref.points[nearest[n].id], c));
+      }
+    }
+  }
+
+  void expectPairsMatch(const SpatialHash& hash, const Reference& ref, float radius)
+  {
+    auto want = brutePairs(ref, radius);
+    std::set<std::pair<uint32_t, uint32_t>> got;
+    size_t calls = 0;
+    hash.forEachPairWithin(radius, [&](uint32_t a, uint32_t b, const Vec3f&, const Vec3f&)
+    {
+      ++calls;
+      got.emplace(std::min(a, b), std::max(a, b));
+    });
+    EXPECT_EQ(calls, got.size()) << "a pair was reported twice";
+    EXPECT_EQ(got, want);
+
+    SpatialHash::NeighbourList list;
+    hash.buildNeighbourList(radius, list);
+    EXPECT_EQ(list.numPairs(), want.size());
+    std::set<std::pair<uint32_t, uint32_t>> rows;
+    for(uint32_t id = 0; id + 1 < list.offsets.size(); ++id)
+    {
+      for(size_t n = list.offsets[id]; n < list.offsets[id + 1]; ++n)
+      {
+        if(id < list.indices[n])
+        {
+          rows.emplace(id, list.indices[n]);
+        }
+      }
+    }
+    EXPECT_EQ(rows, want);
+  }
+}
+
+class SpatialHashModes : public ::testing::TestWithParam<std::tuple<Storage, CellKey>>
+{
+protected:
+  void SetUp() override
+  {
+    m_ref.points = randomPoints(1500, 8.0f, 7);
+    m_ref.live.assign(m_ref.points.size(), true);
+    m_centres = randomPoints(60, 9.0f, 11);
+    // a centre far outside the points and one on a point
+    m_centres.push_back(Vec3f(40.0f, -30.0f, 25.0f));
+    m_centres.push_back(m_ref.points[3]);
+  }
+
+  Storage storage() const { return std::get<0>(GetParam()); }
+  CellKey cellKey() const { return std::get<1>(GetParam()); }
+
+  Reference m_ref;
+  std::vector<Vec3f> m_centres;
+};
+
+TEST_P(SpatialHashModes, build)
+{
+  SpatialHash hash(1.0f, storage(), cellKey());
+  hash.build(m_ref.points);
+  expectMatches(hash, m_ref, m_centres);
+  expectPairsMatch(hash, m_ref, 0.6f);
+  // a rebuild replaces the contents
+  Reference moved{randomPoints(800, 5.0f, 8), std::vector<bool>(800, true)};
+  hash.build(moved.points);
+  expectMatches(hash, moved, m_centres);
+  hash.build(nullptr, 0);
+  EXPECT_TRUE(hash.query(m_ref.points[0], 100.0f).empty());
+}
+
+TEST_P(SpatialHashModes, buildIndexed)
+{
+  // only the ids are stored, the positions are read from m_ref.points
+  SpatialHash hash(1.0f, storage(), cellKey());
+  hash.buildIndexed(m_ref.points);
+  expectMatches(hash, m_ref, m_centres);
+}
+
+TEST_P(SpatialHashModes, insert)
+{
+  SpatialHash hash(1.0f, storage(), cellKey());
+  for(uint32_t i = 0; i < m_ref.points.size(); ++i)
+  {
+    EXPECT_EQ(hash.insert(m_ref.points[i]), i);
+  }
+  hash.commit();
+  expectMatches(hash, m_ref, m_centres);
+}
+
+TEST_P(SpatialHashModes, commitTwice)
+{
+  // points committed earlier are sorted in again with the new ones
+  SpatialHash hash(1.0f, storage(), cellKey());
+  for(size_t i = 0; i < m_ref.points.size(); ++i)
+  {
+    hash.insert(m_ref.points[i]);
+    if(i == m_ref.points.size() / 2)
+    {
+      hash.commit();
+    }
+  }
+  hash.commit();
+  expectMatches(hash, m_ref, m_centres);
+  hash.clear();
+  EXPECT_TRUE(hash.query(m_ref.points[0], 100.0f).empty());
+}
+
+TEST_P(SpatialHashModes, update)
+{
+  SpatialHash hash(1.0f, storage(), cellKey());
+  hash.build(m_ref.points);
+  std::mt19937 rng(5);
+  std::uniform_real_distribution<float> jitter(-0.05f, 0.05f);
+  std::uniform_real_distribution<float> far(-12.0f, 12.0f);
+  for(uint32_t id = 0; id < m_ref.points.size(); id += 7)
+  {
+    // alternate small moves, which mostly stay in their cell, with moves anywhere, some of them
+    // outside the box of the build
+    Vec3f& p = m_ref.points[id];
+    p = id % 2 ? Vec3f(p.m_x + jitter(rng), p.m_y + jitter(rng), p.m_z + jitter(rng)) : Vec3f(far(rng), far(rng), far(rng));
+    hash.update(id, p);
+  }
+  expectMatches(hash, m_ref, m_centres);
+  expectPairsMatch(hash, m_ref, 0.6f);
+}
+
+TEST_P(SpatialHashModes, applyMoves)
+{
+  SpatialHash hash(1.0f, storage(), cellKey());
+  hash.build(m_ref.points);
+  std::mt19937 rng(6);
+  std::uniform_real_distribution<float> jitter(-0.3f, 0.3f);
+  for(auto& p : m_ref.points)
+  {
+    p = Vec3f(p.m_x + jitter(rng), p.m_y + jitter(rng), p.m_z + jitter(rng));
+  }
+  hash.applyMoves(m_ref.points);
+  expectMatches(hash, m_ref, m_centres);
+  expectPairsMatch(hash, m_ref, 0.6f);
+
+  // a few points moved by id, some far outside the points
+  std::vector<uint32_t> ids;
+  std::vector<Vec3f> positions;
+  std::uniform_real_distribution<float> far(-14.0f, 14.0f);
+  for(uint32_t id = 1; id < m_ref.points.size(); id += 13)
+  {
+    m_ref.points[id] = Vec3f(far(rng), far(rng), far(rng));
+    ids.push_back(id);
+    positions.push_back(m_ref.points[id]);
+  }
+  hash.applyMoves(ids.data(), positions.data(), ids.size());
+  expectMatches(hash, m_ref, m_centres);
+  expectPairsMatch(hash, m_ref, 0.6f);
+
+  // ids listed several times in one batch end up at their last position, some staying in their
+  // cell and some leaving it
+  ids.clear();
+  positions.clear();
+  for(int pass = 0; pass < 3; ++pass)
+  {
+    for(uint32_t id = 2; id < m_ref.points.size(); id += 5)
+    {
+      const Vec3f& p = m_ref.points[id];
+      ids.push_back(id);
+      positions.push_back(pass == 1 ? Vec3f(far(rng), far(rng), far(rng)) : Vec3f(p.m_x + jitter(rng), p.m_y, p.m_z));
+    }
+  }
+  for(size_t i = 0; i < ids.size(); ++i)
+  {
+    m_ref.points[ids[i]] = positions[i];
+  }
+  hash.applyMoves(ids.data(), positions.data(), ids.size());
+  expectMatches(hash, m_ref, m_centres);
+  expectPairsMatch(hash, m_ref, 0.6f);
+}
+
+TEST_P(SpatialHashModes, remove)
+{
+  SpatialHash hash(1.0f, storage(), cellKey());
+  hash.build(m_ref.points);
+  for(uint32_t id = 2; id < m_ref.points.size(); id += 9)
+  {
+    hash.remove(id);
+    m_ref.live[id] = false;
+  }
+  expectMatches(hash, m_ref, m_centres);
+  expectPairsMatch(hash, m_ref, 0.6f);
+  // moves after removals, then more points
+  for(uint32_t id = 0; id < m_ref.points.size(); id += 11)
+  {
+    if(m_ref.live[id])
+    {
+      m_ref.points[id] = Vec3f(-m_ref.points[id].m_y, m_ref.points[id].m_x, 0.5f * m_ref.points[id].m_z);
+      hash.update(id, m_ref.points[id]);
+    }
+  }
+  for(const auto& p : randomPoints(100, 10.0f, 8))
+  {
+    EXPECT_EQ(hash.insert(p), m_ref.points.size());
+    m_ref.points.push_back(p);
+    m_ref.live.push_back(true);
+  }
+  hash.commit();
+  expectMatches(hash, m_ref, m_centres);
+}
+
+TEST_P(SpatialHashModes, insertConcurrent)
+{
+  SpatialHash hash(1.0f, storage(), cellKey());
+  hash.reserveConcurrent(m_ref.points.size());
+  std::vector<std::thread> threads;
+  std::vector<uint32_t> idOf(m_ref.points.size());
+  for(size_t t = 0; t < 4; ++t)
+  {
+    threads.emplace_back([&, t]
+    {
+      for(size_t i = t; i < m_ref.points.size(); i += 4)
+      {
+        idOf[i] = hash.insertConcurrent(m_ref.points[i]);
+      }
+    });
+  }
+  for(auto& thread : threads)
+  {
+    thread.join();
+  }
+  hash.commit();
+  // the ids are handed out in whatever order the threads got there
+  Reference byId;
+  byId.points.resize(m_ref.points.size());
+  byId.live.assign(m_ref.points.size(), true);
+  for(size_t i = 0; i < m_ref.points.size(); ++i)
+  {
+    ASSERT_LT(idOf[i], m_ref.points.size());
+    byId.points[idOf[i]] = m_ref.points[i];
+  }
+  expectMatches(hash, byId, m_centres);
+}
+
+TEST_P(SpatialHashModes, kNearestBatch)
+{
+  SpatialHash hash(1.0f, storage(), cellKey());
+  hash.build(m_ref.points);
+  SpatialHash::BatchResult batch;
+  hash.kNearestBatch(m_centres.data(), m_centres.size(), 5, batch);
+  ASSERT_EQ(batch.offsets.size(), m_centres.size() + 1);
+  for(size_t i = 0; i < m_centres.size(); ++i)
+  {
+    auto nearest = hash.kNearest(m_centres[i], 5);
+    ASSERT_EQ(batch.count(i), nearest.size());
+    for(size_t n = 0; n < nearest.size(); ++n)
+    {
+      EXPECT_EQ(distanceSquared(batch.neighbours[batch.offsets[i] + n], m_centres[i]), nearest[n].distanceSquared);
+    }
+  }
+}
+
+TEST_P(SpatialHashModes, queryCache)
+{
+  SpatialHash hash(1.0f, storage(), cellKey());
+  hash.build(m_ref.points);
+  QueryCache cache(hash);
+  std::mt19937 rng(9);
+  std::uniform_real_distribution<float> step(-0.2f, 0.2f);
+  Vec3f probe(0.0f, 0.0f, 0.0f);
+  for(int frame = 0; frame < 120; ++frame)
+  {
+    probe = Vec3f(probe.m_x + step(rng), probe.m_y + step(rng), probe.m_z + step(rng));
+    if(frame % 20 == 10)
+    {
+      for(uint32_t id = frame; id < m_ref.points.size(); id += 17)
+      {
+        m_ref.points[id] = Vec3f(m_ref.points[id].m_x + step(rng) * 10.0f, m_ref.points[id].m_y, m_ref.points[id].m_z);
+      }
+      hash.applyMoves(m_ref.points);
+    }
+    const auto& result = cache.query(probe, 2.0f);
+    EXPECT_EQ(sorted(result.ids), bruteRadius(m_ref, probe, 2.0f)) << "frame " << frame;
+  }
+  EXPECT_GT(cache.stats().incremental, 0u);
+}
+
+TEST_P(SpatialHashModes, sameCellMoves)
+{
+  // every point starts at or below x = 0.5 so a move to x = 0.9 stays in its cell but leaves the
+  // box of the build, which the box, segment and nearest queries clip to
+  Reference ref;
+  for(int i = 0; i < 4; ++i)
+  {
+    for(int j = 0; j < 4; ++j)
+    {
+      ref.points.push_back(Vec3f(0.5f - 0.1f * i, 0.2f * j + 0.1f, 0.5f));
+      ref.points.push_back(Vec3f(-1.5f + 0.1f * i, -0.2f * j, -1.5f));
+    }
+  }
+  ref.live.assign(ref.points.size(), true);
+  std::vector<Vec3f> centres = {Vec3f(0.9f, 0.5f, 0.5f), Vec3f(2.0f, 0.5f, 0.5f), Vec3f(0.8f, 0.1f, 0.5f), Vec3f(-1.0f, 0.0f, -1.0f)};
+  for(int path = 0; path < 2; ++path)
+  {
+    SpatialHash hash(1.0f, storage(), cellKey());
+    hash.build(ref.points);
+    Reference moved = ref;
+    moved.points[0] = Vec3f(0.9f, 0.5f, 0.5f);
+    moved.points[2] = Vec3f(0.95f, 0.3f, 0.5f);
+    if(path == 0)
+    {
+      EXPECT_FALSE(hash.update(0, moved.points[0]));
+      EXPECT_FALSE(hash.update(2, moved.points[2]));
+    }
+    else
+    {
+      EXPECT_EQ(hash.applyMoves(moved.points), 0u);
+    }
+    std::vector<uint32_t> ids;
+    hash.queryBox(Vec3f(0.7f, 0.0f, 0.0f), Vec3f(1.0f, 1.0f, 1.0f), ids);
+    EXPECT_EQ(sorted(ids), (std::vector<uint32_t>{0, 2}));
+    ids.clear();
+    hash.querySegment(Vec3f(0.9f, -5.0f, 0.5f), Vec3f(0.9f, 5.0f, 0.5f), 0.01f, ids);
+    EXPECT_EQ(ids, std::vector<uint32_t>{0});
+    auto nearest = hash.kNearest(Vec3f(3.0f, 0.5f, 0.5f), 1);
+    ASSERT_EQ(nearest.size(), 1u);
+    EXPECT_EQ(nearest[0].id, 2u);
+    expectMatches(hash, moved, centres);
+  }
+}
+
+TEST_P(SpatialHashModes, queryBatch)
+{
+  SpatialHash hash(1.0f, storage(), cellKey());
+  hash.build(m_ref.points);
+  // one shared radius, then one per centre, reusing the result
+  SpatialHash::BatchResult batch;
+  hash.queryBatch(m_centres, 1.3f, batch);
+  ASSERT_EQ(batch.offsets.size(), m_centres.size() + 1);
+  for(size_t i = 0; i < m_centres.size(); ++i)
+  {
+    std::vector<uint32_t> ids(batch.indices.begin() + batch.offsets[i], batch.indices.begin() + batch.offsets[i + 1]);
+    EXPECT_EQ(sorted(ids), bruteRadius(m_ref, m_centres[i], 1.3f)) << "centre " << i;
+    for(size_t n = batch.offsets[i]; n < batch.offsets[i + 1]; ++n)
+    {
+      EXPECT_EQ(batch.neighbours[n], m_ref.points[batch.indices[n]]);
+    }
+  }
+  std::vector<float> radii(m_centres.size());
+  for(size_t i = 0; i < radii.size(); ++i)
+  {
+    radii[i] = 0.2f * static_cast<float>(i % 15);
+  }
+  batch.withPoints = false;
+  hash.queryBatch(m_centres.data(), m_centres.size(), radii.data(), batch);
+  ASSERT_EQ(batch.offsets.size(), m_centres.size() + 1);
+  for(size_t i = 0; i < m_centres.size(); ++i)
+  {
+    std::vector<uint32_t> ids(batch.indices.begin() + batch.offsets[i], batch.indices.begin() + batch.offsets[i + 1]);
+    EXPECT_EQ(sorted(ids), bruteRadius(m_ref, m_centres[i], radii[i])) << "centre " << i;
+  }
+}
+
+TEST_P(SpatialHashModes, cellStats)
+{
+  SpatialHash hash(1.0f, storage(), cellKey());
+  hash.build(m_ref.points);
+  std::set<std::tuple<int, int, int>> cells;
+  for(const auto& p : m_ref.points)
+  {
+    cells.emplace(static_cast<int>(std::floor(p.m_x)), static_cast<int>(std::floor(p.m_y)), static_cast<int>(std::floor(p.m_z)));
+  }
+  auto stats = hash.cellStats();
+  EXPECT_EQ(stats.points, m_ref.points.size());
+  EXPECT_EQ(stats.cells, cells.size());
+  EXPECT_LE(stats.buckets, stats.cells);
+  // the exact keys give every HashMap cell its own bucket
+  if(storage() == Storage::HashMap && cellKey() != CellKey::Hashed)
+  {
+    EXPECT_EQ(stats.sharedBuckets, 0u);
+    EXPECT_EQ(stats.wastedTests, 0u);
+  }
+}
+
+TEST_P(SpatialHashModes, queryStats)
+{
+  SpatialHash hash(1.0f, storage(), cellKey());
+  hash.build(m_ref.points);
+  hash.resetStats();
+  uint64_t found = 0;
+  for(const auto& c : m_centres)
+  {
+    std::vector<uint32_t> ids;
+    hash.queryIndices(c, 1.3f, ids);
+    found += ids.size();
+  }
+  auto stats = hash.queryStats();
+  if(spatialHashDetail::StatsRecorder::enabled)
+  {
+    EXPECT_EQ(stats.queries, m_centres.size());
+    EXPECT_EQ(stats.accepted, found);
+    EXPECT_GE(stats.candidates, stats.accepted);
+    EXPECT_GT(stats.cellsVisited, 0u);
+  }
+  else
+  {
+    EXPECT_EQ(stats.queries, 0u);
+    EXPECT_EQ(stats.accepted, 0u);
+  }
+  // the pair join counts as one query, its workers' counts included
+  hash.resetStats();
+  uint64_t pairs = 0;
+  hash.forEachPairWithin(0.6f, [&](uint32_t, uint32_t, const Vec3f&, const Vec3f&) { ++pairs; });
+  SpatialHash::NeighbourList list;
+  hash.buildNeighbourList(0.6f, list);
+  stats = hash.queryStats();
+  if(spatialHashDetail::StatsRecorder::enabled)
+  {
+    EXPECT_EQ(stats.queries, 2u);
+    EXPECT_EQ(stats.accepted, 2 * pairs);
+    EXPECT_GE(stats.candidates, stats.accepted);
+  }
+  auto cells = hash.cellStats();
+  size_t occupied = 0;
+  for(size_t b = 1; b < cells.occupancy.size(); ++b)
+  {
+    occupied += cells.occupancy[b];
+  }
+  EXPECT_EQ(occupied, cells.buckets);
+  EXPECT_GT(hash.bytesUsed(), m_ref.points.size() * sizeof(uint32_t));
+}
+
+TEST_P(SpatialHashModes, autoCellSize)
+{
+  SpatialHash hash(1.0f, storage(), cellKey());
+  hash.setAutoCellSize(true, 1.3f);
+  hash.build(m_ref.points);
+  float size = hash.cellSize();
+  EXPECT_GE(size, 2.0f * 1.3f / SpatialHash::maxCellsPerDiameter);
+  EXPECT_FLOAT_EQ(size, SpatialHash::suggestCellSize(m_ref.points.size(), Vec3f(-8.0f, -8.0f, -8.0f), Vec3f(8.0f, 8.0f, 8.0f), 1.3f));
+  expectMatches(hash, m_ref, m_centres);
+}
+
+TEST_P(SpatialHashModes, largeRadius)
+{
+  // small cells and radii spanning most of the points take the occupied cell walk
+  SpatialHash hash(0.25f, storage(), cellKey());
+  hash.build(m_ref.points);
+  for(float radius : {4.0f, 9.0f, 1000.0f})
+  {
+    for(size_t i = 0; i < m_centres.size(); i += 7)
+    {
+      std::vector<uint32_t> ids;
+      hash.queryIndices(m_centres[i], radius, ids);
+      EXPECT_EQ(sorted(ids), bruteRadius(m_ref, m_centres[i], radius)) << "radius " << radius << " query " << i;
+    }
+  }
+}
+
+TEST_P(SpatialHashModes, steadyRebuild)
+{
+  // rebuilds of the same size reuse the memory of the ones before
+  SpatialHash hash(1.0f, storage(), cellKey());
+  for(int round = 0; round < 4; ++round)
+  {
+    hash.build(m_ref.points);
+  }
+  hash.build(m_ref.points);
+  EXPECT_EQ(hash.allocationsLastBuild(), 0u);
+  expectMatches(hash, m_ref, m_centres);
+}
+
+TEST(SpatialHash, bucketResource)
+{
+  // the HashMap cells can come from a caller's resource instead of the hash's arena
+  std::pmr::unsynchronized_pool_resource pool;
+  Reference ref{randomPoints(1000, 6.0f, 3), std::vector<bool>(1000, true)};
+  SpatialHash hash(1.0f, Storage::HashMap, CellKey::Hashed, &pool);
+  hash.build(ref.points);
+  hash.build(ref.points);
+  expectMatches(hash, ref, randomPoints(30, 7.0f, 4));
+}
+
+TEST(SpatialHash, farCells)
+{
+  // cells far apart, on both sides of zero, must not share keys under the exact keys
+  std::vector<Vec3f> points = {Vec3f(-1000000.5f, 0.5f, 0.5f), Vec3f(1000000.5f, 0.5f, 0.5f),
+                                   Vec3f(0.5f, -1000000.5f, 0.5f), Vec3f(0.5f, 0.5f, 1000000.5f)};
+  for(auto key : {CellKey::Packed, CellKey::Morton})
+  {
+    for(auto storage : {Storage::HashMap, Storage::CellSorted, Storage::CellSortedSoA})
+    {
+      SpatialHash hash(1.0f, storage, key);
+      hash.build(points);
+      for(uint32_t i = 0; i < points.size(); ++i)
+      {
+        std::vector<uint32_t> ids;
+        hash.queryIndices(points[i], 0.1f, ids);
+        EXPECT_EQ(ids, std::vector<uint32_t>{i});
+      }
+    }
+  }
+}
+
+TEST(SpatialHash, arrayPoints)
+{
+  // the std::array instance answers the same as the Vec3f one in every mode
+  using ArrayHash = BasicSpatialHash<std::array<float, 3>>;
+  auto points = randomPoints(1000, 6.0f, 12);
+  auto centres = randomPoints(40, 7.0f, 13);
+  std::vector<std::array<float, 3>> arrays;
+  for(const auto& p : points)
+  {
+    arrays.push_back({p.m_x, p.m_y, p.m_z});
+  }
+  for(auto storage : {ArrayHash::Storage::HashMap, ArrayHash::Storage::CellSorted, ArrayHash::Storage::CellSortedSoA})
+  {
+    for(auto key : {ArrayHash::CellKey::Hashed, ArrayHash::CellKey::Packed, ArrayHash::CellKey::Morton})
+    {
+      ArrayHash hash(1.0f, storage, key);
+      hash.build(arrays);
+      SpatialHash reference(1.0f, static_cast<Storage>(storage), static_cast<CellKey>(key));
+      reference.build(points);
+      for(size_t i = 0; i < centres.size(); ++i)
+      {
+        float radius = 0.3f * static_cast<float>(i % 10);
+        std::vector<uint32_t> got;
+        std::vector<uint32_t> want;
+        hash.queryIndices({centres[i].m_x, centres[i].m_y, centres[i].m_z}, radius, got);
+        reference.queryIndices(centres[i], radius, want);
+        EXPECT_EQ(sorted(got), sorted(want)) << "query " << i;
+      }
+    }
+  }
+}
+
+template<typename Hash>
+struct PointOf;
+
+template<typename PointT, int Dim, typename KeyT>
+struct PointOf<BasicSpatialHash<PointT, Dim, KeyT>>
+{
+  using type = PointT;
+};
+
+template<typename Hash>
+class BasicSpatialHashTypes : public ::testing::Test
+{
+};
+
+using HashTypes = ::testing::Types<BasicSpatialHash<std::array<double, 2>>, BasicSpatialHash<Vec3f, 3, uint32_t>,
+                                   BasicSpatialHash<std::array<double, 2>, 2, uint32_t>>;
+TYPED_TEST_SUITE(BasicSpatialHashTypes, HashTypes);
+
+TYPED_TEST(BasicSpatialHashTypes, matchesBruteForce)
+{
+  // double coordinates take the scalar scans instead of DistanceFilter and 32 bit keys give the
+  // Packed and Morton keys fewer bits per axis
+  using Hash = TypeParam;
+  using PointT = typename PointOf<Hash>::type;
+  using Traits = typename Hash::Traits;
+  using Scalar = typename Hash::Scalar;
+  constexpr int dim = Traits::dim;
+  std::mt19937 rng(24);
+  std::uniform_real_distribution<Scalar> u(-1, 1);
+  auto randomPoint = [&](Scalar extent)
+  {
+    std::array<Scalar, dim> c;
+    for(auto& x : c)
+    {
+      x = extent * u(rng);
+    }
+    return Traits::make(c);
+  };
+  auto distanceSquared = [](const PointT& a, const PointT& b)
+  {
+    Scalar d = 0;
+    for(int axis = 0; axis < dim; ++axis)
+    {
+      Scalar t = Traits::get(a, axis) - Traits::get(b, axis);
+      d += t * t;
+    }
+    return d;
+  };
+  for(auto storage : {Hash::Storage::HashMap, Hash::Storage::CellSorted, Hash::Storage::CellSortedSoA})
+  {
+    for(auto key : {Hash::CellKey::Hashed, Hash::CellKey::Packed, Hash::CellKey::Morton, Hash::CellKey::Dense, Hash::CellKey::Auto})
+    {
+      std::vector<PointT> points(2000);
+      for(auto& p : points)
+      {
+        p = randomPoint(8);
+      }
+      std::vector<bool> live(points.size(), true);
+      Hash hash(1, storage, key);
+      hash.build(points);
+      auto expectMatches = [&](const char* stage)
+      {
+        for(int q = 0; q < 40; ++q)
+        {
+          PointT c = randomPoint(9);
+          Scalar radius = Scalar(0.25) * (q % 12);
+          std::vector<uint32_t> ids;
+          hash.queryIndices(c, radius, ids);
+          std::vector<uint32_t> want;
+          for(uint32_t i = 0; i < points.size(); ++i)
+          {
+            if(live[i] && distanceSquared(points[i], c) <= radius * radius)
+            {
+              want.push_back(i);
+            }
+          }
+          EXPECT_EQ(sorted(ids), want) << stage << " radius query " << q;
+
+          std::array<Scalar, dim> lower;
+          std::array<Scalar, dim> upper;
+          for(int axis = 0; axis < dim; ++axis)
+          {
+            lower[axis] = Traits::get(c, axis) - radius;
+            upper[axis] = Traits::get(c, axis) + radius / 2;
+          }
+          ids.clear();
+          hash.queryBox(Traits::make(lower), Traits::make(upper), ids);
+          want.clear();
+          for(uint32_t i = 0; i < points.size(); ++i)
+          {
+            bool inside = live[i];
+            for(int axis = 0; axis < dim; ++axis)
+            {
+              inside = inside && Traits::get(points[i], axis) >= lower[axis] && Traits::get(points[i], axis) <= upper[axis];
+            }
+            if(inside)
+            {
+              want.push_back(i);
+            }
+          }
+          EXPECT_EQ(sorted(ids), want) << stage << " box query " << q;
+
+          size_t k = 1 + q % 8;
+          auto nearest = hash.kNearest(c, k);
+          std::vector<Scalar> distances;
+          for(uint32_t i = 0; i < points.size(); ++i)
+          {
+            if(live[i])
+            {
+              distances.push_back(distanceSquared(points[i], c));
+            }
+          }
+          std::sort(distances.begin(), distances.end());
+          distances.resize(std::min(k, distances.size()));
+          ASSERT_EQ(nearest.size(), distances.size()) << stage << " kNearest " << q;
+          for(size_t n = 0; n < nearest.size(); ++n)
+          {
+            EXPECT_EQ(nearest[n].distanceSquared, distances[n]) << stage << " kNearest " << q << " rank " << n;
+          }
+        }
+
+        std::set<std::pair<uint32_t, uint32_t>> want;
+        for(uint32_t a = 0; a < points.size(); ++a)
+        {
+          for(uint32_t b = a + 1; b < points.size() && live[a]; ++b)
+          {
+            if(live[b] && distanceSquared(points[a], points[b]) <= Scalar(0.25))
+            {
+              want.emplace(a, b);
+            }
+          }
+        }
+        std::set<std::pair<uint32_t, uint32_t>> got;
+        hash.forEachPairWithin(Scalar(0.5), [&](uint32_t a, uint32_t b, const PointT&, const PointT&)
+        {
+          got.emplace(std::min(a, b), std::max(a, b));
+        });
+        EXPECT_EQ(got, want) << stage << " pairs";
+      };
+      expectMatches("build");
+      for(uint32_t id = 0; id < points.size(); id += 7)
+      {
+        points[id] = randomPoint(12);
+        hash.update(id, points[id]);
+      }
+      for(uint32_t id = 3; id < points.size(); id += 11)
+      {
+        hash.remove(id);
+        live[id] = false;
+      }
+      expectMatches("moves");
+    }
+  }
+}
+
+TEST(SpatialHash, spatialOrder)
+{
+  auto points = randomPoints(3000, 6.0f, 23);
+  auto cellOf = [](const Vec3f& p)
+  {
+    return std::make_tuple(std::floor(p.m_x), std::floor(p.m_y), std::floor(p.m_z));
+  };
+  for(auto curve : {SpatialHash::Curve::Morton, SpatialHash::Curve::Hilbert})
+  {
+    std::vector<uint32_t> order;
+    SpatialHash::spatialOrder(points, 1.0f, curve, order);
+    ASSERT_EQ(order.size(), points.size());
+    std::vector<uint32_t> ids(points.size());
+    for(uint32_t i = 0; i < ids.size(); ++i)
+    {
+      ids[i] = i;
+    }
+    EXPECT_EQ(sorted(order), ids);
+    auto reordered = points;
+    SpatialHash::permute(order, reordered);
+    for(size_t i = 0; i < order.size(); ++i)
+    {
+      ASSERT_EQ(reordered[i], points[order[i]]);
+      // points sharing a cell keep their input order
+      if(i > 0 && cellOf(reordered[i]) == cellOf(reordered[i - 1]))
+      {
+        EXPECT_LT(order[i - 1], order[i]);
+      }
+    }
+  }
+
+  // one point per cell of a 8^3 block, the Hilbert curve only steps to face neighbours
+  std::vector<Vec3f> grid;
+  for(int x = 0; x < 8; ++x)
+  {
+    for(int y = 0; y < 8; ++y)
+    {
+      for(int z = 0; z < 8; ++z)
+      {
+        grid.push_back(Vec3f(x + 0.5f, y + 0.5f, z + 0.5f));
+      }
+    }
+  }
+  std::vector<uint32_t> order;
+  SpatialHash::spatialOrder(grid, 1.0f, SpatialHash::Curve::Hilbert, order);
+  for(size_t i = 1; i < order.size(); ++i)
+  {
+    const Vec3f& a = grid[order[i - 1]];
+    const Vec3f& b = grid[order[i]];
+    EXPECT_EQ(std::fabs(a.m_x - b.m_x) + std::fabs(a.m_y - b.m_y) + std::fabs(a.m_z - b.m_z), 1.0f) << "step " << i;
+  }
+}
+
+TEST(SpatialHash, denseDomain)
+{
+  Reference ref;
+  ref.points = randomPoints(2000, 5.0f, 12);
+  ref.live.assign(ref.points.size(), true);
+  SpatialHash hash(0.5f, Storage::CellSortedSoA, CellKey::Dense);
+  // points outside the domain share its border cells
+  hash.setDomain(Vec3f(-3.0f, -3.0f, -3.0f), Vec3f(3.0f, 3.0f, 3.0f));
+  hash.build(ref.points);
+  EXPECT_TRUE(hash.dense());
+  expectMatches(hash, ref, randomPoints(40, 6.0f, 13));
+}
+
+TEST(SpatialHash, snapshot)
+{
+  Reference ref;
+  ref.points = randomPoints(3000, 6.0f, 14);
+  ref.live.assign(ref.points.size(), true);
+  std::string path = (std::filesystem::temp_directory_path() / "testSpatialHash.snap").string();
+  for(auto key : {CellKey::Hashed, CellKey::Dense})
+  {
+    for(auto storage : {Storage::CellSorted, Storage::CellSortedSoA})
+    {
+      SpatialHash hash(1.0f, storage, key);
+      hash.build(ref.points);
+      ASSERT_TRUE(hash.saveSnapshot(path));
+      SpatialHash mapped(1.0f);
+      ASSERT_TRUE(mapped.openSnapshot(path));
+      EXPECT_TRUE(mapped.mapped());
+      auto centres = randomPoints(30, 7.0f, 15);
+      expectMatches(mapped, ref, centres);
+      // the first move copies the arrays out of the file
+      Reference moved = ref;
+      moved.points[10] = Vec3f(20.0f, 0.0f, 0.0f);
+      mapped.update(10, moved.points[10]);
+      EXPECT_FALSE(mapped.mapped());
+      expectMatches(mapped, moved, centres);
+    }
+  }
+  // the HashMap storage can't be saved
+  SpatialHash hashMap(1.0f);
+  hashMap.build(ref.points);
+  EXPECT_FALSE(hashMap.saveSnapshot(path));
+  std::remove(path.c_str());
+}
+
+TEST(SpatialHash, corruptSnapshot)
+{
+  auto points = randomPoints(2000, 6.0f, 16);
+  std::string path = (std::filesystem::temp_directory_path() / "testSpatialHashCorrupt.snap").string();
+  SpatialHash hash(1.0f, Storage::CellSorted, CellKey::Packed);
+  hash.build(points);
+  ASSERT_TRUE(hash.saveSnapshot(path));
+  std::vector<char> good;
+  {
+    std::ifstream in(path, std::ios::binary);
+    good.assign(std::istreambuf_iterator<char>(in), {});
+  }
+  spatialHashDetail::SnapshotHeader header;
+  std::memcpy(&header, good.data(), sizeof(header));
+  // each corruption writes one out of range value into an array the queries index with
+  auto rejected = [&](uint64_t offset, uint32_t value)
+  {
+    auto bytes = good;
+    std::memcpy(bytes.data() + offset, &value, sizeof(value));
+    {
+      std::ofstream out(path, std::ios::binary | std::ios::trunc);
+      out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    }
+    SpatialHash mapped(1.0f);
+    return !mapped.openSnapshot(path) && mapped.numPoints() == 0;
+  };
+  EXPECT_TRUE(rejected(header.indexOffset + 4 * 100, static_cast<uint32_t>(points.size())));
+  EXPECT_TRUE(rejected(header.cellStartOffset, 1));
+  EXPECT_TRUE(rejected(header.cellStartOffset + 4 * (header.numCellStarts / 2), static_cast<uint32_t>(header.numEntries) + 1));
+  // the start of the second occupied cell
+  EXPECT_TRUE(rejected(header.cellsOffset + 2 * header.cellRecordSize - 4, static_cast<uint32_t>(header.numEntries)));
+  // and rewriting a value unchanged leaves a file that opens
+  uint32_t magic;
+  std::memcpy(&magic, good.data(), sizeof(magic));
+  EXPECT_FALSE(rejected(0, magic));
+  std::remove(path.c_str());
+}
+
+TEST(SpatialHash, tiled)
+{
+  Reference ref;
+  ref.points = randomPoints(20000, 30.0f, 17);
+  // a dense cluster inside one tile, split into several parts
+  std::mt19937 rng(18);
+  std::uniform_real_distribution<float> u(-0.1f, 0.1f);
+  for(size_t i = 0; i < 3000; ++i)
+  {
+    ref.points[i] = Vec3f(2.0f + u(rng), 2.0f + u(rng), 2.0f + u(rng));
+  }
+  ref.live.assign(ref.points.size(), true);
+  std::string directory = (std::filesystem::temp_directory_path() / "testSpatialHashTiles").string();
+  std::filesystem::remove_all(directory);
+  TiledSpatialHash::Config config;
+  config.tileCells = 8;
+  config.chunkPoints = 1000;
+  config.spillBytes = 32000;
+  config.cacheBytes = 1 << 20;
+  config.maxTilePoints = 1000;
+  TiledSpatialHash tiled(config);
+  ASSERT_TRUE(tiled.build(directory, ref.points.begin(), ref.points.end()));
+  EXPECT_EQ(tiled.numPoints(), ref.points.size());
+  EXPECT_GT(tiled.numTileParts(), tiled.numTiles());
+  TiledSpatialHash opened;
+  ASSERT_TRUE(opened.open(directory));
+  EXPECT_EQ(opened.config().tileCells, 8);
+  EXPECT_EQ(opened.config().maxTilePoints, 1000u);
+  auto centres = randomPoints(40, 30.0f, 19);
+  centres.push_back(Vec3f(2.0f, 2.0f, 2.0f));
+  for(auto* hash : {&tiled, &opened})
+  {
+    for(size_t i = 0; i < centres.size(); ++i)
+    {
+      float radius = i % 2 ? 1.0f : 4.0f;
+      std::vector<uint64_t> ids;
+      hash->queryIndices(centres[i], radius, ids);
+      std::vector<uint32_t> got(ids.begin(), ids.end());
+      EXPECT_EQ(sorted(got), bruteRadius(ref, centres[i], radius)) << "tiled query " << i;
+      EXPECT_LE(hash->residentBytes(), config.cacheBytes);
+    }
+  }
+  std::filesystem::remove_all(directory);
+}
+
+TEST(SpatialHash, buffered)
+{
+  Reference ref;
+  ref.points = randomPoints(5000, 8.0f, 20);
+  ref.live.assign(ref.points.size(), true);
+  BufferedSpatialHash buffered(1.0f);
+  buffered.rebuild(ref.points);
+  auto reader = buffered.reader();
+  auto centres = randomPoints(30, 9.0f, 21);
+  for(const auto& c : centres)
+  {
+    std::vector<uint32_t> ids;
+    reader.queryIndices(c, 1.5f, ids);
+    EXPECT_EQ(sorted(ids), bruteRadius(ref, c, 1.5f));
+  }
+  // readers keep querying while the builder publishes new generations
+  std::atomic<bool> done{false};
+  std::atomic<size_t> bad{0};
+  std::thread query([&]
+  {
+    auto r = buffered.reader();
+    while(!done.load())
+    {
+      r.read([&](const SpatialHash& hash)
+      {
+        if(hash.numPoints() != ref.points.size())
+        {
+          ++bad;
+        }
+      });
+    }
+  });
+  for(int generation = 0; generation < 10; ++generation)
+  {
+    for(auto& p : ref.points)
+    {
+      p = Vec3f(p.m_y, p.m_z, p.m_x);
+    }
+    buffered.rebuildAsync(ref.points);
+  }
+  buffered.waitForRebuilds();
+  done = true;
+  query.join();
+  EXPECT_EQ(bad.load(), 0u);
+  for(const auto& c : centres)
+  {
+    std::vector<uint32_t> ids;
+    reader.queryIndices(c, 1.5f, ids);
+    EXPECT_EQ(sorted(ids), bruteRadius(ref, c, 1.5f));
+  }
+}
+
+TEST(DistanceFilter, matchesScalar)
+{
+  // every count up to a full block so the vector kernels hit their tails
+  auto points = randomPoints(DistanceFilter::blockSize, 2.0f, 5);
+  std::vector<float> x, y, z;
+  for(const auto& p : points)
+  {
+    x.push_back(p.m_x);
+    y.push_back(p.m_y);
+    z.push_back(p.m_z);
+  }
+  uint32_t got[DistanceFilter::blockSize];
+  uint32_t want[DistanceFilter::blockSize];
+  for(uint32_t count = 0; count <= DistanceFilter::blockSize; ++count)
+  {
+    uint32_t n = DistanceFilter::filter(x.data(), y.data(), z.data(), count, 0.1f, -0.2f, 0.3f, 2.0f, got);
+    uint32_t m = DistanceFilter::scalar(x.data(), y.data(), z.data(), count, 0.1f, -0.2f, 0.3f, 2.0f, want);
+    ASSERT_EQ(n, m) << DistanceFilter::isa() << " count " << count;
+    EXPECT_TRUE(std::equal(got, got + n, want)) << DistanceFilter::isa() << " count " << count;
+  }
+}
+
+TEST(FlatCellMap, matchesMap)
+{
+  // keys from a small range so runs are long and erase has to shift entries back
+  FlatCellMap<uint64_t, std::pmr::vector<uint32_t>> map;
+  std::map<uint64_t, std::vector<uint32_t>> want;
+  std::mt19937 rng(22);
+  std::uniform_int_distribution<uint64_t> key(0, 3000);
+  for(uint32_t step = 0; step < 20000; ++step)
+  {
+    uint64_t k = key(rng);
+    if(step % 3 == 2)
+    {
+      map.erase(k);
+      want.erase(k);
+    }
+    else
+    {
+      map[k].push_back(step);
+      want[k].push_back(step);
+    }
+  }
+  ASSERT_EQ(map.size(), want.size());
+  EXPECT_LE(2 * map.size(), map.capacity());
+  for(uint64_t k = 0; k <= 3000; ++k)
+  {
+    auto* found = map.find(k);
+    auto it = want.find(k);
+    ASSERT_EQ(found != nullptr, it != want.end()) << "key " << k;
+    if(found)
+    {
+      EXPECT_TRUE(std::equal(found->begin(), found->end(), it->second.begin(), it->second.end())) << "key " << k;
+    }
+  }
+  size_t visited = 0;
+  map.forEach([&](uint64_t, const std::pmr::vector<uint32_t>&) { ++visited; });
+  EXPECT_EQ(visited, want.size());
+}
+
+std::string modeName(const ::testing::TestParamInfo<std::tuple<Storage, CellKey>>& info)
+{
+  const char* storages[] = {"HashMap", "CellSorted", "CellSortedSoA"};
+  const char* keys[] = {"Hashed", "Packed", "Morton", "Dense", "Auto"};
+  return std::string(storages[static_cast<int>(std::get<0>(info.param))]) + keys[static_cast<int>(std::get<1>(info.param))];
+}
+
+INSTANTIATE_TEST_SUITE_P(SpatialHash, SpatialHashModes,
+                         ::testing::Combine(::testing::Values(Storage::HashMap, Storage::CellSorted, Storage::CellSortedSoA),
+                                            ::testing::Values(CellKey::Hashed, CellKey::Packed, CellKey::Morton, CellKey::Dense, CellKey::Auto)),
+                         modeName);